@@ -20,35 +20,290 @@
 
        That'll use FFP floats rather than IEEE.
 
+
+       Anywhere else (or with -DHEADLESS) there are
+       no screens to open, so Shade draws into a
+       framebuffer in memory with its own polygon
+       filler and writes every frame to a file:
+
+        cc Shade.c -o shade -lm -lpthread
+
+        Usage: shade [options] InputFile
+
+          -frames n     render n frames (default 1)
+          -o pattern    output file name, printf
+                        style (default frame%04d.ppm)
+          -raw          write bare RGB bytes with no
+                        PPM header
+          -video how    write all the frames to one
+                        stream, the -o file or pipe
+                        (default - for the standard
+                        output), as y4m video at 25
+                        frames a second or bare rgb
+                        bytes, to be fed to an
+                        encoder such as ffmpeg
+          -size WxH     draw W by H pixels, up to
+                        8192x8192 (default 640x400,
+                        the Amiga's screen)
+          -aspect a     pixels are a times as wide
+                        as they are high (default 1
+                        with -size, else 0.875 as on
+                        the Amiga)
+          -zbuffer      use a depth buffer instead of
+                        sorting the faces
+          -nosimd       transform points one at a time
+                        even if the CPU has AVX2/SSE2
+          -threads n    rasterize on n threads (default
+                        one per CPU)
+          -nopipeline   finish each frame before
+                        starting on the next, rather
+                        than set the next one up on a
+                        thread of its own while this
+                        one is filled
+          -batch dir    render the frames into dir, as
+                        many at once as there are
+                        threads, each frame on a
+                        single thread
+          -stream       render a compiled mesh a piece
+                        at a time, for objects too big
+                        to hold in memory (implies
+                        -zbuffer)
+          -memcap n     keep the stream within about
+                        n megabytes
+          -nocull       don't skip parts of the object
+                        that are off the screen or
+                        facing away all at once
+          -lod          draw simpler versions of the
+                        object when it's too small on
+                        the screen for the detail to
+                        show
+          -optimize     weld points in the same place
+                        together, drop faces left with
+                        fewer than three corners, and
+                        reorder the rest to be kinder
+                        to the cache (-v says how much
+                        it saved)
+          -sort how     sort the faces with qsort or
+                        radix (the default)
+          -shading how  color each face flat (the
+                        default), gouraud: lit at each
+                        corner and blended across, or
+                        phong: lit pixel by pixel, with
+                        highlights
+          -fixed        do all the sums in whole
+                        numbers, so a frame comes out
+                        the same to the last pixel on
+                        any machine (flat shading,
+                        whole objects only)
+          -v            say how long things took
+
+        shade compile InputFile MeshFile
+
+       writes the object out again in a binary form
+       that Shade can map straight into memory and
+       use as it is, rather than parse, which takes
+       the same time whatever the size of the object.
+       Give Shade the mesh file in place of the
+       InputFile to use it.  With -optimize the
+       object is optimized before it's written.
+
+       The InputFile can also be a scene: a text
+       file that names each object once and then
+       places as many copies of it as it likes.
+       Each object is read in and got ready only
+       once, however many copies there are.
+
+        # a comment
+        mesh  NAME File
+        place NAME X Y Z [Heading Pitch Roll [Scale]]
+
+       File is an InputFile or mesh file, relative
+       to the scene's directory.  X, Y and Z are in
+       the same units as the points of an InputFile,
+       and the copy is turned Roll degrees about the
+       x axis, Pitch about y and Heading about z,
+       in that order, and made Scale times as big.
+       A scene can't be streamed, compiled or drawn
+       with -fixed.
+
+        shade bench [options] [InputFile...]
+
+       times each stage of drawing a frame (loading,
+       transforming, culling, sorting, lighting and
+       filling) for each InputFile, or without any,
+       for the objects that come with Shade and some
+       big generated spheres.  It takes the same
+       options as drawing, plus
+
+          -runs n       time each object n times
+                        (default 5)
+
+       and draws 16 frames a run unless -frames says
+       otherwise.  -size can list several sizes, as
+       in -size 640x400,1920x1080,7680x4320, to time
+       every object at each of them.
+
+        shade generate [-seed n] Shape Faces OutputFile
+
+       makes up an object of about Faces faces, for
+       timing Shade on objects of any size.  Shape is
+       sphere, blimp, torus or terrain, whose hills
+       and valleys come from the seed (default 1).
+       Faces can be written 1e6 and so on, up to
+       5e8.  An OutputFile ending in .shb is written
+       as a compiled mesh, anything else as an
+       InputFile.  Either way the object goes
+       straight to the file without being held in
+       memory, and the same options always make
+       exactly the same file.
+
+        shade serve [options] Socket
+
+       keeps running, drawing pictures for anyone
+       who asks through the Unix socket Socket.
+       Each request is a line
+
+        render File [from X Y Z] [at X Y Z] [up X Y Z]
+                    [light X Y Z] [size WxH] [png]
+
+       and the answer is a line "OK n" and then the n
+       bytes of the picture, a PPM or (uncompressed)
+       PNG, or a line "ERROR" and what went wrong.
+       Anything left out is as the first frame would
+       have it.  The objects asked for are kept ready
+       to draw, up to -cache n of them (default 16),
+       and only read again if their files change.
+       Up to 64 connections are served at once, a
+       line from each in turn, so one that's slow or
+       quiet doesn't hold the others up.  A line of
+       4096 characters or more is answered with a
+       single ERROR.
+
 */
 
 
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if !defined(HEADLESS) && !defined(AMIGA) && !defined(_DCC)
+#define HEADLESS
+#endif
+
+#ifndef HEADLESS
 #include "exec/types.h"
 #include "exec/memory.h"
 #include "intuition/intuition.h"
 #include "graphics/gfxmacros.h"
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#endif
 #include <time.h>
 
+#if defined(HEADLESS) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/*  Without exec and the math libraries we need a few */
+/*  stand-ins for the Amiga names used below.         */
+
+#ifdef HEADLESS
+typedef unsigned char UBYTE;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+
+#define MEMF_PUBLIC     0
+#define FreeMem(p,n)    ((void) (n), free(p))
+
+/* Everything we allocate starts on a 64 byte         */
+/* boundary, so arrays of small structures line up    */
+/* with cache lines and SIMD loads never straddle     */
+/* one needlessly.                                    */
+
+void *AllocMem(long amount, long flags)
+{
+    void  *temp;
+
+    if (posix_memalign(&temp, 64, amount))
+        return (NULL);
+    return (temp);
+}
+
+#define fsqrt(x)        ((float) sqrt(x))
+#define fsin(x)         ((float) sin(x))
+#define fcos(x)         ((float) cos(x))
+#define ftan(x)         ((float) tan(x))
+#endif
+
 /*  These constants define the size of the            */
 /*  screen.  You can set MAXX to 320 or 640 and       */
 /*  MAXY to 200 or 400.  All the other routines       */
 /*  will adjust to these values.                      */
-
+/*  The headless version picks its size when it       */
+/*  runs, with -size and -aspect, so there they're    */
+/*  variables.  ASPECT is how much wider than it is   */
+/*  tall the whole picture looks.                     */
+
+#ifdef HEADLESS
+#define MAXX            ScreenWidth
+#define MAXY            ScreenHeight
+#define ASPECT          ScreenAspect
+#define MAX_SIZE        8192
+#else
 #define MAXX            640
 #define MAXY            400
+#define ASPECT          1.4
+#endif
 #define HALFX           (MAXX / 2)
 #define HALFY           (MAXY / 2)
 #define PI              3.14159
-#define ASPECT          1.4
+
+/*  Without -size the headless version draws the      */
+/*  Amiga's 640x400 screen, whose pixels are          */
+/*  PIXEL_ASPECT as wide as they are high; with it,   */
+/*  square ones unless -aspect says otherwise.        */
+
+#ifdef HEADLESS
+#define PIXEL_ASPECT    0.875
+
+    long        ScreenWidth = 640,
+                ScreenHeight = 400;
+    double      ScreenAspect = 1.4,
+                PixelAspect = 0.0;
+#endif
+
+/*  The headless version splits the screen into       */
+/*  square tiles this many pixels on a side, and      */
+/*  fills them in parallel.                           */
+
+#define TILE_SIZE       64
+#define TILE_AREA       (TILE_SIZE * TILE_SIZE)
+#define TILES_ACROSS    ((MAXX + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_DOWN      ((MAXY + TILE_SIZE - 1) / TILE_SIZE)
 
 /*  A few error messages                              */
 
 #define NO_MEMORY  "Could not allocate memory"
 #define BAD_FILE   "Error reading object definition"
 #define BAD_PARAM  "Parameter out of range"
+#define USAGE      "Usage: shade [options] objectfile"
 
 
 
@@ -64,10 +319,20 @@
 /* The Z coordinate is a fake - it's really just a    */
 /* positive or negative integer to tell you whether   */
 /* the point is in front of or behind you,            */
-/* respectively.                                      */
+/* respectively.  W is the real thing, or rather 1/z, */
+/* which unlike z itself can be interpolated straight */
+/* across the screen.  Only the z-buffer uses it.     */
+
+/* X and Y are 32 bits, since a point just in front   */
+/* of the viewer can land a long way off the screen.  */
+/* They're kept within COORD_LIMIT of the middle.     */
+
+#define COORD_LIMIT     16777216.0
 
     typedef struct {
-        short X,Y,Z;
+        LONG  X,Y;
+        short Z;
+        float W;
     } Display_Point;
 
 
@@ -78,11 +343,57 @@
 /*       actual vertex information.                   */
 
     typedef struct {
-        short  start,end;
-        float  distance;
+        LONG   start,end;
     } Face;
 
 
+/* Face_Info: the parts of a face that never change:  */
+/*            its centroid, its unit outer normal     */
+/*            and how many vertices it has.  These    */
+/*            are worked out once, after the object   */
+/*            is read, so each frame only has to do   */
+/*            the work that depends on the camera.    */
+
+    typedef struct {
+        Point_3D  Centroid,Normal;
+        long      Count;
+    } Face_Info;
+
+
+/* Fixed_3D: a point or vector in whole numbers, for  */
+/*           -fixed.  Points are in the units of the  */
+/*           input file, 1/FIX_SCALE of a World_Data  */
+/*           unit; unit vectors are scaled up by 2 to */
+/*           the power FIX_NORMAL or FIX_VIEW.        */
+
+    typedef struct {
+        LONG  X,Y,Z;
+    } Fixed_3D;
+
+
+/* Fixed_Info: the Face_Info of a face for -fixed,    */
+/*             worked out again from the whole        */
+/*             number points.                         */
+
+    typedef struct {
+        Fixed_3D  Centroid,Normal;
+    } Fixed_Info;
+
+
+/* Face_Key: one face's place in the drawing order,   */
+/*           and its distance from the camera.        */
+/*           Sorting these rather than Face_List      */
+/*           itself leaves Face_List alone, so it     */
+/*           can be shared by several frames.         */
+
+    typedef struct {
+        float  distance;
+        LONG   face;
+    } Face_Key;
+
+
+
+#ifndef HEADLESS
 
 /* The libraries we'll need.  With DICE we didn't     */
 /* actually have to declare these - it would handle   */
@@ -136,10 +447,114 @@
     short  *RasterBuffer1 = NULL,
            *RasterBuffer2 = NULL;
 
+#else
+
+/* Box: a rectangle of pixels, from Left,Top up to    */
+/* but not including Right,Bottom.                   */
+
+    typedef struct {
+        short  Left,Top,Right,Bottom;
+    } Box;
+
+
+/* Drawing: a face that ShowFace has decided to draw, */
+/* in the shade it should be drawn, and the box on    */
+/* screen it covers.  The headless version collects   */
+/* these for a whole frame, then fills them tile by   */
+/* tile.                                              */
+
+    typedef struct {
+        long   Face;
+        UBYTE  Shade;
+        Box    Bounds;
+    } Drawing;
+
+
+
+/* FrameBuffer: the headless stand-in for a screen.   */
+/* Each pixel is one byte holding the brightness of   */
+/* the red we would have used on the Amiga, 0 - 255.  */
+/* Depth, if there is one, holds the 1/z of whatever  */
+/* was drawn at each pixel; 0 is infinitely far away. */
+/*                                                    */
+/* Both are kept a tile at a time rather than a row   */
+/* at a time: all of tile 0, row by row, then tile 1  */
+/* and so on, the tiles going across and then down,   */
+/* so whatever DrawTile fills is one small block of   */
+/* memory however big the screen is.  The edge tiles  */
+/* are whole ones, with pixels to spare past Width    */
+/* and Height.  TILE_OFFSET is where pixel x,y is;    */
+/* Frame_Row puts a row back in order for writing it  */
+/* out.                                               */
+
+#define FRAME_PIXELS    ((long) TILES_ACROSS * TILES_DOWN * TILE_AREA)
+#define TILE_OFFSET(x,y) \
+            ((((long) (y) / TILE_SIZE) * TILES_ACROSS + (x) / TILE_SIZE) * \
+             TILE_AREA + ((y) % TILE_SIZE) * TILE_SIZE + (x) % TILE_SIZE)
+
+    typedef struct {
+        short  Width,Height;
+        UBYTE  *Pixels;
+        float  *Depth;
+    } FrameBuffer;
+
+/* How many frames to render and where to put them.   */
+
+    long   FrameCount = 1;
+    char   *OutputName = NULL,
+           *BatchDir = NULL;
+    short  RawOutput = 0,
+           VideoFormat = 0;
+    short  UseSIMD = 1;
+    short  Pipelining = 1;
+    long   Threads = 0;
+
+#endif
+
 /* The input file.                                    */
 
     FILE   *ObjectFile = 0;
 
+/* The whole of the input file, once it's loaded.     */
+
+    char   *FileData = NULL;
+    long   FileSize = 0;
+
+#ifdef HEADLESS
+
+/* A compiled mesh file starts with a Mesh_Header.    */
+/* Each of the arrays follows at Offset[] bytes from  */
+/* the start of the file, on a MESH_ALIGN boundary,   */
+/* in the form Shade keeps them in memory: World_Data */
+/* X, Y and Z, then Face_List and Connections.        */
+/* FaceSize and IndexSize are the sizes of a Face and */
+/* a connection, so a file written by a different     */
+/* build (or a machine of the other byte order, whose */
+/* Version would read backwards) is turned away       */
+/* rather than misread.                               */
+
+#define MESH_MAGIC      "SHB\032"
+#define MESH_VERSION    2
+#define MESH_ALIGN      64
+#define MESH_SECTIONS   5
+
+    typedef struct {
+        char     Magic[4];
+        int32_t  Version;
+        int32_t  TotalPoints,TotalFaces,ConnectLen;
+        int32_t  FaceSize,IndexSize;
+        int32_t  Spare;
+        int64_t  Offset[MESH_SECTIONS];
+    } Mesh_Header;
+
+/* MeshMapped is set when the object's arrays are     */
+/* pointers into a mapped mesh file, not memory of    */
+/* their own.                                         */
+
+    short  MeshMapped = 0;
+
+#endif
+
 
 /* The totals, which will also define the size of the */
 /* buffers.  TotalPoints is the total number of world */
@@ -154,9 +569,16 @@
 
 
 /* The arrays.  World_Data represents the actual data */
-/* points.                                            */
+/* points.  Rather than an array of Point_3D it's     */
+/* kept as three separate arrays of X, Y and Z, so    */
+/* the transform can load several points' worth of   */
+/* each coordinate at once.                           */
+
+    typedef struct {
+        float  *X,*Y,*Z;
+    } Point_List;
 
-    Point_3D    *World_Data = NULL;
+    Point_List  World_Data = { NULL, NULL, NULL };
 
 
 /* Face_List is an array of polygon definitions,      */
@@ -164,19 +586,323 @@
 /* array.                                             */
 
     Face        *Face_List = NULL;
+    Face_Info   *Face_Data = NULL;
+
+
+/* With -fixed, Fixed_Data holds the points as the    */
+/* whole numbers they were in the file, and           */
+/* Fixed_Faces the Fixed_Info for each face.          */
+
+    typedef struct {
+        LONG   *X,*Y,*Z;
+    } Fixed_List;
+
+    Fixed_List  Fixed_Data = { NULL, NULL, NULL };
+    Fixed_Info  *Fixed_Faces = NULL;
+
+
+/* BVH_Node: one node of a tree of clusters of faces, */
+/* built by Build_BVH so that ShowObject can skip a   */
+/* whole cluster with one test.  Min and Max bound    */
+/* all the cluster's vertices.  Center and Radius     */
+/* bound its centroids.  Every face's normal is       */
+/* within the angle whose cosine and sine are         */
+/* CosSpread and SinSpread of Axis; CosSpread is 0 if */
+/* the normals point too many ways to be any use.  A  */
+/* node's faces are Face_List[First] on, Count of     */
+/* them; Left and Right are its children, or 0 for a  */
+/* leaf.  Node 0 is the root.                         */
+
+#define CLUSTER_FACES   64
+
+    typedef struct {
+        Point_3D  Min,Max,Center,Axis;
+        float     Radius,CosSpread,SinSpread;
+        long      First,Count,Left,Right;
+    } BVH_Node;
+
+    BVH_Node    *BVH = NULL;
+    long        BVH_Nodes = 0;
 
 
 /* This array holds the points that make up each face.*/
 /* The Face_List tells where each face begins and     */
 /* ends.                                              */
 
-    short       *Connections = NULL;
+/* An object with no more than COMPACT_POINTS points  */
+/* keeps its connections as shorts (IndexSize 2),     */
+/* anything bigger as LONGs (IndexSize 4).  VERTEX(i) */
+/* reads connection i either way.  MaxFaceSize is     */
+/* the most vertices any one face has.                */
+
+#define COMPACT_POINTS  32767
+#define VERTEX(i)       (IndexSize == 2 ? ((short *) Connections)[i] \
+                                        : ((LONG *) Connections)[i])
+
+    void        *Connections = NULL;
+    short       IndexSize = 2;
+    long        MaxFaceSize = 0;
+
+
+/* Arena: one block of memory handed out a piece at a */
+/* time, front to back, by Arena_Get, and given back  */
+/* all at once.  Each piece starts on an ARENA_ALIGN  */
+/* boundary.  Anything that won't fit in the block    */
+/* gets memory of its own on the Spill list instead,  */
+/* Spilled bytes in all, so a block that was sized a  */
+/* little small still works.  Off the Amiga a block   */
+/* ARENA_HUGE or bigger is mapped on an ARENA_HUGE    */
+/* boundary, so the system can use huge pages for it. */
+
+#define ARENA_ALIGN     64
+#define ARENA_HUGE      (2L << 20)
+
+    typedef struct Spill_Block {
+        struct Spill_Block *Next;
+        long        Size;
+    } Spill_Block;
+
+    typedef struct {
+        char        *Base;
+        long        Size,Used,Spilled;
+        Spill_Block *Spill;
+    } Arena;
+
+/* MeshArena holds every array of the object: the     */
+/* points, faces and connections as read (unless      */
+/* they're mapped), and everything worked out from    */
+/* them.  Mesh_Size says how big to make it.          */
+
+    Arena       MeshArena = { NULL, 0, 0, 0, NULL };
+
+
+/* Level: one version of the object, in the same      */
+/* form as the arrays above.  Levels[0] is the        */
+/* object itself.  With -lod, Build_Levels adds       */
+/* simpler versions after it, each with at most half  */
+/* the faces of the one before, by merging all the    */
+/* vertices in each cube of a grid Cell units on a    */
+/* side into one.  Weight is how many of the          */
+/* object's own vertices each point stands for.       */
+/* Normals, if it has any, are the unit normals at    */
+/* each point, for smooth shading.                    */
+/* LEVEL_VERTEX(l,i) reads connection i of level l.   */
+
+#define MAX_LEVELS      8
+#define LOD_GRID        1024
+#define LOD_MIN_GRID    4
+#define LEVEL_VERTEX(l,i) ((l)->IndexSize == 2 ? \
+                           ((short *) (l)->Connections)[i] : \
+                           ((LONG *) (l)->Connections)[i])
+
+    typedef struct {
+        Point_List  Points,Normals;
+        long        TotalPoints,TotalFaces,ConnectLen;
+        Face        *Faces;
+        Face_Info   *Data;
+        void        *Connections;
+        short       IndexSize;
+        BVH_Node    *BVH;
+        float       Cell,*Weight;
+    } Level;
+
+    Level       Levels[MAX_LEVELS];
+    long        LevelCount = 0;
+
+/* The grid starts at LodMin.  Every point of the     */
+/* object is within LodRadius of LodCenter.           */
+
+    Point_3D    LodMin,LodCenter;
+    float       LodRadius;
+
+#ifdef HEADLESS
+
+/* Mesh: one of the objects of a scene.  The globals  */
+/* above hold whichever object is being read in or    */
+/* got ready; Keep_Mesh puts it away in its Mesh, and */
+/* Use_Mesh brings it back.  Drawing it only needs    */
+/* its Levels and Lod values, so once the scene is    */
+/* loaded the meshes just stay put, however many      */
+/* frames are drawing them at once.  Min and Max      */
+/* bound its points.                                  */
+
+    typedef struct {
+        long        TotalPoints,TotalFaces,ConnectLen,MaxFaceSize;
+        Point_List  World_Data;
+        Face        *Face_List;
+        Face_Info   *Face_Data;
+        void        *Connections;
+        short       IndexSize,MeshMapped;
+        BVH_Node    *BVH;
+        long        BVH_Nodes;
+        Level       Levels[MAX_LEVELS];
+        long        LevelCount;
+        Point_3D    LodMin,LodCenter,Min,Max;
+        float       LodRadius;
+        char        *FileData;
+        long        FileSize;
+        Arena       MeshArena;
+        char        Name[64];
+    } Mesh;
+
+/* Instance: a Mesh placed in the scene.  A point P   */
+/* of the mesh ends up at At + Scale Turn P, where    */
+/* Turn[0], [1] and [2] are the rows of a rotation.   */
+
+    typedef struct {
+        Mesh        *Object;
+        Point_3D    At,Turn[3];
+        float       Scale;
+    } Instance;
+
+    Mesh        *Mesh_List = NULL;
+    Instance    *Instance_List = NULL;
+    long        MeshCount = 0,
+                InstanceCount = 0;
+
+#endif
+
+
+/* Scratch: room for one face's display points and    */
+/* edges.  Faces can be any size, so rather than      */
+/* keep these on the stack each thread has its own,   */
+/* MaxFaceSize long, in Scratch_List[ThreadIndex].    */
+/* With smooth shading each vertex also has up to     */
+/* MAX_ATTRS values in Attrs to be carried down the   */
+/* edges, and CrossA holds them where the edges       */
+/* cross a line.  SCRATCH_SIZE is how much all that   */
+/* takes for each vertex.                             */
+
+#define MAX_ATTRS       6
+
+    typedef struct {
+        float   X,Slope,W,SlopeW;
+        LONG    Top,Bottom;
+        float   A[MAX_ATTRS],SlopeA[MAX_ATTRS];
+    } Edge;
+
+#ifdef HEADLESS
+
+/* With -fixed the edges are Fixed_Edges instead,     */
+/* and FixX and FixW hold the crossings.  Where an    */
+/* edge crosses a line, and the 1/z there, are each a */
+/* Fixed_Step: the whole part At, and Rest over Per   */
+/* left over.  A line down they go up by Step and     */
+/* Extra over Per, as in Bresenham's line drawing, so */
+/* they're always exactly what a division would give. */
+
+    typedef struct {
+        int64_t   At,Step;
+        LONG      Rest,Extra,Per;
+    } Fixed_Step;
+
+    typedef struct {
+        LONG        Top,Bottom;
+        Fixed_Step  X,W;
+    } Fixed_Edge;
+#endif
+
+    typedef struct {
+        Display_Point *Points;
+        Edge          *Edges;
+        float         *CrossX,*CrossW,*Attrs,*CrossA;
+#ifdef HEADLESS
+        LONG          *FixX,*FixW;
+        Fixed_Edge    *FixEdges;
+#endif
+    } Scratch;
+
+#ifdef HEADLESS
+#define SCRATCH_SIZE    (sizeof(Display_Point) + sizeof(Edge) + \
+                         (2 + 2 * MAX_ATTRS) * sizeof(float) + \
+                         2 * sizeof(LONG) + sizeof(Fixed_Edge))
+#else
+#define SCRATCH_SIZE    (sizeof(Display_Point) + sizeof(Edge) + \
+                         (2 + 2 * MAX_ATTRS) * sizeof(float))
+#endif
+
+    Scratch     *Scratch_List = NULL;
+    long        ScratchSlots = 0;
+
+#ifdef HEADLESS
+    __thread long ThreadIndex = 0;
+#else
+#define ThreadIndex 0
+#endif
+
+
+/* Frame: everything that changes from one frame to   */
+/*        the next.  From and V are this frame's      */
+/*        camera, Light its light, Display the world  */
+/*        data points translated into their actual    */
+/*        display positions, and Order the faces      */
+/*        sorted from farthest to nearest.  The       */
+/*        headless version also keeps the frame's     */
+/*        picture here, and the faces waiting to be   */
+/*        drawn into it.                              */
+/*       Source is where the points to transform      */
+/*       come from: World_Data, or when streaming     */
+/*       the vertices of the connections from Base    */
+/*       on.  Detail is the Level being drawn, and    */
+/*       with -lod Source is its points instead.      */
+
+/* With one of these per thread we can work on as     */
+/* many frames at once as we have threads.            */
+
+    typedef struct {
+        long          Number;
+        Point_3D      From,V[3],Light;
+        Point_List    Source;
+        long          Base;
+        Level         *Detail;
+        Display_Point *Display;
+        Face_Key      *Order;
+
+/* Spare and Buckets are room for Radix_Sort to work  */
+/* in.  SortTime and SortedFaces add up the time      */
+/* spent sorting, and how many faces it sorted.       */
+
+        Face_Key      *Spare;
+        LONG          *Buckets;
+        double        SortTime,SortedFaces;
+#ifdef HEADLESS
+        short         Busy;
+        FrameBuffer   Buffer;
+
+/* The drawings are sorted into bins, one per tile.   */
+/* Bins holds the drawing numbers for tile 0, then    */
+/* tile 1 and so on; tile t's run starts at           */
+/* BinStart[t] and ends just before BinStart[t+1].    */
+
+        Drawing       *Drawings;
+        long          DrawCount;
+        long          *Bins,*BinStart,*BinNext;
+
+/* Temp is room for what's only needed until the      */
+/* frame is done: the bins, and a row of the picture  */
+/* as it's written out.  DrawAll starts it over every */
+/* frame, so once it has grown big enough to hold a   */
+/* frame nothing more is allocated.                   */
+
+        Arena         Temp;
+
+/* With gouraud shading Bright holds how brightly     */
+/* each vertex of Detail is lit this frame.  With     */
+/* -fixed, FixFrom and FixV are From and V in whole   */
+/* numbers, and From and V are worked out from them.  */
 
+        float         *Bright;
+        Fixed_3D      FixFrom,FixV[3];
 
-/* Display represents the world data points           */
-/* translated into their actual display positions.    */
+/* In a scene, Instances is the order to draw them    */
+/* in, farthest first, found afresh each frame.       */
 
-    Display_Point *Display = NULL;
+        Face_Key      *Instances;
+#endif
+    } Frame;
+
+    Frame       *Frame_List = NULL;
+    long        FrameSlots = 0;
 
 
 /* The variables that define what the display will    */
@@ -185,10 +911,9 @@
 /* to almost anything.                                */
 
     Point_3D    At,        /* Target point            */
-                From,      /* Camera position         */
+                From,      /* Starting camera position*/
                 Light,     /* Light position          */
-                UP,        /* Vector pointing UP      */
-                V[3];      /* Transformation matrix   */
+                UP;        /* Vector pointing UP      */
 
 
 /* Multipliers that actually do several things.  They */
@@ -205,6 +930,93 @@
     float       Ambient, Diffuse, Specular, Sharpness;
 
 
+/* If ZBuffer is set, faces are drawn in whatever     */
+/* order they come and the depth buffer sorts out     */
+/* which one is in front at each pixel.  Otherwise    */
+/* they're sorted and drawn back to front.  Only the  */
+/* headless version has a depth buffer.               */
+
+    short       ZBuffer = 0;
+
+/* Shading is how the faces are colored: flat, one    */
+/* shade for all of a face as on the Amiga; phong,    */
+/* lit pixel by pixel with the normal interpolated    */
+/* from the normals at the vertices and a highlight;  */
+/* or gouraud, lit once at each vertex with the same  */
+/* sums and the light blended across the face.        */
+/* Attributes is how many values each vertex brings   */
+/* for that.  Only the headless version does anything */
+/* but flat.                                          */
+
+#define SHADE_FLAT      0
+#define SHADE_PHONG     1
+#define SHADE_GOURAUD   2
+
+    short       Shading = SHADE_FLAT,
+                Attributes = 0;
+
+/* If FixedPoint is set, everything from the camera   */
+/* to the pixels is worked out in whole numbers,      */
+/* which come out the same on any machine; floats     */
+/* can differ in the last bit from one compiler or    */
+/* CPU to the next.  Only the headless version has    */
+/* it.                                                */
+
+    short       FixedPoint = 0;
+
+/* If Verbose is set, say how long the slow parts     */
+/* took.                                              */
+
+    short       Verbose = 0;
+
+/* If Culling is set, ShowObject uses the BVH to      */
+/* skip clusters of faces it can't possibly draw.     */
+
+    short       Culling = 1;
+
+/* If LevelOfDetail is set, each frame draws the      */
+/* simplest Level whose vertices are all within       */
+/* LOD_PIXELS of where they'd be on the real object.  */
+
+#define LOD_PIXELS      1.0
+
+    short       LevelOfDetail = 0;
+
+/* If Optimizing is set, Optimize_Mesh tidies the     */
+/* object up as soon as it's read.                    */
+
+    short       Optimizing = 0;
+
+
+/* SortMethod is how the faces are sorted when there  */
+/* isn't a depth buffer: with qsort() or with a radix */
+/* sort.                                              */
+
+#define SORT_QSORT      0
+#define SORT_RADIX      1
+
+    short       SortMethod = SORT_RADIX;
+
+#define RADIX_BITS      11
+#define RADIX_SIZE      (1 << RADIX_BITS)
+#define RADIX_PASSES    3
+
+
+/* If Streaming is set, the object is drawn a piece   */
+/* at a time: StreamSlots connections' worth of       */
+/* vertices and at most StreamFaces faces.  Only the  */
+/* headless version streams.                          */
+
+#define STREAM_BLOCK    65536L
+#define STREAM_EXTRA    (4L << 20)
+#define STREAM_MAPPED   (16L << 20)
+
+    short       Streaming = 0;
+    long        StreamSlots = 1L << 20,
+                StreamFaces,
+                MemCap = 0;
+
+
 /* These are the area patterns used for dithering.    */
 
     short       EvenCheck[] = {0x5555,0xAAAA},
@@ -239,6 +1051,32 @@ void Normalize(Point_3D *v)
     v->Z /= mag;
 }
 
+/* WorldPoint: gather point i of World_Data back      */
+/* into a Point_3D.                                   */
+
+Point_3D WorldPoint(long i)
+{
+    Point_3D    p;
+
+    p.X = World_Data.X[i];
+    p.Y = World_Data.Y[i];
+    p.Z = World_Data.Z[i];
+    return (p);
+}
+
+/* LevelPoint: the same for point i of level l.       */
+
+Point_3D LevelPoint(Level *l, long i)
+{
+    Point_3D    p;
+
+    p.X = l->Points.X[i];
+    p.Y = l->Points.Y[i];
+    p.Z = l->Points.Z[i];
+    return (p);
+}
+
+
 /*  Minus: Calculate r = v1 - v2                      */
 /*         (make a vector pointing from v2 to v1)     */
 
@@ -313,7 +1151,7 @@ void RotateX(Point_3D Initial, Point_3D Center,
 {
     float   temp, sine, cosine;
 
-    Minus(Initial,Center,&Result);
+    Minus(Initial,Center,Result);
 
     sine = fsin(theta);
     cosine = fcos(theta);
@@ -400,33 +1238,245 @@ void RotateZ(Point_3D Initial, Point_3D Center,
 }
 
 
+/* Arena_Close: give back everything in arena a.      */
+
+void Arena_Close(Arena *a)
+{
+    Spill_Block *s;
+
+    while ((s = a->Spill)) {
+        a->Spill = s->Next;
+        FreeMem(s, s->Size);
+    }
+    if (a->Base) {
+#ifdef HEADLESS
+        munmap(a->Base, a->Size);
+#else
+        FreeMem(a->Base, a->Size);
+#endif
+    }
+    a->Base = NULL;
+    a->Size = a->Used = a->Spilled = 0;
+}
+
+
+/* CloseFrames: give back everything OpenFrames got.  */
+
+void CloseFrames()
+{
+    Frame       *fr;
+    long        i,points,faces;
+
+    points = Streaming ? StreamSlots : TotalPoints;
+    faces  = Streaming ? StreamFaces : TotalFaces;
+
+    for (i = 0; i < FrameSlots; i++) {
+        fr = &Frame_List[i];
+        if (Streaming && fr->Source.X) {
+            FreeMem(fr->Source.X,points*sizeof(float));
+            FreeMem(fr->Source.Y,points*sizeof(float));
+            FreeMem(fr->Source.Z,points*sizeof(float));
+        }
+        if (fr->Display)
+            FreeMem(fr->Display,points*sizeof(Display_Point));
+        if (fr->Order)
+            FreeMem(fr->Order,faces*sizeof(Face_Key));
+        if (fr->Spare) {
+            FreeMem(fr->Spare,faces*sizeof(Face_Key));
+            FreeMem(fr->Buckets,RADIX_PASSES*RADIX_SIZE*sizeof(LONG));
+        }
+#ifdef HEADLESS
+        if (fr->Buffer.Pixels)
+            FreeMem(fr->Buffer.Pixels,FRAME_PIXELS);
+        if (fr->Buffer.Depth)
+            FreeMem(fr->Buffer.Depth,FRAME_PIXELS*sizeof(float));
+        if (fr->BinStart) {
+            FreeMem(fr->BinStart,(TILES_ACROSS*TILES_DOWN+1)*sizeof(long));
+            FreeMem(fr->BinNext,TILES_ACROSS*TILES_DOWN*sizeof(long));
+        }
+        if (fr->Drawings)
+            FreeMem(fr->Drawings,faces*sizeof(Drawing));
+        Arena_Close(&fr->Temp);
+        if (fr->Bright)
+            FreeMem(fr->Bright,points*sizeof(float));
+        if (fr->Instances)
+            FreeMem(fr->Instances,InstanceCount*sizeof(Face_Key));
+#endif
+    }
+
+    FreeMem(Frame_List, FrameSlots * sizeof(Frame));
+    Frame_List = NULL;
+    FrameSlots = 0;
+
+    for (i = 0; i < ScratchSlots; i++)
+        FreeMem(Scratch_List[i].Points, MaxFaceSize * SCRATCH_SIZE);
+    FreeMem(Scratch_List, ScratchSlots * sizeof(Scratch));
+    Scratch_List = NULL;
+    ScratchSlots = 0;
+}
+
+
+/* UnloadFile: give back the copy of the input file.  */
+/* If the object was mapped from a mesh file, its     */
+/* arrays go with it.                                 */
+
+void UnloadFile()
+{
+#ifdef HEADLESS
+    munmap(FileData, FileSize);
+#else
+    FreeMem(FileData, FileSize);
+#endif
+    FileData = NULL;
+
+#ifdef HEADLESS
+    if (MeshMapped) {
+        World_Data.X = World_Data.Y = World_Data.Z = NULL;
+        Face_List = NULL;
+        Connections = NULL;
+        MeshMapped = 0;
+    }
+#endif
+}
+
+
+/* Release: when streaming, tell the system we're     */
+/* done with a piece of the mapped mesh file, so its  */
+/* pages needn't stay in memory.  Only whole pages    */
+/* inside the piece can go.  ReleasePoints and        */
+/* ReleaseFaces let go of points start to end-1, and  */
+/* faces start to end-1 with their connections.       */
+
+void Release(void *start, long length)
+{
+#ifdef HEADLESS
+    long        page = sysconf(_SC_PAGESIZE);
+    char        *first, *last;
+
+    if (!Streaming || !MeshMapped || length <= 0)
+        return;
+
+    first = (char *) (((unsigned long) start + page - 1) & ~(page - 1));
+    last  = (char *) (((unsigned long) start + length) & ~(page - 1));
+    if (last > first)
+        madvise(first, last - first, MADV_DONTNEED);
+#endif
+}
+
+
+void ReleasePoints(long start, long end)
+{
+    Release(World_Data.X + start, (end - start) * sizeof(float));
+    Release(World_Data.Y + start, (end - start) * sizeof(float));
+    Release(World_Data.Z + start, (end - start) * sizeof(float));
+}
+
+
+void ReleaseFaces(long start, long end)
+{
+    long        first = Face_List[start].start,
+                last  = Face_List[end-1].end + 1;
+
+    Release((char *) Connections + first * IndexSize,
+            (last - first) * IndexSize);
+    Release(Face_List + start, (end - start) * sizeof(Face));
+}
+
+
+/* Seconds: a clock for timing things with.  Only     */
+/* the difference between two readings means          */
+/* anything.                                          */
+
+double Seconds()
+{
+#ifdef HEADLESS
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+#else
+    return ((double) clock() / CLOCKS_PER_SEC);
+#endif
+}
+
+
+/* Free_Object: free the object and everything worked */
+/* out from it, leaving room for another one.  It all */
+/* lives in MeshArena, apart from the mapped file.    */
+
+void Free_Object()
+{
+    if (MeshMapped)
+        UnloadFile();
+    Arena_Close(&MeshArena);
+
+    World_Data.X = World_Data.Y = World_Data.Z = NULL;
+    Face_List   = NULL;
+    Face_Data   = NULL;
+    Connections = NULL;
+    BVH         = NULL;
+    BVH_Nodes   = 0;
+    Fixed_Data.X = Fixed_Data.Y = Fixed_Data.Z = NULL;
+    Fixed_Faces = NULL;
+    memset(Levels, 0, sizeof(Levels));
+    LevelCount  = 0;
+    MaxFaceSize = 0;
+}
 
 
 /* If for some reason I can't open a screen or        */
 /* something else goes haywire, I call this           */
 /* routine to notify the user and bug out cleanly     */
 
+/* Except in shade serve, which has to keep going     */
+/* whatever one request does.  There QuitJump is set  */
+/* while a request is worked on, and Quit frees       */
+/* whatever the request had and jumps back to it,     */
+/* leaving msg in QuitMessage.  Only the thread that  */
+/* set it jumps; the pool's threads still leave.      */
+
+#ifdef HEADLESS
+    __thread jmp_buf *QuitJump = NULL;
+    char        *QuitMessage = NULL;
+#endif
+
 void Quit(char *msg)
 {
+#ifdef HEADLESS
+    if (QuitJump) {
+        if (ObjectFile)
+            fclose(ObjectFile);
+        ObjectFile = 0;
+        if (Frame_List)
+            CloseFrames();
+        Free_Object();
+        if (FileData)
+            UnloadFile();
+        QuitMessage = msg;
+        longjmp(*QuitJump, 1);
+    }
+#endif
+
     /* Close the input file */
 
     if (ObjectFile)
         fclose(ObjectFile);
+    if (FileData)
+        UnloadFile();
 
     /* Free all the memory */
 
+#ifndef HEADLESS
     if (RasterBuffer1)
         FreeRaster(RasterBuffer1,MAXX,MAXY);
     if (RasterBuffer2)
         FreeRaster(RasterBuffer2,MAXX,MAXY);
-    if (Display)
-        FreeMem(Display,TotalPoints*sizeof(Display_Point));
-    if (World_Data)
-        FreeMem(World_Data,TotalPoints*sizeof(Point_3D));
-    if (Face_List)
-        FreeMem(Face_List,TotalFaces*sizeof(Face));
-    if (Connections)
-        FreeMem(Connections,ConnectLen*sizeof(short));
+#endif
+    if (Frame_List)
+        CloseFrames();
+    Free_Object();
+
+#ifndef HEADLESS
 
     /* Close the windows and screens */
 
@@ -446,6 +1496,7 @@ void Quit(char *msg)
         CloseLibrary(IntuitionBase);
     if (GfxBase)
         CloseLibrary(GfxBase);
+#endif
 
     /* Tell the user and leave */
 
@@ -469,656 +1520,6628 @@ void *GetMemory(long amount)
 }
 
 
-/*  Read the object definition from the input file.   */
-/*  The format of the definition file is as follows:  */
+/* Arena_Open: make a an empty arena with a block of  */
+/* size bytes, or none at all if size is 0.           */
 
-/*      Number of Points                              */
-/*      Number of Faces                               */
-/*      Number of connections                         */
-/*         (i.e. Faces * points per face)             */
+void Arena_Open(Arena *a, long size)
+{
+#ifdef HEADLESS
+    long        page = sysconf(_SC_PAGESIZE), extra = 0;
+    char        *p,*start;
+#endif
+
+    a->Base = NULL;
+    a->Size = a->Used = a->Spilled = 0;
+    a->Spill = NULL;
+    if (size <= 0)
+        return;
 
-/*      3D points, expressed as X Y Z.                */
-/*      Face definitions, expressed as a series of    */
-/*         vertex numbers (based at 1), with a        */
-/*         negative vertex specifying the last vertex */
-/*         in the face.                               */
+#ifdef HEADLESS
+    if (size >= ARENA_HUGE) {
+        size  = (size + ARENA_HUGE - 1) & ~(ARENA_HUGE - 1);
+        extra = ARENA_HUGE;
+    } else
+        size  = (size + page - 1) & ~(page - 1);
 
-/*  This routine also allocates memory for the world  */
-/*  coordinates, face list, and connection array.     */
+    p = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        Quit(NO_MEMORY);
 
-/*  Since my version of DICE won't scanf floating     */
-/*  point numbers yet, I had to read them in as longs */
-/*  and convert them.                                 */
+/* Map a huge page more than asked for, and trim it   */
+/* back to a huge page boundary at both ends.         */
+
+    if (extra) {
+        start = (char *) (((unsigned long) p + extra - 1) & ~(extra - 1));
+        if (start > p)
+            munmap(p, start - p);
+        if (p + extra > start)
+            munmap(start + size, p + extra - start);
+        p = start;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    a->Base = p;
+#else
+    a->Base = GetMemory(size);
+#endif
+    a->Size = size;
+}
 
-/*  Apparently there are some object formats used by  */
-/*  Amiga graphics programs that you could use with   */
-/*  this program - I'm not familiar with them, but    */
-/*  you could probably make this program read and     */
-/*  understand them.                                  */
 
+/* Arena_Get: the next amount bytes of arena a.       */
 
-void ReadObjectFile(char *fname)
+void *Arena_Get(Arena *a, long amount)
 {
-    short  FaceNum,i;
-    long   vertex;
-    long   TempX,TempY,TempZ;
+    Spill_Block *s;
+    char        *p;
+
+    amount = (amount + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1L);
+    if (a->Used + amount <= a->Size) {
+        p = a->Base + a->Used;
+        a->Used += amount;
+        return (p);
+    }
 
-    ObjectFile = fopen(fname, "r");
-    if (ObjectFile) {
-        if (fscanf(ObjectFile, "%ld",&TotalPoints)==EOF)
-            Quit(BAD_FILE);
-        if (TotalPoints < 1)
-            Quit(BAD_PARAM);
+    s = GetMemory(amount + ARENA_ALIGN);
+    s->Next = a->Spill;
+    s->Size = amount + ARENA_ALIGN;
+    a->Spill = s;
+    a->Spilled += amount;
+    return ((char *) s + ARENA_ALIGN);
+}
 
-        World_Data = GetMemory(TotalPoints*sizeof(Point_3D));
-        Display = GetMemory(TotalPoints*sizeof(Display_Point));
 
-        if (fscanf(ObjectFile, "%ld",&TotalFaces)==EOF)
-            Quit(BAD_FILE);
-        if (TotalFaces < 1)
-            Quit(BAD_PARAM);
-        Face_List = GetMemory((TotalFaces+1)*sizeof(Face));
+/* Arena_Reset: empty arena a to be used again.  If   */
+/* anything spilled, the block wasn't big enough, so  */
+/* it's swapped for one half as big again as all of   */
+/* it was.                                            */
 
-        if (fscanf(ObjectFile, "%ld",&ConnectLen)==EOF)
-            Quit(BAD_FILE);
-        if (ConnectLen < 1)
-            Quit(BAD_PARAM);
-        Connections = GetMemory(ConnectLen*sizeof(short));
+void Arena_Reset(Arena *a)
+{
+    long        size;
 
-        for (i=0; i<TotalPoints; i++) {
-            if (fscanf(ObjectFile,"%ld %ld %ld",
-                &TempX,&TempY,&TempZ)==EOF)
-                Quit(BAD_FILE);
-            World_Data[i].X = (float) (TempX / 10000.0);
-            World_Data[i].Y = (float) (TempY / 10000.0);
-            World_Data[i].Z = (float) (TempZ / 10000.0);
-        }
+    if (a->Spilled) {
+        size = a->Used + a->Spilled;
+        Arena_Close(a);
+        Arena_Open(a, size + size / 2);
+    }
+    a->Used = 0;
+}
 
-        FaceNum = 0;
-        Face_List[0].start = 0;
 
-        for (i=0; i<ConnectLen; i++) {
-            if (fscanf(ObjectFile, "%ld",&vertex)==EOF)
-                Quit(BAD_FILE);
-            if (vertex < 0) {
-                Connections[i] = (-vertex) - 1;
-                Face_List[FaceNum++].end = i;
-                Face_List[FaceNum].start = i+1;
+
+/* OpenFrames: set up n frames' worth of everything   */
+/* that changes from frame to frame.  This has to     */
+/* wait until the object has been read, since that's  */
+/* what tells us how big Display and Order will be.   */
+
+void OpenFrames(long n)
+{
+    Frame       *fr;
+    Scratch     *s;
+    long        points,faces;
+
+    points = Streaming ? StreamSlots : TotalPoints;
+    faces  = Streaming ? StreamFaces : TotalFaces;
+
+    Frame_List = GetMemory(n * sizeof(Frame));
+    memset(Frame_List, 0, n * sizeof(Frame));
+
+    for (FrameSlots = 0; FrameSlots < n; FrameSlots++) {
+        fr = &Frame_List[FrameSlots];
+        if (Streaming) {
+            fr->Source.X = GetMemory(points*sizeof(float));
+            fr->Source.Y = GetMemory(points*sizeof(float));
+            fr->Source.Z = GetMemory(points*sizeof(float));
+        } else
+            fr->Source = World_Data;
+        fr->Detail = &Levels[0];
+        fr->Display = GetMemory(points*sizeof(Display_Point));
+        if (!Streaming)
+            fr->Order = GetMemory(faces*sizeof(Face_Key));
+        if (!Streaming && !ZBuffer && SortMethod != SORT_QSORT) {
+            fr->Spare   = GetMemory(faces*sizeof(Face_Key));
+            fr->Buckets = GetMemory(RADIX_PASSES*RADIX_SIZE*sizeof(LONG));
+        }
+#ifdef HEADLESS
+        fr->Buffer.Width  = MAXX;
+        fr->Buffer.Height = MAXY;
+        fr->Buffer.Pixels = GetMemory(FRAME_PIXELS);
+        if (ZBuffer)
+            fr->Buffer.Depth = GetMemory(FRAME_PIXELS*sizeof(float));
+        fr->BinStart = GetMemory((TILES_ACROSS*TILES_DOWN+1)*sizeof(long));
+        fr->BinNext  = GetMemory(TILES_ACROSS*TILES_DOWN*sizeof(long));
+        fr->Drawings = GetMemory(faces*sizeof(Drawing));
+        if (Shading == SHADE_GOURAUD)
+            fr->Bright = GetMemory(points*sizeof(float));
+        if (InstanceCount)
+            fr->Instances = GetMemory(InstanceCount*sizeof(Face_Key));
+        Arena_Open(&fr->Temp, 2 * faces * sizeof(long) + MAXX * 4L +
+                   2 * ARENA_ALIGN);
+#endif
+    }
+
+/* And a Scratch for each thread (StartThreads makes  */
+/* Threads of them, counting this one, and the        */
+/* pipeline has one more), each one a single block    */
+/* cut up into its arrays.                            */
+
+#ifdef HEADLESS
+    n = (Threads > 1) ? Threads : 1;
+    if (Pipelining)
+        n++;
+#else
+    n = 1;
+#endif
+    Scratch_List = GetMemory(n * sizeof(Scratch));
+
+    for (ScratchSlots = 0; ScratchSlots < n; ScratchSlots++) {
+        s = &Scratch_List[ScratchSlots];
+        s->Points = GetMemory(MaxFaceSize * SCRATCH_SIZE);
+        s->Edges  = (Edge *) (s->Points + MaxFaceSize);
+        s->CrossX = (float *) (s->Edges + MaxFaceSize);
+        s->CrossW = s->CrossX + MaxFaceSize;
+        s->Attrs  = s->CrossW + MaxFaceSize;
+        s->CrossA = s->Attrs + MaxFaceSize * MAX_ATTRS;
+#ifdef HEADLESS
+        s->FixX   = (LONG *) (s->CrossA + MaxFaceSize * MAX_ATTRS);
+        s->FixW   = s->FixX + MaxFaceSize;
+        s->FixEdges = (Fixed_Edge *) (s->FixW + MaxFaceSize);
+#endif
+    }
+}
+
+
+#ifdef HEADLESS
+
+/* A very small thread pool.  RunJobs hands out job   */
+/* numbers 0 to count-1 to whichever thread asks for  */
+/* one next, the calling thread included, and         */
+/* returns once all of them have finished.  A job     */
+/* that calls RunJobs itself just runs the inner      */
+/* jobs on its own thread, one after another.         */
+
+    typedef void (*Job_Func)(void *, long);
+
+    pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  PoolWork = PTHREAD_COND_INITIALIZER,
+                    PoolDone = PTHREAD_COND_INITIALIZER;
+    pthread_t       *PoolThreads = NULL;
+    long            PoolSize = 0;
+
+    Job_Func        PoolJob;
+    void            *PoolArg;
+    long            PoolNext = 0,
+                    PoolCount = 0,
+                    PoolBusy = 0;
+    short           PoolQuit = 0;
+
+    __thread short  InPool = 0;
+
+
+void *PoolWorker(void *index)
+{
+    long        job;
+
+    InPool = 1;
+    ThreadIndex = (long) index;
+
+    pthread_mutex_lock(&PoolLock);
+    for (;;) {
+        while (!PoolQuit && PoolNext >= PoolCount)
+            pthread_cond_wait(&PoolWork, &PoolLock);
+        if (PoolQuit)
+            break;
+
+        job = PoolNext++;
+        PoolBusy++;
+        pthread_mutex_unlock(&PoolLock);
+
+        PoolJob(PoolArg, job);
+
+        pthread_mutex_lock(&PoolLock);
+        if (--PoolBusy == 0 && PoolNext >= PoolCount)
+            pthread_cond_broadcast(&PoolDone);
+    }
+    pthread_mutex_unlock(&PoolLock);
+
+    return (NULL);
+}
+
+
+void RunJobs(Job_Func job, void *arg, long count)
+{
+    long        i;
+
+    if (PoolSize == 0 || InPool || count < 2) {
+        for (i = 0; i < count; i++)
+            job(arg, i);
+        return;
+    }
+
+    pthread_mutex_lock(&PoolLock);
+    PoolJob   = job;
+    PoolArg   = arg;
+    PoolNext  = 0;
+    PoolCount = count;
+    pthread_cond_broadcast(&PoolWork);
+
+    InPool = 1;
+    while (PoolNext < PoolCount) {
+        i = PoolNext++;
+        PoolBusy++;
+        pthread_mutex_unlock(&PoolLock);
+
+        job(arg, i);
+
+        pthread_mutex_lock(&PoolLock);
+        PoolBusy--;
+    }
+    while (PoolBusy > 0)
+        pthread_cond_wait(&PoolDone, &PoolLock);
+    InPool = 0;
+
+    pthread_mutex_unlock(&PoolLock);
+}
+
+
+/* Start n-1 worker threads; the main thread is the   */
+/* nth.  StopThreads lets them all go again.          */
+/* Each worker's ThreadIndex is its place in the      */
+/* pool plus one, the main thread's 0.                */
+
+void StartThreads(long n)
+{
+    PoolThreads = GetMemory(n * sizeof(pthread_t));
+
+    for (PoolSize = 0; PoolSize < n - 1; PoolSize++)
+        if (pthread_create(&PoolThreads[PoolSize], NULL,
+                           PoolWorker, (void *) (PoolSize + 1)))
+            Quit("Could not start a thread");
+}
+
+
+void StopThreads()
+{
+    long        i;
+
+    pthread_mutex_lock(&PoolLock);
+    PoolQuit = 1;
+    pthread_cond_broadcast(&PoolWork);
+    pthread_mutex_unlock(&PoolLock);
+
+    for (i = 0; i < PoolSize; i++)
+        pthread_join(PoolThreads[i], NULL);
+
+    FreeMem(PoolThreads, (PoolSize + 1) * sizeof(pthread_t));
+    PoolThreads = NULL;
+    PoolSize = 0;
+}
+
+#endif
+
+
+/* Parse_Chunk: one piece of the input file, from     */
+/* Start up to End.  First is the number (counting    */
+/* from the first point's X) of its first value, and  */
+/* Count is how many values it holds.                 */
+
+    typedef struct {
+        char   *Start,*End;
+        long   First,Count;
+        short  Bad;
+    } Parse_Chunk;
+
+
+/* IsSpace[c] is 1 for the characters that separate   */
+/* numbers, and 0 for everything else.                */
+
+    char        IsSpace[256];
+
+
+/* Mesh_Size: how big MeshArena should be for the     */
+/* object whose totals have just been read, with the  */
+/* options given.  The simpler levels of -lod each    */
+/* have at most three quarters of the points and half */
+/* the faces of the one before, so between them they  */
+/* have at most three times the points and as many    */
+/* faces as the object.  Their connections are        */
+/* guessed to be no more than the object's, which     */
+/* halving the faces nearly always makes true; if     */
+/* they aren't, the rest spills.  A mapped object     */
+/* only needs room for its own arrays if it's to be   */
+/* optimized.  A streamed object is never worked on,  */
+/* so it needs nothing.                               */
+
+long Mesh_Size()
+{
+    long        points = TotalPoints * sizeof(float),
+                size = ARENA_ALIGN * (8 + 8 * MAX_LEVELS);
+
+    if (Streaming)
+        return (0);
+
+    if (!MeshMapped || Optimizing)
+        size += 3 * points + (TotalFaces + 1) * sizeof(Face) +
+                ConnectLen * IndexSize;
+    size += TotalFaces * sizeof(Face_Info);
+    if (Shading != SHADE_FLAT)
+        size += 3 * points;
+    if (Culling)
+        size += (TotalFaces / (CLUSTER_FACES / 2) + 1) * 2 *
+                sizeof(BVH_Node);
+    if (LevelOfDetail)
+        size += 3 * points * ((Shading != SHADE_FLAT) ? 7 : 4) +
+                TotalFaces * (sizeof(Face) + sizeof(Face_Info)) +
+                ConnectLen * IndexSize;
+    if (FixedPoint)
+        size += 3 * TotalPoints * sizeof(LONG) +
+                TotalFaces * sizeof(Fixed_Info);
+    return (size);
+}
+
+
+/* LoadFile: get the whole of fname into FileData.    */
+
+void LoadFile(char *fname)
+{
+#ifdef HEADLESS
+    int         fd;
+    struct stat st;
+
+    if ((fd = open(fname, O_RDONLY)) < 0)
+        Quit("Could not open input file");
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        Quit(BAD_FILE);
+    }
+    FileSize = st.st_size;
+    FileData = mmap(NULL, FileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (FileData == MAP_FAILED) {
+        FileData = NULL;
+        Quit(BAD_FILE);
+    }
+    madvise(FileData, FileSize, MADV_SEQUENTIAL);
+#else
+    if (!(ObjectFile = fopen(fname, "r")))
+        Quit("Could not open input file");
+    fseek(ObjectFile, 0L, SEEK_END);
+    if ((FileSize = ftell(ObjectFile)) <= 0)
+        Quit(BAD_FILE);
+    fseek(ObjectFile, 0L, SEEK_SET);
+    FileData = GetMemory(FileSize);
+    FileSize = fread(FileData, 1, FileSize, ObjectFile);
+    fclose(ObjectFile);
+    ObjectFile = 0;
+#endif
+}
+
+
+/* ParseLong: read the number starting at or after    */
+/* *pos, and leave *pos just past it.  Returns 0 if   */
+/* there isn't a number there, or it's too big for a  */
+/* long.                                              */
+
+short ParseLong(char **pos, char *end, long *value)
+{
+    char        *p = *pos;
+    long        v = 0;
+    short       negative;
+
+    while (p < end && IsSpace[(UBYTE) *p])
+        p++;
+    if (p == end)
+        return (0);
+
+    negative = (*p == '-');
+    p += negative;
+    if (p == end || (unsigned) (*p - '0') > 9)
+        return (0);
+
+    while (p < end && (unsigned) (*p - '0') <= 9) {
+        if (v >= LONG_MAX / 10 &&
+            (v > LONG_MAX / 10 || *p - '0' > LONG_MAX % 10))
+            return (0);
+        v = v * 10 + (*p++ - '0');
+    }
+
+    if (p < end && !IsSpace[(UBYTE) *p])
+        return (0);
+
+    *value = negative ? -v : v;
+    *pos = p;
+    return (1);
+}
+
+
+/* CountChunk: count the numbers in chunk n, which    */
+/* is just the number of places where a space is      */
+/* followed by something that isn't.  Chunks start    */
+/* at the beginning of a line, so none of them        */
+/* splits a number in two.                            */
+
+void CountChunk(void *chunks, long n)
+{
+    Parse_Chunk *c = (Parse_Chunk *) chunks + n;
+    char        *p;
+    long        count = 0;
+    short       space = 1, now;
+
+    for (p = c->Start; p < c->End; p++) {
+        now = IsSpace[(UBYTE) *p];
+        count += space & !now;
+        space = now;
+    }
+    c->Count = count;
+}
+
+
+/* ParseChunk: parse the numbers in chunk n into      */
+/* World_Data and Connections.  The connections are   */
+/* stored just as they are, negatives and all;        */
+/* sorting them out into faces is left for later.     */
+
+void ParseChunk(void *chunks, long n)
+{
+    Parse_Chunk *c = (Parse_Chunk *) chunks + n;
+    char        *p = c->Start;
+    long        i,t,value,point;
+    short       axis;
+
+    t = c->First;
+    point = t / 3;
+    axis  = t % 3;
+
+    for (i = 0; i < c->Count; i++, t++) {
+        if (!ParseLong(&p, c->End, &value)) {
+            c->Bad = 1;
+            return;
+        }
+
+        if (t < 3 * TotalPoints) {
+            if (axis == 0)
+                World_Data.X[point] = (float) (value / 10000.0);
+            else if (axis == 1)
+                World_Data.Y[point] = (float) (value / 10000.0);
+            else
+                World_Data.Z[point++] = (float) (value / 10000.0);
+            if (++axis == 3)
+                axis = 0;
+        } else if (t - 3 * TotalPoints < ConnectLen) {
+            if (value > TotalPoints || value < -TotalPoints) {
+                c->Bad = 1;
+                return;
+            }
+            if (IndexSize == 2)
+                ((short *) Connections)[t - 3 * TotalPoints] = value;
+            else
+                ((LONG *) Connections)[t - 3 * TotalPoints] = value;
+        } else
+            return;
+    }
+}
+
+
+#ifdef HEADLESS
+
+/* Check_Mesh: make sure the faces of a mapped mesh   */
+/* file make sense, as ReadObjectFile does for a text */
+/* one, since a bad face or index would otherwise     */
+/* only show up as a crash.  Each face has to start   */
+/* just after the one before ends, have at least      */
+/* three corners and stay within the connections, and */
+/* each connection has to be a point.  This only      */
+/* reads, and when streaming it lets go of each block */
+/* as soon as it's checked.                           */
+
+void Check_Mesh()
+{
+    long        i,j,next;
+    LONG        v;
+
+    next = 0;
+    for (i = 0; i < TotalFaces; i++) {
+        if (Face_List[i].start != next || Face_List[i].end < next + 2 ||
+            Face_List[i].end >= ConnectLen)
+            Quit(BAD_FILE);
+        for (j = next; j <= Face_List[i].end; j++) {
+            v = VERTEX(j);
+            if (v < 0 || v >= TotalPoints)
+                Quit(BAD_FILE);
+        }
+        next = Face_List[i].end + 1;
+
+        if ((i + 1) % STREAM_BLOCK == 0)
+            ReleaseFaces(i + 1 - STREAM_BLOCK, i + 1);
+    }
+}
+
+
+/* MapMeshFile: if FileData holds a compiled mesh,    */
+/* point the object's arrays straight at it and       */
+/* return 1.  Nothing is copied; past the header only */
+/* the faces are looked at, by Check_Mesh, and the    */
+/* pages are shared with anything else that has the   */
+/* same file mapped.  Returns 0 if FileData is        */
+/* anything else.                                     */
+
+short MapMeshFile()
+{
+    Mesh_Header *h = (Mesh_Header *) FileData;
+    long        length[MESH_SECTIONS];
+    short       k;
+
+    if (FileSize < sizeof(Mesh_Header) || memcmp(h->Magic, MESH_MAGIC, 4))
+        return (0);
+
+    if (h->Version != MESH_VERSION || h->FaceSize != sizeof(Face) ||
+        h->IndexSize != (h->TotalPoints > COMPACT_POINTS ? 4 : 2))
+        Quit(BAD_FILE);
+    if (h->TotalPoints < 1 || h->TotalFaces < 1 || h->ConnectLen < 1)
+        Quit(BAD_PARAM);
+
+    TotalPoints = h->TotalPoints;
+    TotalFaces  = h->TotalFaces;
+    ConnectLen  = h->ConnectLen;
+    IndexSize   = h->IndexSize;
+
+    length[0] = length[1] = length[2] = TotalPoints * sizeof(float);
+    length[3] = TotalFaces * sizeof(Face);
+    length[4] = ConnectLen * IndexSize;
+
+    for (k = 0; k < MESH_SECTIONS; k++)
+        if (h->Offset[k] < 0 || h->Offset[k] % MESH_ALIGN ||
+            (long) h->Offset[k] < (long) sizeof(Mesh_Header) ||
+            (long) h->Offset[k] > FileSize - length[k])
+            Quit(BAD_FILE);
+
+    World_Data.X = (float *) (FileData + h->Offset[0]);
+    World_Data.Y = (float *) (FileData + h->Offset[1]);
+    World_Data.Z = (float *) (FileData + h->Offset[2]);
+    Face_List    = (Face *)  (FileData + h->Offset[3]);
+    Connections  = FileData + h->Offset[4];
+    MeshMapped = 1;
+    Check_Mesh();
+
+    madvise(FileData, FileSize, MADV_WILLNEED);
+    return (1);
+}
+
+#endif
+
+
+/*  Read the object definition from the input file.   */
+/*  The format of the definition file is as follows:  */
+
+/*      Number of Points                              */
+/*      Number of Faces                               */
+/*      Number of connections                         */
+/*         (i.e. Faces * points per face)             */
+
+/*      3D points, expressed as X Y Z.                */
+/*      Face definitions, expressed as a series of    */
+/*         vertex numbers (based at 1), with a        */
+/*         negative vertex specifying the last vertex */
+/*         in the face.                               */
+
+/*  This routine also allocates memory for the world  */
+/*  coordinates, face list, and connection array.     */
+
+/*  Since my version of DICE won't scanf floating     */
+/*  point numbers yet, I had to read them in as longs */
+/*  and convert them.                                 */
+
+/*  Rather than fscanf each number, the whole file    */
+/*  is pulled into memory at once (mapped, where the  */
+/*  system can) and the numbers are picked out of it  */
+/*  by hand.  Past the three totals the file is cut   */
+/*  into chunks on line boundaries, which can be      */
+/*  parsed on separate threads: first every chunk     */
+/*  counts its numbers, which tells each chunk which  */
+/*  number it starts with, and then the chunks parse  */
+/*  their numbers straight into place.                */
+
+/*  A mesh file written by "shade compile" is mapped  */
+/*  and used in place instead (see MapMeshFile).      */
+
+/*  Apparently there are some object formats used by  */
+/*  Amiga graphics programs that you could use with   */
+/*  this program - I'm not familiar with them, but    */
+/*  you could probably make this program read and     */
+/*  understand them.                                  */
+
+
+void ReadObjectFile(char *fname)
+{
+    long        FaceNum,i,n,vertex,size;
+    char        *p,*end,*body;
+    Parse_Chunk *chunks;
+    double      start,took;
+
+    start = Seconds();
+
+    for (i = 0; i < 256; i++)
+        IsSpace[i] = (i == ' ' || i == '\t' || i == '\n' ||
+                      i == '\r' || i == '\f' || i == '\v');
+
+    LoadFile(fname);
+
+#ifdef HEADLESS
+    if (MapMeshFile()) {
+        Arena_Open(&MeshArena, Mesh_Size());
+        if (Verbose)
+            printf("Mapped %s: %ld bytes in %.3f s\n",
+                   fname, FileSize, Seconds() - start);
+        return;
+    }
+#endif
+
+    p   = FileData;
+    end = FileData + FileSize;
+
+    if (!ParseLong(&p, end, &TotalPoints))
+        Quit(BAD_FILE);
+    if (TotalPoints < 1)
+        Quit(BAD_PARAM);
+
+    if (!ParseLong(&p, end, &TotalFaces))
+        Quit(BAD_FILE);
+    if (TotalFaces < 1)
+        Quit(BAD_PARAM);
+
+    if (!ParseLong(&p, end, &ConnectLen))
+        Quit(BAD_FILE);
+    if (ConnectLen < 1 || ConnectLen > 0x7FFFFFFFL ||
+        TotalPoints > 0x7FFFFFFFL)
+        Quit(BAD_PARAM);
+    IndexSize = (TotalPoints > COMPACT_POINTS) ? 4 : 2;
+
+    /* Face_List has a spare entry at the end, which */
+    /* the loop below starts a face in after the     */
+    /* last one.                                     */
+
+    Arena_Open(&MeshArena, Mesh_Size());
+    World_Data.X = Arena_Get(&MeshArena, TotalPoints*sizeof(float));
+    World_Data.Y = Arena_Get(&MeshArena, TotalPoints*sizeof(float));
+    World_Data.Z = Arena_Get(&MeshArena, TotalPoints*sizeof(float));
+    Face_List    = Arena_Get(&MeshArena, (TotalFaces+1)*sizeof(Face));
+    Connections  = Arena_Get(&MeshArena, ConnectLen*IndexSize);
+
+    /* Cut the rest into chunks.  A small file isn't */
+    /* worth the trouble of splitting up.            */
+
+    body = p;
+    n = 1;
+#ifdef HEADLESS
+    if (PoolSize && end - body > (1L << 20))
+        n = (PoolSize + 1) * 4;
+#endif
+    chunks = GetMemory(n * sizeof(Parse_Chunk));
+    memset(chunks, 0, n * sizeof(Parse_Chunk));
+
+    size = (end - body) / n;
+    for (i = 0; i < n; i++) {
+        chunks[i].Start = i ? chunks[i-1].End : body;
+        if (i == n - 1)
+            p = end;
+        else {
+            p = body + size * (i + 1);
+            if (p < chunks[i].Start)
+                p = chunks[i].Start;
+            while (p < end && *p++ != '\n')
+                ;
+        }
+        chunks[i].End = p;
+    }
+
+    RunJobs(CountChunk, chunks, n);
+
+    for (i = 1; i < n; i++)
+        chunks[i].First = chunks[i-1].First + chunks[i-1].Count;
+    if (chunks[n-1].First + chunks[n-1].Count <
+        3 * TotalPoints + ConnectLen) {
+        FreeMem(chunks, n * sizeof(Parse_Chunk));
+        Quit(BAD_FILE);
+    }
+
+    RunJobs(ParseChunk, chunks, n);
+
+    for (i = 0; i < n; i++)
+        if (chunks[i].Bad) {
+            FreeMem(chunks, n * sizeof(Parse_Chunk));
+            Quit(BAD_FILE);
+        }
+    FreeMem(chunks, n * sizeof(Parse_Chunk));
+
+    /* Now sort the connections out into faces.  A   */
+    /* negative vertex ends a face, which has to     */
+    /* have at least three corners.                  */
+
+    FaceNum = 0;
+    Face_List[0].start = 0;
+
+    for (i=0; i<ConnectLen; i++) {
+        vertex = VERTEX(i);
+        if (vertex < 0) {
+            vertex = -vertex;
+            if (FaceNum >= TotalFaces || i < Face_List[FaceNum].start + 2)
+                Quit(BAD_FILE);
+            Face_List[FaceNum++].end = i;
+            Face_List[FaceNum].start = i+1;
+        }
+        if (vertex < 1)
+            Quit(BAD_FILE);
+        if (IndexSize == 2)
+            ((short *) Connections)[i] = vertex - 1;
+        else
+            ((LONG *) Connections)[i] = vertex - 1;
+    }
+    if (FaceNum < TotalFaces)
+        Quit(BAD_FILE);
+
+    if (Verbose) {
+        took = Seconds() - start;
+        printf("Read %s: %ld bytes in %.3f s (%.1f MB/s)\n",
+               fname, FileSize, took,
+               took > 0 ? FileSize / 1048576.0 / took : 0.0);
+    }
+
+    UnloadFile();
+}
+
+
+#ifdef HEADLESS
+
+/* Mesh_Layout: fill in h for a compiled mesh of the  */
+/* given size, and the length of each of its          */
+/* sections.                                          */
+
+void Mesh_Layout(Mesh_Header *h, long points, long faces, long connectlen,
+                 long *length)
+{
+    long        pos;
+    short       k;
+
+    memset(h, 0, sizeof(Mesh_Header));
+    memcpy(h->Magic, MESH_MAGIC, 4);
+    h->Version     = MESH_VERSION;
+    h->TotalPoints = points;
+    h->TotalFaces  = faces;
+    h->ConnectLen  = connectlen;
+    h->FaceSize    = sizeof(Face);
+    h->IndexSize   = (points > COMPACT_POINTS) ? 4 : 2;
+
+    length[0] = length[1] = length[2] = points * sizeof(float);
+    length[3] = faces * sizeof(Face);
+    length[4] = connectlen * h->IndexSize;
+
+    pos = sizeof(Mesh_Header);
+    for (k = 0; k < MESH_SECTIONS; k++) {
+        pos = (pos + MESH_ALIGN - 1) & ~(MESH_ALIGN - 1L);
+        h->Offset[k] = pos;
+        pos += length[k];
+    }
+}
+
+
+/* WriteMeshFile: write the object just read out to   */
+/* fname as a compiled mesh, for MapMeshFile to map.  */
+
+void WriteMeshFile(char *fname)
+{
+    static char zero[MESH_ALIGN];
+    Mesh_Header h;
+    FILE        *out;
+    void        *data[MESH_SECTIONS];
+    long        length[MESH_SECTIONS],pos;
+    short       k;
+
+    data[0] = World_Data.X;
+    data[1] = World_Data.Y;
+    data[2] = World_Data.Z;
+    data[3] = Face_List;
+    data[4] = Connections;
+    Mesh_Layout(&h, TotalPoints, TotalFaces, ConnectLen, length);
+
+    if (!(out = fopen(fname, "wb")))
+        Quit("Could not open output file");
+
+    fwrite(&h, sizeof(h), 1, out);
+    pos = sizeof(h);
+    for (k = 0; k < MESH_SECTIONS; k++) {
+        fwrite(zero, 1, h.Offset[k] - pos, out);
+        fwrite(data[k], 1, length[k], out);
+        pos = h.Offset[k] + length[k];
+    }
+
+    if (fclose(out))
+        Quit("Error writing output file");
+}
+
+#endif
+
+
+/* Face_Details: work out the Face_Info for face i.   */
+/* The centroid is just the average of the face's     */
+/* vertices.  The normal is the cross product of two  */
+/* of its edges, P2 - P1 and P3 - P1, which points    */
+/* outward as long as the vertices go clockwise seen  */
+/* from outside.                                      */
+
+void Face_Details(Level *l, long i, Face_Info *info)
+{
+    long        count,first;
+    Point_3D    Centroid,V1,V2,P;
+
+    first = l->Faces[i].start;
+
+    Centroid.X = Centroid.Y = Centroid.Z = 0.0;
+    for (count = first; count <= l->Faces[i].end; count++) {
+        P = LevelPoint(l, LEVEL_VERTEX(l, count));
+        Centroid.X += P.X;
+        Centroid.Y += P.Y;
+        Centroid.Z += P.Z;
+    }
+    info->Count = l->Faces[i].end - first + 1;
+
+    info->Centroid.X = Centroid.X / (float) info->Count;
+    info->Centroid.Y = Centroid.Y / (float) info->Count;
+    info->Centroid.Z = Centroid.Z / (float) info->Count;
+
+    /* V1 = P3 - P1 */
+
+    Minus(LevelPoint(l, LEVEL_VERTEX(l, first+2)),
+          LevelPoint(l, LEVEL_VERTEX(l, first)),&V1);
+
+    /* V2 = P2 - P1 */
+
+    Minus(LevelPoint(l, LEVEL_VERTEX(l, first+1)),
+          LevelPoint(l, LEVEL_VERTEX(l, first)),&V2);
+
+    CrossProduct(V2,V1,&info->Normal);
+    Normalize(&info->Normal);
+}
+
+
+/* Full_Level: make Levels[0] the object as read.     */
+
+void Full_Level()
+{
+    Level       *l = &Levels[0];
+
+    l->Points      = World_Data;
+    l->TotalPoints = TotalPoints;
+    l->TotalFaces  = TotalFaces;
+    l->ConnectLen  = ConnectLen;
+    l->Faces       = Face_List;
+    l->Connections = Connections;
+    l->IndexSize   = IndexSize;
+    l->Data        = NULL;
+    l->BVH         = NULL;
+    l->Cell        = 0.0;
+    l->Weight      = NULL;
+    l->Normals.X   = l->Normals.Y = l->Normals.Z = NULL;
+    LevelCount = 1;
+}
+
+
+/* Prepare_Faces: fill in Face_Data for every face.   */
+
+void Prepare_Faces()
+{
+    long        i;
+
+    Full_Level();
+    Face_Data = Arena_Get(&MeshArena, TotalFaces*sizeof(Face_Info));
+
+    for (i=0; i<TotalFaces; i++) {
+        Face_Details(&Levels[0], i, &Face_Data[i]);
+        if (Face_Data[i].Count > MaxFaceSize)
+            MaxFaceSize = Face_Data[i].Count;
+    }
+    Levels[0].Data = Face_Data;
+}
+
+
+/* Vertex_Normals: work out a normal for each point   */
+/* of l, as the average of the normals of all the     */
+/* faces it's a vertex of.                            */
+
+void Vertex_Normals(Level *l)
+{
+    long        i,j,v;
+    Point_3D    N,*Normal;
+
+    l->Normals.X = Arena_Get(&MeshArena, l->TotalPoints * sizeof(float));
+    l->Normals.Y = Arena_Get(&MeshArena, l->TotalPoints * sizeof(float));
+    l->Normals.Z = Arena_Get(&MeshArena, l->TotalPoints * sizeof(float));
+    for (i = 0; i < l->TotalPoints; i++)
+        l->Normals.X[i] = l->Normals.Y[i] = l->Normals.Z[i] = 0.0;
+
+    for (i = 0; i < l->TotalFaces; i++) {
+        Normal = &l->Data[i].Normal;
+        if (!(DotProduct(*Normal, *Normal) > 0.5))
+            continue;
+        for (j = l->Faces[i].start; j <= l->Faces[i].end; j++) {
+            v = LEVEL_VERTEX(l, j);
+            l->Normals.X[v] += Normal->X;
+            l->Normals.Y[v] += Normal->Y;
+            l->Normals.Z[v] += Normal->Z;
+        }
+    }
+
+    for (i = 0; i < l->TotalPoints; i++) {
+        N.X = l->Normals.X[i];
+        N.Y = l->Normals.Y[i];
+        N.Z = l->Normals.Z[i];
+        Normalize(&N);
+        l->Normals.X[i] = N.X;
+        l->Normals.Y[i] = N.Y;
+        l->Normals.Z[i] = N.Z;
+    }
+}
+
+
+/* Extend: stretch the box from Min to Max to take    */
+/* in P.                                              */
+
+void Extend(Point_3D *Min, Point_3D *Max, Point_3D P)
+{
+    if (P.X < Min->X)
+        Min->X = P.X;
+    if (P.X > Max->X)
+        Max->X = P.X;
+    if (P.Y < Min->Y)
+        Min->Y = P.Y;
+    if (P.Y > Max->Y)
+        Max->Y = P.Y;
+    if (P.Z < Min->Z)
+        Min->Z = P.Z;
+    if (P.Z > Max->Z)
+        Max->Z = P.Z;
+}
+
+
+/* Make_Leaf: work out the box, sphere and cone of a  */
+/* node straight from its faces.                      */
+
+void Make_Leaf(BVH_Node *node)
+{
+    Point_3D    Lo,Hi,P,*Normal;
+    long        i,j;
+    float       d,len;
+
+    node->Min.X = node->Min.Y = node->Min.Z =  HUGE_VAL;
+    node->Max.X = node->Max.Y = node->Max.Z = -HUGE_VAL;
+    Lo = node->Min;
+    Hi = node->Max;
+    node->Axis.X = node->Axis.Y = node->Axis.Z = 0.0;
+
+    for (i = node->First; i < node->First + node->Count; i++) {
+        for (j = Face_List[i].start; j <= Face_List[i].end; j++)
+            Extend(&node->Min, &node->Max, WorldPoint(VERTEX(j)));
+        Extend(&Lo, &Hi, Face_Data[i].Centroid);
+
+        /* Faces too small to have a normal are never */
+        /* drawn, so they needn't fit in the cone.    */
+
+        Normal = &Face_Data[i].Normal;
+        if (DotProduct(*Normal, *Normal) > 0.5) {
+            node->Axis.X += Normal->X;
+            node->Axis.Y += Normal->Y;
+            node->Axis.Z += Normal->Z;
+        }
+    }
+
+    node->Center.X = (Lo.X + Hi.X) / 2.0;
+    node->Center.Y = (Lo.Y + Hi.Y) / 2.0;
+    node->Center.Z = (Lo.Z + Hi.Z) / 2.0;
+
+    node->Radius = 0.0;
+    node->CosSpread = 1.0;
+    if ((len = Magnitude(&node->Axis)) > 0.0) {
+        node->Axis.X /= len;
+        node->Axis.Y /= len;
+        node->Axis.Z /= len;
+    }
+
+    for (i = node->First; i < node->First + node->Count; i++) {
+        Minus(Face_Data[i].Centroid, node->Center, &P);
+        if ((d = Magnitude(&P)) > node->Radius)
+            node->Radius = d;
+        Normal = &Face_Data[i].Normal;
+        if (DotProduct(*Normal, *Normal) > 0.5 &&
+            (d = DotProduct(*Normal, node->Axis)) < node->CosSpread)
+            node->CosSpread = d;
+    }
+
+    /* Allow a little for rounding, and give up on    */
+    /* cones as wide as a right angle.                */
+
+    node->CosSpread -= 0.001;
+    if (len == 0.0 || node->CosSpread <= 0.0)
+        node->CosSpread = 0.0;
+    node->SinSpread = fsqrt(1.0 - node->CosSpread * node->CosSpread);
+}
+
+
+/* Join_Nodes: make a node's box, sphere and cone     */
+/* big enough to hold both its children's.  The       */
+/* cone's axis is halfway between theirs, and its     */
+/* angle the widest either child's reaches from it.   */
+
+void Join_Nodes(BVH_Node *node)
+{
+    BVH_Node    *a = &BVH[node->Left], *b = &BVH[node->Right];
+    Point_3D    D;
+    float       len,spread,t;
+
+    node->Min = a->Min;
+    node->Max = a->Max;
+    Extend(&node->Min, &node->Max, b->Min);
+    Extend(&node->Min, &node->Max, b->Max);
+
+    node->Center.X = (a->Center.X + b->Center.X) / 2.0;
+    node->Center.Y = (a->Center.Y + b->Center.Y) / 2.0;
+    node->Center.Z = (a->Center.Z + b->Center.Z) / 2.0;
+    Minus(a->Center, node->Center, &D);
+    node->Radius = Magnitude(&D) + a->Radius;
+    Minus(b->Center, node->Center, &D);
+    if ((t = Magnitude(&D) + b->Radius) > node->Radius)
+        node->Radius = t;
+
+    node->CosSpread = 0.0;
+    node->SinSpread = 1.0;
+    if (a->CosSpread <= 0.0 || b->CosSpread <= 0.0)
+        return;
+
+    node->Axis.X = a->Axis.X + b->Axis.X;
+    node->Axis.Y = a->Axis.Y + b->Axis.Y;
+    node->Axis.Z = a->Axis.Z + b->Axis.Z;
+    if ((len = Magnitude(&node->Axis)) == 0.0)
+        return;
+    node->Axis.X /= len;
+    node->Axis.Y /= len;
+    node->Axis.Z /= len;
+
+    t = DotProduct(node->Axis, a->Axis);
+    spread = acos(t > 1.0 ? 1.0 : t) + acos(a->CosSpread);
+    t = DotProduct(node->Axis, b->Axis);
+    t = acos(t > 1.0 ? 1.0 : t) + acos(b->CosSpread);
+    if (t > spread)
+        spread = t;
+
+    if (spread + 0.001 < PI / 2.0) {
+        node->CosSpread = fcos(spread + 0.001);
+        node->SinSpread = fsin(spread + 0.001);
+    }
+}
+
+
+/* Make_Node: make node n of the BVH out of count     */
+/* faces starting at face first, splitting them in    */
+/* half until there are no more than CLUSTER_FACES    */
+/* left.  The faces are never moved, so a cluster is  */
+/* just a run of Face_List; objects are usually       */
+/* built up in some sort of order, so neighbouring    */
+/* faces tend to be close together, and this way      */
+/* they're drawn in the order they always were.       */
+
+void Make_Node(long n, long first, long count)
+{
+    BVH_Node    *node = &BVH[n];
+
+    node->First = first;
+    node->Count = count;
+    node->Left  = node->Right = 0;
+
+    if (count <= CLUSTER_FACES) {
+        Make_Leaf(node);
+        return;
+    }
+
+    node->Left  = BVH_Nodes++;
+    node->Right = BVH_Nodes++;
+    Make_Node(node->Left, first, count / 2);
+    Make_Node(node->Right, first + count / 2, count - count / 2);
+    Join_Nodes(node);
+}
+
+
+/* Build_BVH: build the tree over all the faces.      */
+/* Every leaf ends up with at least CLUSTER_FACES/2   */
+/* faces, which puts a limit on how many nodes there  */
+/* can be.                                            */
+
+void Build_BVH()
+{
+    double      start;
+
+    start = Seconds();
+
+    BVH = Arena_Get(&MeshArena, (TotalFaces / (CLUSTER_FACES / 2) + 1) * 2 *
+                                sizeof(BVH_Node));
+
+    BVH_Nodes = 1;
+    Make_Node(0, 0, TotalFaces);
+    Levels[0].BVH = BVH;
+
+    if (Verbose)
+        printf("Built %ld BVH nodes in %.3f s\n", BVH_Nodes,
+               Seconds() - start);
+}
+
+
+/* Collapse: put the new vertices of face i of src    */
+/* into Points, leaving out any that merged with the  */
+/* one before, and return how many are left.  Map     */
+/* gives the new vertex for each old one.             */
+
+long Collapse(Level *src, LONG *Map, long i, LONG *Points)
+{
+    long        j,n;
+    LONG        v;
+
+    n = 0;
+    for (j = src->Faces[i].start; j <= src->Faces[i].end; j++) {
+        v = Map[LEVEL_VERTEX(src, j)];
+        if (n == 0 || v != Points[n-1])
+            Points[n++] = v;
+    }
+    while (n > 1 && Points[n-1] == Points[0])
+        n--;
+
+    return (n);
+}
+
+
+/* Cluster: make dst out of src by merging all the    */
+/* vertices in each cube of a grid grid cubes across  */
+/* into one, at their average position.  A face       */
+/* keeps whatever vertices are left in the same       */
+/* order, and is dropped if there are fewer than      */
+/* three.  The cubes are found through a hash table   */
+/* of their numbers, size long, so the grid can be    */
+/* much finer than there's room to store.  Returns    */
+/* 0, with nothing made, if dst wouldn't have at      */
+/* most half as many faces as src.  What it does make */
+/* is the last thing in MeshArena, so giving it back  */
+/* is just a matter of winding Used back.             */
+
+short Cluster(Level *src, Level *dst, long grid, float cell)
+{
+    long        i,j,n,x,y,z,key,size,hash,mark;
+    long        *Keys;
+    LONG        *Slot,*Map,*Points;
+    float       w;
+
+    dst->Cell = cell;
+
+/* Number the cubes, in the order their first vertex  */
+/* comes.                                             */
+
+    for (size = 1; size < 2 * src->TotalPoints; size *= 2)
+        ;
+    Keys = GetMemory(size * sizeof(long));
+    Slot = GetMemory(size * sizeof(LONG));
+    Map  = GetMemory(src->TotalPoints * sizeof(LONG));
+    for (i = 0; i < size; i++)
+        Keys[i] = -1;
+
+    n = 0;
+    for (i = 0; i < src->TotalPoints; i++) {
+        x = (long) ((src->Points.X[i] - LodMin.X) / cell);
+        y = (long) ((src->Points.Y[i] - LodMin.Y) / cell);
+        z = (long) ((src->Points.Z[i] - LodMin.Z) / cell);
+        x = (x < 0) ? 0 : (x > grid) ? grid : x;
+        y = (y < 0) ? 0 : (y > grid) ? grid : y;
+        z = (z < 0) ? 0 : (z > grid) ? grid : z;
+        key = x + (grid + 1) * (y + (grid + 1) * z);
+
+        hash = ((unsigned long) key * 2654435761UL) & (size - 1);
+        while (Keys[hash] != -1 && Keys[hash] != key)
+            hash = (hash + 1) & (size - 1);
+        if (Keys[hash] == -1) {
+            Keys[hash] = key;
+            Slot[hash] = n++;
+        }
+        Map[i] = Slot[hash];
+    }
+
+    FreeMem(Keys, size * sizeof(long));
+    FreeMem(Slot, size * sizeof(LONG));
+
+/* If hardly any vertices merged, hardly any faces    */
+/* will go either, so don't bother with the rest.     */
+
+    if (n > src->TotalPoints - src->TotalPoints / 4) {
+        FreeMem(Map, src->TotalPoints * sizeof(LONG));
+        return (0);
+    }
+
+/* Each new point is the average of the old ones in   */
+/* its cube.                                          */
+
+    mark = MeshArena.Used;
+    dst->TotalPoints = n;
+    dst->Points.X = Arena_Get(&MeshArena, n * sizeof(float));
+    dst->Points.Y = Arena_Get(&MeshArena, n * sizeof(float));
+    dst->Points.Z = Arena_Get(&MeshArena, n * sizeof(float));
+    dst->Weight   = Arena_Get(&MeshArena, n * sizeof(float));
+    for (i = 0; i < n; i++)
+        dst->Points.X[i] = dst->Points.Y[i] = dst->Points.Z[i] =
+            dst->Weight[i] = 0.0;
+
+    for (i = 0; i < src->TotalPoints; i++) {
+        w = src->Weight ? src->Weight[i] : 1.0;
+        dst->Points.X[Map[i]] += w * src->Points.X[i];
+        dst->Points.Y[Map[i]] += w * src->Points.Y[i];
+        dst->Points.Z[Map[i]] += w * src->Points.Z[i];
+        dst->Weight[Map[i]]   += w;
+    }
+    for (i = 0; i < n; i++) {
+        dst->Points.X[i] /= dst->Weight[i];
+        dst->Points.Y[i] /= dst->Weight[i];
+        dst->Points.Z[i] /= dst->Weight[i];
+    }
+
+/* Count what's left of the faces, then go round      */
+/* again and keep it.                                 */
+
+    Points = GetMemory(MaxFaceSize * sizeof(LONG));
+
+    dst->TotalFaces = dst->ConnectLen = 0;
+    for (i = 0; i < src->TotalFaces; i++)
+        if ((j = Collapse(src, Map, i, Points)) >= 3) {
+            dst->TotalFaces++;
+            dst->ConnectLen += j;
+        }
+
+    if (dst->TotalFaces == 0 || dst->TotalFaces > src->TotalFaces / 2) {
+        FreeMem(Points, MaxFaceSize * sizeof(LONG));
+        FreeMem(Map, src->TotalPoints * sizeof(LONG));
+        MeshArena.Used = mark;
+        return (0);
+    }
+
+    dst->IndexSize   = (n > COMPACT_POINTS) ? 4 : 2;
+    dst->Faces       = Arena_Get(&MeshArena, dst->TotalFaces * sizeof(Face));
+    dst->Data        = Arena_Get(&MeshArena,
+                                 dst->TotalFaces * sizeof(Face_Info));
+    dst->Connections = Arena_Get(&MeshArena,
+                                 dst->ConnectLen * dst->IndexSize);
+    dst->BVH         = NULL;
+
+    dst->TotalFaces = dst->ConnectLen = 0;
+    for (i = 0; i < src->TotalFaces; i++) {
+        if ((n = Collapse(src, Map, i, Points)) < 3)
+            continue;
+        dst->Faces[dst->TotalFaces].start = dst->ConnectLen;
+        for (j = 0; j < n; j++, dst->ConnectLen++)
+            if (dst->IndexSize == 2)
+                ((short *) dst->Connections)[dst->ConnectLen] = Points[j];
+            else
+                ((LONG *) dst->Connections)[dst->ConnectLen] = Points[j];
+        dst->Faces[dst->TotalFaces].end = dst->ConnectLen - 1;
+        Face_Details(dst, dst->TotalFaces, &dst->Data[dst->TotalFaces]);
+        dst->TotalFaces++;
+    }
+    if (Shading != SHADE_FLAT)
+        Vertex_Normals(dst);
+
+    FreeMem(Points, MaxFaceSize * sizeof(LONG));
+    FreeMem(Map, src->TotalPoints * sizeof(LONG));
+    return (1);
+}
+
+
+/* Build_Levels: make the simpler levels.  Each one   */
+/* starts from the last, on a grid half as fine,      */
+/* until they get down to LOD_MIN_GRID cubes across.  */
+/* A level that doesn't at least halve the faces      */
+/* isn't worth having, so the next grid is tried on   */
+/* the same level instead.  The grids all line up,    */
+/* so a cube of one is exactly eight cubes of the     */
+/* one before.                                        */
+
+void Build_Levels()
+{
+    long        i,grid;
+    Point_3D    Max,D;
+    float       extent;
+    Level       *src,*dst;
+    double      start;
+
+    start = Seconds();
+    src = &Levels[0];
+
+    LodMin = Max = LevelPoint(src, 0);
+    for (i = 1; i < src->TotalPoints; i++)
+        Extend(&LodMin, &Max, LevelPoint(src, i));
+
+    LodCenter.X = (LodMin.X + Max.X) / 2.0;
+    LodCenter.Y = (LodMin.Y + Max.Y) / 2.0;
+    LodCenter.Z = (LodMin.Z + Max.Z) / 2.0;
+    Minus(Max, LodCenter, &D);
+    LodRadius = Magnitude(&D);
+
+    extent = Max.X - LodMin.X;
+    if (Max.Y - LodMin.Y > extent)
+        extent = Max.Y - LodMin.Y;
+    if (Max.Z - LodMin.Z > extent)
+        extent = Max.Z - LodMin.Z;
+    if (extent <= 0.0)
+        return;
+
+    for (grid = LOD_GRID; grid >= LOD_MIN_GRID && LevelCount < MAX_LEVELS;
+         grid /= 2) {
+        dst = &Levels[LevelCount];
+        if (Cluster(src, dst, grid, extent / grid)) {
+            src = dst;
+            LevelCount++;
+        }
+    }
+
+    if (Verbose) {
+        printf("Built %ld levels of detail in %.3f s", LevelCount - 1,
+               Seconds() - start);
+        for (i = 1; i < LevelCount; i++)
+            printf("%s %ld", (i == 1) ? ":" : ",", Levels[i].TotalFaces);
+        printf("%s\n", (LevelCount > 1) ? " faces" : "");
+    }
+}
+
+
+/* Gather_Misses: what share of the vertices          */
+/* ShowFace reads, going through all the faces in     */
+/* order, would miss a cache of GATHER_LINES lines of */
+/* GATHER_LINE bytes, each line of Display only ever  */
+/* going in one place in it.  That's only a model of  */
+/* a real cache, but it's enough to tell a good       */
+/* order from a bad one.                              */
+
+#define GATHER_LINE     64
+#define GATHER_LINES    512
+
+double Gather_Misses()
+{
+    long        Tags[GATHER_LINES];
+    long        i,line,misses;
+
+    for (i = 0; i < GATHER_LINES; i++)
+        Tags[i] = -1;
+
+    misses = 0;
+    for (i = 0; i < ConnectLen; i++) {
+        line = VERTEX(i) * (long) sizeof(Display_Point) / GATHER_LINE;
+        if (Tags[line % GATHER_LINES] != line) {
+            Tags[line % GATHER_LINES] = line;
+            misses++;
+        }
+    }
+    return ((double) misses / ConnectLen);
+}
+
+
+/* Point_Hash: a hash of where point i is.  Adding    */
+/* 0.0 makes -0.0 into 0.0, so the two hash the same, */
+/* as they compare the same.                          */
+
+ULONG Point_Hash(long i)
+{
+    float       x = World_Data.X[i] + 0.0f,
+                y = World_Data.Y[i] + 0.0f,
+                z = World_Data.Z[i] + 0.0f;
+    ULONG       bx,by,bz;
+
+    memcpy(&bx, &x, sizeof(ULONG));
+    memcpy(&by, &y, sizeof(ULONG));
+    memcpy(&bz, &z, sizeof(ULONG));
+    return ((bx * 73856093UL ^ by * 19349663UL ^ bz * 83492791UL) *
+            2654435761UL);
+}
+
+
+/* Spread_Bits: the low ten bits of x, two zero bits  */
+/* after each, so that three of them can be woven     */
+/* into one number by Morton order.                   */
+
+ULONG Spread_Bits(ULONG x)
+{
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8))  & 0x0300F00F;
+    x = (x | (x << 4))  & 0x030C30C3;
+    x = (x | (x << 2))  & 0x09249249;
+    return (x);
+}
+
+
+/* Morton_Key: a face, and the place of its centroid  */
+/* along a Morton curve through the object's box.     */
+
+    typedef struct {
+        ULONG  Code;
+        LONG   Face;
+    } Morton_Key;
+
+int Compare_Morton(Morton_Key *k1, Morton_Key *k2)
+{
+    if (k1->Code != k2->Code)
+        return ((k1->Code < k2->Code) ? -1 : 1);
+    return ((k1->Face < k2->Face) ? -1 : (k1->Face > k2->Face));
+}
+
+
+#ifdef HEADLESS
+
+/* Copy_Mesh: give a mapped object arrays of its own  */
+/* in MeshArena, so they can be changed, and let the  */
+/* file go.                                           */
+
+void Copy_Mesh()
+{
+    Point_List  P;
+    Face        *faces;
+    void        *conn;
+
+    P.X   = Arena_Get(&MeshArena, TotalPoints * sizeof(float));
+    P.Y   = Arena_Get(&MeshArena, TotalPoints * sizeof(float));
+    P.Z   = Arena_Get(&MeshArena, TotalPoints * sizeof(float));
+    faces = Arena_Get(&MeshArena, (TotalFaces + 1) * sizeof(Face));
+    conn  = Arena_Get(&MeshArena, ConnectLen * IndexSize);
+
+    memcpy(P.X, World_Data.X, TotalPoints * sizeof(float));
+    memcpy(P.Y, World_Data.Y, TotalPoints * sizeof(float));
+    memcpy(P.Z, World_Data.Z, TotalPoints * sizeof(float));
+    memcpy(faces, Face_List, TotalFaces * sizeof(Face));
+    memcpy(conn, Connections, ConnectLen * IndexSize);
+
+    UnloadFile();
+    World_Data  = P;
+    Face_List   = faces;
+    Connections = conn;
+}
+
+#endif
+
+
+/* Optimize_Mesh: weld together the points that are   */
+/* in exactly the same place, drop the faces that it  */
+/* leaves with fewer than three different corners,    */
+/* which can't cover any pixels, and put what is left */
+/* in an order that's kinder to the cache.  The faces */
+/* go in Morton order of their centroids, so ones     */
+/* next to each other in space are next to each other */
+/* in Face_List, and the points are numbered in the   */
+/* order the faces first use them, so the vertices of */
+/* the faces drawn one after another are close        */
+/* together in Display.  Points that no face uses go  */
+/* at the end; they're kept, since they still count   */
+/* towards the box the camera is aimed at.  The       */
+/* arrays only get smaller, so it's all done in       */
+/* place.                                             */
+
+void Optimize_Mesh()
+{
+    long        i,j,n,size,hash,faces,conn,points,count;
+    LONG        *Table,*Map,*Keep,*Conn,*Renumber;
+    Face        *Faces;
+    Morton_Key  *Keys;
+    float       *Spare,*Axis[3],scale;
+    Point_3D    Min,Max,C;
+    double      start,before;
+
+    start  = Seconds();
+    before = Gather_Misses();
+
+#ifdef HEADLESS
+    if (MeshMapped)
+        Copy_Mesh();
+#endif
+
+/* Number the different places, in the order their    */
+/* first point comes.  Keep says which point that     */
+/* is, and Map gives every point its place.           */
+
+    for (size = 1; size < 2 * TotalPoints; size *= 2)
+        ;
+    Table = GetMemory(size * sizeof(LONG));
+    Map   = GetMemory(TotalPoints * sizeof(LONG));
+    Keep  = GetMemory(TotalPoints * sizeof(LONG));
+    for (i = 0; i < size; i++)
+        Table[i] = -1;
+
+    n = 0;
+    for (i = 0; i < TotalPoints; i++) {
+        hash = Point_Hash(i) & (size - 1);
+        while (Table[hash] != -1 &&
+               (World_Data.X[Keep[Table[hash]]] != World_Data.X[i] ||
+                World_Data.Y[Keep[Table[hash]]] != World_Data.Y[i] ||
+                World_Data.Z[Keep[Table[hash]]] != World_Data.Z[i]))
+            hash = (hash + 1) & (size - 1);
+        if (Table[hash] == -1) {
+            Table[hash] = n;
+            Keep[n++] = i;
+        }
+        Map[i] = Table[hash];
+    }
+    FreeMem(Table, size * sizeof(LONG));
+
+/* Rewrite the faces in terms of places, into Faces   */
+/* and Conn for now.  Collapse says how many          */
+/* different corners each one has, but a face that's  */
+/* kept keeps all its corners, repeats and all, since */
+/* its normal and centroid come from them.            */
+
+    Full_Level();
+    Faces = GetMemory(TotalFaces * sizeof(Face));
+    Conn  = GetMemory(ConnectLen * sizeof(LONG));
+
+    faces = conn = 0;
+    for (i = 0; i < TotalFaces; i++)
+        if (Collapse(&Levels[0], Map, i, Conn + conn) >= 3) {
+            Faces[faces].start = conn;
+            for (j = Face_List[i].start; j <= Face_List[i].end; j++)
+                Conn[conn++] = Map[VERTEX(j)];
+            Faces[faces].end = conn - 1;
+            faces++;
+        }
+    FreeMem(Map, TotalPoints * sizeof(LONG));
+
+    if (faces == 0) {
+        FreeMem(Keep, TotalPoints * sizeof(LONG));
+        FreeMem(Faces, TotalFaces * sizeof(Face));
+        FreeMem(Conn, ConnectLen * sizeof(LONG));
+        return;
+    }
+
+/* Find each face's place on the curve.               */
+
+    Min.X = Max.X = World_Data.X[Keep[0]];
+    Min.Y = Max.Y = World_Data.Y[Keep[0]];
+    Min.Z = Max.Z = World_Data.Z[Keep[0]];
+    for (i = 1; i < n; i++)
+        Extend(&Min, &Max, WorldPoint(Keep[i]));
+    scale = Max.X - Min.X;
+    if (Max.Y - Min.Y > scale)
+        scale = Max.Y - Min.Y;
+    if (Max.Z - Min.Z > scale)
+        scale = Max.Z - Min.Z;
+    scale = (scale > 0.0) ? 1023.0 / scale : 0.0;
+
+    Keys = GetMemory(faces * sizeof(Morton_Key));
+    for (i = 0; i < faces; i++) {
+        C.X = C.Y = C.Z = 0.0;
+        for (j = Faces[i].start; j <= Faces[i].end; j++) {
+            C.X += World_Data.X[Keep[Conn[j]]];
+            C.Y += World_Data.Y[Keep[Conn[j]]];
+            C.Z += World_Data.Z[Keep[Conn[j]]];
+        }
+        count = Faces[i].end - Faces[i].start + 1;
+        C.X = (C.X / count - Min.X) * scale;
+        C.Y = (C.Y / count - Min.Y) * scale;
+        C.Z = (C.Z / count - Min.Z) * scale;
+        Keys[i].Code = Spread_Bits((ULONG) C.X) |
+                       Spread_Bits((ULONG) C.Y) << 1 |
+                       Spread_Bits((ULONG) C.Z) << 2;
+        Keys[i].Face = i;
+    }
+    qsort(Keys, faces, sizeof(Morton_Key),
+          (int (*)(const void *, const void *)) Compare_Morton);
+
+/* Number the points in the order the faces use       */
+/* them, and then copy the faces back in their new    */
+/* order.  The connections may fit in shorts now.     */
+
+    Renumber = GetMemory(n * sizeof(LONG));
+    for (i = 0; i < n; i++)
+        Renumber[i] = -1;
+    points = 0;
+    for (i = 0; i < faces; i++)
+        for (j = Faces[Keys[i].Face].start; j <= Faces[Keys[i].Face].end; j++)
+            if (Renumber[Conn[j]] == -1)
+                Renumber[Conn[j]] = points++;
+    for (i = 0; i < n; i++)
+        if (Renumber[i] == -1)
+            Renumber[i] = points++;
+
+    IndexSize = (points > COMPACT_POINTS) ? 4 : 2;
+    conn = 0;
+    for (i = 0; i < faces; i++) {
+        Face_List[i].start = conn;
+        for (j = Faces[Keys[i].Face].start; j <= Faces[Keys[i].Face].end;
+             j++, conn++)
+            if (IndexSize == 2)
+                ((short *) Connections)[conn] = Renumber[Conn[j]];
+            else
+                ((LONG *) Connections)[conn] = Renumber[Conn[j]];
+        Face_List[i].end = conn - 1;
+    }
+    Face_List[faces].start = conn;
+
+    Spare = GetMemory(points * sizeof(float));
+    Axis[0] = World_Data.X;
+    Axis[1] = World_Data.Y;
+    Axis[2] = World_Data.Z;
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < n; i++)
+            if (Renumber[i] != -1)
+                Spare[Renumber[i]] = Axis[j][Keep[i]];
+        memcpy(Axis[j], Spare, points * sizeof(float));
+    }
+
+    FreeMem(Spare, points * sizeof(float));
+    FreeMem(Renumber, n * sizeof(LONG));
+    FreeMem(Keys, faces * sizeof(Morton_Key));
+    FreeMem(Faces, TotalFaces * sizeof(Face));
+    FreeMem(Conn, ConnectLen * sizeof(LONG));
+    FreeMem(Keep, TotalPoints * sizeof(LONG));
+
+    points = TotalPoints - points;
+    faces  = TotalFaces - faces;
+    TotalPoints -= points;
+    TotalFaces  -= faces;
+    ConnectLen   = conn;
+
+    if (Verbose)
+        printf("Optimized in %.3f s: %ld points and %ld faces fewer, "
+               "gather misses %.1f%% (%.1f%% before)\n",
+               Seconds() - start, points, faces,
+               Gather_Misses() * 100.0, before * 100.0);
+}
+
+
+#ifndef HEADLESS
+
+/* Open a couple of screens and windows.  This        */
+/* program uses two of each for double buffering.     */
+/* Also, this routine jump-starts the double          */
+/* buffering process.                                 */
+
+void OpenDisplay()
+{
+    struct ViewPort  *vp;
+    long  i;
+
+    if (!(screen1 = (void *) OpenScreen(&MyNewScreen)))
+        Quit("Could not open screen");
+    ShowTitle(screen1, FALSE);
+
+    if (!(screen2 = (void *) OpenScreen(&MyNewScreen)))
+        Quit("Could not open screen");
+    ShowTitle(screen2, FALSE);
+
+    MyNewWindow.Screen = screen1;
+
+    if (!(window1 = (struct Window *)
+                            OpenWindow(&MyNewWindow)))
+        Quit("Could not open the window");
+
+    MyNewWindow.Screen = screen2;
+    MyNewWindow.Flags  = BACKDROP | BORDERLESS;
+
+    if (!(window2 = (struct Window *)
+                        OpenWindow(&MyNewWindow)))
+        Quit("Could not open the window");
+
+    frontwindow = window1;
+    ScreenToFront(screen1);
+
+/* Set the colors for each screen to a range of red.  */
+
+    vp = (void *) ViewPortAddress(window1);
+    for (i=0; i<16; i++)
+        SetRGB4(vp,i,i,0,0);
+
+    vp = (void *) ViewPortAddress(window2);
+    for (i=0; i<16; i++)
+        SetRGB4(vp,i,i,0,0);
+
+/* Initialize a TmpRas for each window.  The TmpRas   */
+/* is used by the Area routines.                      */
+
+    InitArea(&areainfo1, AreaBuffer1, 20);
+
+    RasterBuffer1 = (void *) AllocRaster(MAXX,MAXY);
+    if (!RasterBuffer1)
+        Quit(NO_MEMORY);
+
+    InitTmpRas(&tmpras1,RasterBuffer1,RASSIZE(MAXX,MAXY));
+
+    rp = window1->RPort;
+    rp->AreaInfo = &areainfo1;
+    rp->TmpRas = &tmpras1;
+
+    InitArea(&areainfo2, AreaBuffer2, 20);
+
+    RasterBuffer2 = (void *) AllocRaster(MAXX,MAXY);
+    if (!RasterBuffer2)
+        Quit(NO_MEMORY);
+
+    InitTmpRas(&tmpras2,RasterBuffer2,RASSIZE(MAXX,MAXY));
+
+    rp = window2->RPort;
+    rp->AreaInfo = &areainfo2;
+    rp->TmpRas   = &tmpras2;
+}
+
+
+
+
+/* Shows the screen we have, presumably, just         */
+/* finished drawing on.  This routine also sets       */
+/* up the correct rastport, so if we always draw      */
+/* into rp we never need to know the details of       */
+/* which screen is in front.                          */
+
+void SwapBuffers()
+{
+    rp = frontwindow->RPort;
+
+    if (frontwindow == window1) {
+        ScreenToFront(screen2);
+        frontwindow = window2;
+    } else {
+        ScreenToFront(screen1);
+        frontwindow = window1;
+    }
+}
+
+#else
+
+/* Headless there's no display to open: each frame    */
+/* gets its own framebuffer in OpenFrames.            */
+
+/* Clear the framebuffer to a single color, the same  */
+/* way SetRast() clears a RastPort.  The depth buffer */
+/* goes back to infinitely far away.                  */
+
+void SetRast(FrameBuffer *f, short color)
+{
+    long  i, size;
+
+    size = FRAME_PIXELS;
+    memset(f->Pixels, color, size);
+
+    if (f->Depth)
+        for (i = 0; i < size; i++)
+            f->Depth[i] = 0.0;
+}
+
+
+/* Frame_Row: copy row y of the framebuffer, in order */
+/* from left to right, into row.                      */
+
+void Frame_Row(FrameBuffer *f, long y, UBYTE *row)
+{
+    UBYTE  *tile;
+    long   x,n;
+
+    tile = f->Pixels + TILE_OFFSET(0, y);
+    for (x = 0; x < f->Width; x += TILE_SIZE, tile += TILE_AREA) {
+        n = (f->Width - x < TILE_SIZE) ? f->Width - x : TILE_SIZE;
+        memcpy(row + x, tile, n);
+    }
+}
+
+
+/* Write a framebuffer out as a binary PPM, or as     */
+/* bare RGB triples if RawOutput is set.  Each pixel  */
+/* becomes the shade of red it would have been on     */
+/* the Amiga.  The row it's put together in comes     */
+/* from temp.                                         */
+
+void WriteFrame(FrameBuffer *f, char *fname, Arena *temp)
+{
+    FILE   *out;
+    UBYTE  *row, *pixel;
+    long   x,y;
+
+    if (!(out = fopen(fname, "wb")))
+        Quit("Could not open output file");
+
+    if (!RawOutput)
+        fprintf(out, "P6\n%d %d\n255\n", f->Width, f->Height);
+
+    row = Arena_Get(temp, f->Width * 4L);
+    memset(row, 0, f->Width * 3L);
+
+    pixel = row + f->Width * 3L;
+    for (y = 0; y < f->Height; y++) {
+        Frame_Row(f, y, pixel);
+        for (x = 0; x < f->Width; x++)
+            row[x*3] = pixel[x];
+        fwrite(row, 3, f->Width, out);
+    }
+
+    if (fclose(out))
+        Quit("Error writing output file");
+}
+
+
+/* With -video the frames all go into one stream      */
+/* instead, for an encoder such as ffmpeg to read     */
+/* from a pipe: as YUV4MPEG2 (Y4M) video, each        */
+/* pixel's red turned into Y, Cb and Cr at full       */
+/* resolution, or as bare RGB bytes.  Either way a    */
+/* frame takes VideoSize bytes, three for each pixel. */
+/*                                                    */
+/* So that drawing never waits on the encoder, the    */
+/* frames are handed to a writer thread through a     */
+/* ring of VIDEO_SLOTS buffers.  Video_Frame puts     */
+/* frame n into slot n % VIDEO_SLOTS, once the frame  */
+/* that was there has been written, and the writer    */
+/* sends every frame that's ready, in order, with a   */
+/* single writev.  Number is the frame a slot holds,  */
+/* -1 if none; VideoDone counts the frames written.   */
+
+#define VIDEO_Y4M       1
+#define VIDEO_RGB       2
+#define VIDEO_SLOTS     8
+#define VIDEO_RATE      25
+
+    typedef struct {
+        long    Number;
+        UBYTE   *Data;
+    } Video_Slot;
+
+    Video_Slot      Video_Ring[VIDEO_SLOTS];
+    int             VideoFile = -1;
+    long            VideoSize = 0,
+                    VideoDone = 0;
+    UBYTE           VideoY[256],VideoCb[256],VideoCr[256];
+    pthread_t       VideoThread;
+    pthread_mutex_t VideoLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  VideoChanged = PTHREAD_COND_INITIALIZER;
+
+
+/* Video_Write: write all count pieces in iov to the  */
+/* stream, however many goes it takes.                */
+
+void Video_Write(struct iovec *iov, int count)
+{
+    ssize_t     done;
+
+    while (count > 0) {
+        if ((done = writev(VideoFile, iov, count)) < 0)
+            Quit("Error writing output file");
+        while (count > 0 && done >= (ssize_t) iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+
+/* Video_Writer: the writer thread.  The Y4M header   */
+/* goes out with the first frames.                    */
+
+void *Video_Writer(void *unused)
+{
+    struct iovec iov[2 * VIDEO_SLOTS + 1];
+    char        header[128];
+    long        last,aspect,unit,a,b;
+    int         count;
+
+    header[0] = '\0';
+    if (VideoFormat == VIDEO_Y4M) {
+        aspect = (long) (PixelAspect * 1000.0 + 0.5);
+        unit = 1000;
+        for (a = aspect, b = unit; b; ) {
+            last = a % b;
+            a = b;
+            b = last;
+        }
+        snprintf(header, sizeof(header),
+                 "YUV4MPEG2 W%ld H%ld F%d:1 Ip A%ld:%ld C444\n",
+                 (long) MAXX, (long) MAXY, VIDEO_RATE, aspect / a, unit / a);
+    }
+
+    while (VideoDone < FrameCount) {
+        pthread_mutex_lock(&VideoLock);
+        while (Video_Ring[VideoDone % VIDEO_SLOTS].Number != VideoDone)
+            pthread_cond_wait(&VideoChanged, &VideoLock);
+        for (last = VideoDone; last < FrameCount &&
+                               last - VideoDone < VIDEO_SLOTS &&
+                               Video_Ring[last % VIDEO_SLOTS].Number == last;
+             last++)
+            ;
+        pthread_mutex_unlock(&VideoLock);
+
+        count = 0;
+        if (header[0] && VideoDone == 0) {
+            iov[count].iov_base = header;
+            iov[count++].iov_len = strlen(header);
+        }
+        for (a = VideoDone; a < last; a++) {
+            if (VideoFormat == VIDEO_Y4M) {
+                iov[count].iov_base = "FRAME\n";
+                iov[count++].iov_len = 6;
+            }
+            iov[count].iov_base = Video_Ring[a % VIDEO_SLOTS].Data;
+            iov[count++].iov_len = VideoSize;
+        }
+        Video_Write(iov, count);
+
+        pthread_mutex_lock(&VideoLock);
+        VideoDone = last;
+        pthread_cond_broadcast(&VideoChanged);
+        pthread_mutex_unlock(&VideoLock);
+    }
+
+    return (NULL);
+}
+
+
+/* Video_Frame: hand fr's picture to the writer.  A   */
+/* Y4M frame is the Y of every pixel, then the Cb,    */
+/* then the Cr.                                       */
+
+void Video_Frame(Frame *fr)
+{
+    Video_Slot  *s = &Video_Ring[fr->Number % VIDEO_SLOTS];
+    FrameBuffer *f = &fr->Buffer;
+    UBYTE       *y,*cb,*cr;
+    long        row,x,area;
+
+    pthread_mutex_lock(&VideoLock);
+    while (VideoDone <= fr->Number - VIDEO_SLOTS)
+        pthread_cond_wait(&VideoChanged, &VideoLock);
+    pthread_mutex_unlock(&VideoLock);
+
+    area = (long) f->Width * f->Height;
+    for (row = 0; row < f->Height; row++) {
+        y = s->Data + row * f->Width;
+        Frame_Row(f, row, y);
+        if (VideoFormat == VIDEO_Y4M) {
+            cb = y + area;
+            cr = cb + area;
+            for (x = 0; x < f->Width; x++) {
+                cb[x] = VideoCb[y[x]];
+                cr[x] = VideoCr[y[x]];
+                y[x]  = VideoY[y[x]];
+            }
+        }
+    }
+
+/* Bare RGB goes three bytes a pixel, so spread each  */
+/* row out from the back, where it can't run over     */
+/* one that's still to be done.                       */
+
+    if (VideoFormat == VIDEO_RGB)
+        for (x = area - 1; x >= 0; x--) {
+            s->Data[x*3]   = s->Data[x];
+            s->Data[x*3+1] = 0;
+            s->Data[x*3+2] = 0;
+        }
+
+    pthread_mutex_lock(&VideoLock);
+    s->Number = fr->Number;
+    pthread_cond_broadcast(&VideoChanged);
+    pthread_mutex_unlock(&VideoLock);
+}
+
+
+/* Open_Video: open the stream and start the writer.  */
+/* Standard output, "-", is kept for the video alone: */
+/* anything else printed goes to standard error.  The */
+/* shades turn into Y, Cb and Cr as in ITU-R BT.601.  */
+
+void Open_Video()
+{
+    long        i;
+
+    if (!strcmp(OutputName, "-")) {
+        fflush(stdout);
+        VideoFile = dup(1);
+        dup2(2, 1);
+    } else
+        VideoFile = open(OutputName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (VideoFile < 0)
+        Quit("Could not open output file");
+
+    for (i = 0; i < 256; i++) {
+        VideoY[i]  = 16  + ((66 * i + 128) >> 8);
+        VideoCb[i] = 128 + ((-38 * i + 128) >> 8);
+        VideoCr[i] = 128 + ((112 * i + 128) >> 8);
+    }
+
+    VideoSize = 3L * MAXX * MAXY;
+    VideoDone = 0;
+    for (i = 0; i < VIDEO_SLOTS; i++) {
+        Video_Ring[i].Number = -1;
+        Video_Ring[i].Data = GetMemory(VideoSize);
+    }
+
+    if (pthread_create(&VideoThread, NULL, Video_Writer, NULL))
+        Quit("Could not start a thread");
+}
+
+
+/* Close_Video: wait for the last frames to go out.   */
+
+void Close_Video()
+{
+    long        i;
+
+    pthread_join(VideoThread, NULL);
+    if (close(VideoFile))
+        Quit("Error writing output file");
+    for (i = 0; i < VIDEO_SLOTS; i++)
+        FreeMem(Video_Ring[i].Data, VideoSize);
+}
+
+
+/* "Showing" a finished frame just means writing it   */
+/* to the file for its frame number, or handing it to */
+/* the writer with -video.                            */
+
+void SwapBuffers(Frame *fr)
+{
+    char        fname[1024];
+
+    if (VideoFormat) {
+        Video_Frame(fr);
+        return;
+    }
+
+    snprintf(fname, sizeof(fname), OutputName, fr->Number);
+    WriteFrame(&fr->Buffer, fname, &fr->Temp);
+}
+
+#endif
+
+
+#ifdef HEADLESS
+
+/* Set_Screen: read a screen size, WIDTHxHEIGHT, from */
+/* the start of *spec and make it the one to draw,    */
+/* with pixels pixel wide for each one high.  *spec   */
+/* is left after the size and any comma following     */
+/* it.  Returns 0 if there's no size there, or it's   */
+/* too big or small.                                  */
+
+short Set_Screen(char **spec, double pixel)
+{
+    char        *p;
+    long        w,h;
+
+    w = strtol(*spec, &p, 10);
+    if (*p++ != 'x')
+        return (0);
+    h = strtol(p, &p, 10);
+    if (*p == ',')
+        p++;
+    else if (*p)
+        return (0);
+    if (w < TILE_SIZE / 4 || w > MAX_SIZE || h < TILE_SIZE / 4 ||
+        h > MAX_SIZE)
+        return (0);
+
+    ScreenWidth  = w;
+    ScreenHeight = h;
+    ScreenAspect = w * pixel / h;
+    *spec = p;
+    return (1);
+}
+
+#endif
+
+
+/* This routine sets the field of view.  The field is */
+/* specified in degrees.                              */
+
+void Set_View_Angle(float theta)
+{
+    theta = fabs(theta);
+    if (theta >= 180.0)
+        theta = 179.9;
+    else if (theta == 0.0)
+        theta = 1.0;
+
+    theta = ftan((theta / 2.0) / (180.0 / PI));
+
+    MultX = MAXX / (ASPECT * 2.0 * theta);
+    MultY = MAXY / (2.0 * theta);
+}
+
+
+/* Aim_Camera: set up the camera, light and view to   */
+/* take in the box from MinX,MinY,MinZ to             */
+/* MaxX,MaxY,MaxZ.                                    */
+
+void Aim_Camera(float MinX, float MaxX, float MinY, float MaxY,
+                float MinZ, float MaxZ)
+{
+    float       offset;
+
+/* Set the UP vector to be along the positive         */
+/* z axis.                                            */
+
+    UP.X = 0.0;
+    UP.Y = 0.0;
+    UP.Z = 1.0;
+
+/* Place the At point in the middle of the            */
+/* bounding box.                                      */
+
+    At.X = (MinX + MaxX) / 2.0;
+    At.Y = (MinY + MaxY) / 2.0;
+    At.Z = (MinZ + MaxZ) / 2.0;
+
+
+/* Put the From point just far enough away from the   */
+/* At point that we could see the entire bounding box */
+/* using a field of view of 100.                     */
+
+    offset = (MaxX - MinX) / 2.0;
+    if ((MaxZ - MinZ) > (MaxY - MinY))
+        offset += (MaxZ - MinZ) / 2.3;
+    else
+        offset += (MaxY - MinY) / 2.3;
+
+    From.X = At.X + offset;
+    From.Y = At.Y;
+    From.Z = At.Z;
+
+
+/* Place the Light position to the upper right of the */
+/* From point                                         */
+
+    Light.X = From.X;
+    Light.Y = From.Y + offset;
+    Light.Z = From.Z + offset;
+
+/* Set a reasonable field of view                     */
+
+    Set_View_Angle(100.0);
+
+/* Set some reasonable light values                   */
+
+    Ambient   = 0.3;
+    Diffuse   = 0.8;
+    Specular  = 0.2;     /* Not currently used        */
+    Sharpness = 200.0;   /* Not currently used        */
+}
+
+
+/* After reading in all the data points, come up with */
+/* some plausible default values.                     */
+
+void SetDefaults()
+{
+    long        i;
+    float       MinX,MaxX,
+                MinY,MaxY,
+                MinZ,MaxZ;
+
+/*  These Min and Max points define the minimum       */
+/*  bounding box of all the points.  The center       */
+/*  of this box will be the At point.                 */
+
+
+    MinX = MaxX = World_Data.X[0];
+    MinY = MaxY = World_Data.Y[0];
+    MinZ = MaxZ = World_Data.Z[0];
+
+    for (i = 1; i < TotalPoints; i++) {
+        if (World_Data.X[i] < MinX)
+            MinX = World_Data.X[i];
+        else if (World_Data.X[i] > MaxX)
+            MaxX = World_Data.X[i];
+
+        if (World_Data.Y[i] < MinY)
+            MinY = World_Data.Y[i];
+        else if (World_Data.Y[i] > MaxY)
+            MaxY = World_Data.Y[i];
+
+        if (World_Data.Z[i] < MinZ)
+            MinZ = World_Data.Z[i];
+        else if (World_Data.Z[i] > MaxZ)
+            MaxZ = World_Data.Z[i];
+
+        if (i % STREAM_BLOCK == 0)
+            ReleasePoints(i - STREAM_BLOCK, i);
+    }
+    ReleasePoints(TotalPoints - TotalPoints % STREAM_BLOCK, TotalPoints);
+
+    Aim_Camera(MinX, MaxX, MinY, MaxY, MinZ, MaxZ);
+}
+
+
+#ifdef HEADLESS
+
+/* Phong shading.  Each vertex brings its normal and  */
+/* its position, both times 1/z, and each pixel gets  */
+/* them back by dividing by its own 1/z.  The light   */
+/* at a pixel is Ambient, plus Diffuse times the      */
+/* cosine of the angle between the normal and the     */
+/* light, plus Specular times the cosine of the       */
+/* angle between the normal and H, halfway between    */
+/* the light and the viewer, to the power of          */
+/* Sharpness (Blinn's version of Phong's highlight,   */
+/* which saves working out the reflection).  If the   */
+/* three could add up to more than 1, it's all        */
+/* scaled down by Exposure so the highlight isn't     */
+/* lost in the diffuse light.                         */
+
+/* The pixels are shaded 8 at a time with AVX2 where  */
+/* there is AVX2; like the transform, the sums are    */
+/* done in exactly the same order either way, so the  */
+/* picture is the same down to the last pixel.        */
+
+/* Fast_Pow: x to the power s, for x from 0 to 1,     */
+/* as 2 to the power s log2 x.  log2 x is the         */
+/* exponent of x plus a polynomial in the rest of     */
+/* it, and 2 to the power y a polynomial in the       */
+/* fraction of y with the whole part added to the     */
+/* exponent.  The error grows with s; at the          */
+/* Sharpness of 200 it's within 0.19% of pow for any  */
+/* x, which is plenty for a highlight.                */
+
+    float   Exposure = 1.0;
+
+    float   Log2_Poly[] = { 1.44187990, -0.70886522, 0.41524556,
+                            -0.19351652, 0.04526829 },
+            Exp2_Poly[] = { 0.69315254, 0.24015244, 0.05583660,
+                            0.00897290, 0.00188540 };
+
+float Fast_Pow(float x, float s)
+{
+    ULONG       bits;
+    float       e,t,y,r;
+    LONG        i;
+
+    if (!(x > 0.0))
+        return (0.0);
+
+    memcpy(&bits, &x, sizeof(bits));
+    e = (float) ((LONG) (bits >> 23) - 127);
+    bits = (bits & 0x7FFFFF) | 0x3F800000;
+    memcpy(&t, &bits, sizeof(t));
+    t = t - (float) 1.0;
+    y = s * (e + t * (Log2_Poly[0] + t * (Log2_Poly[1] +
+                      t * (Log2_Poly[2] + t * (Log2_Poly[3] +
+                      t * Log2_Poly[4])))));
+    if (!(y >= -126.0))
+        return (0.0);
+
+    r = (float) floor(y);
+    i = (LONG) r;
+    t = y - r;
+    r = (float) 1.0 + t * (Exp2_Poly[0] + t * (Exp2_Poly[1] +
+                           t * (Exp2_Poly[2] + t * (Exp2_Poly[3] +
+                           t * Exp2_Poly[4]))));
+    memcpy(&bits, &r, sizeof(bits));
+    bits += (ULONG) i << 23;
+    memcpy(&r, &bits, sizeof(r));
+    return (r);
+}
+
+
+/* Unit: make x,y,z 1 unit long, unless it's 0.       */
+
+void Unit(float *x, float *y, float *z)
+{
+    float       len;
+
+    len = fsqrt(*x * *x + *y * *y + *z * *z);
+    len = (len > 0.0) ? (float) 1.0 / len : 0.0;
+    *x *= len;
+    *y *= len;
+    *z *= len;
+}
+
+
+/* Lighting: how brightly a point at px,py,pz with    */
+/* the normal nx,ny,nz is lit, from 0 to 1.           */
+
+float Lighting(Frame *fr, float nx, float ny, float nz,
+               float px, float py, float pz)
+{
+    float       lx,ly,lz,ex,ey,ez,hx,hy,hz,diff,spec,light;
+
+    Unit(&nx, &ny, &nz);
+
+    lx = fr->Light.X - px;
+    ly = fr->Light.Y - py;
+    lz = fr->Light.Z - pz;
+    Unit(&lx, &ly, &lz);
+
+    ex = fr->From.X - px;
+    ey = fr->From.Y - py;
+    ez = fr->From.Z - pz;
+    Unit(&ex, &ey, &ez);
+
+    hx = lx + ex;
+    hy = ly + ey;
+    hz = lz + ez;
+    Unit(&hx, &hy, &hz);
+
+    diff = nx * lx + ny * ly + nz * lz;
+    diff = (diff > 0.0) ? diff : 0.0;
+    spec = 0.0;
+    if (diff > 0.0) {
+        spec = nx * hx + ny * hy + nz * hz;
+        spec = Fast_Pow((spec > 0.0) ? spec : 0.0, Sharpness);
+    }
+
+    light = (Ambient + Diffuse * diff + Specular * spec) * Exposure;
+    return ((light < 1.0) ? light : 1.0);
+}
+
+
+/* Phong_Pixel: the shade of the pixel x along a      */
+/* span, whose 1/z is w.                              */
+
+UBYTE Phong_Pixel(Frame *fr, float x, float w, float *a0, float *da)
+{
+    float       iw;
+
+    iw = (float) 1.0 / w;
+    return ((UBYTE) (LONG) (Lighting(fr, (a0[0] + x * da[0]) * iw,
+                                         (a0[1] + x * da[1]) * iw,
+                                         (a0[2] + x * da[2]) * iw,
+                                         (a0[3] + x * da[3]) * iw,
+                                         (a0[4] + x * da[4]) * iw,
+                                         (a0[5] + x * da[5]) * iw)
+                            * (float) 255.0));
+}
+
+
+/* Phong_Attrs: put the attributes of face n's        */
+/* vertices into Attrs: the normal and the position,  */
+/* each times 1/z.                                    */
+
+void Phong_Attrs(Frame *fr, long n, Display_Point *Points, float *Attrs)
+{
+    Level       *l = fr->Detail;
+    long        i,v;
+    float       w;
+
+    for (i = 0; l->Faces[n].start + i <= l->Faces[n].end; i++) {
+        v = LEVEL_VERTEX(l, l->Faces[n].start + i);
+        w = Points[i].W;
+        Attrs[0] = l->Normals.X[v] * w;
+        Attrs[1] = l->Normals.Y[v] * w;
+        Attrs[2] = l->Normals.Z[v] * w;
+        Attrs[3] = l->Points.X[v] * w;
+        Attrs[4] = l->Points.Y[v] * w;
+        Attrs[5] = l->Points.Z[v] * w;
+        Attrs += MAX_ATTRS;
+    }
+}
+
+
+/* Span_Phong: shade pixels x1 to x2-1 of a line.     */
+/* At pixel x the 1/z is w0 + x dw, and attribute a   */
+/* is a0[a] + x da[a].  With a depth buffer only the  */
+/* pixels nearer than what's there are drawn.         */
+
+void Span_Phong(Frame *fr, UBYTE *line, float *depth, long x1, long x2,
+                float w0, float dw, float *a0, float *da)
+{
+    long        x;
+    float       w;
+
+    for (x = x1; x < x2; x++) {
+        w = w0 + x * dw;
+        if (depth) {
+            if (!(w > depth[x]))
+                continue;
+            depth[x] = w;
+        }
+        line[x] = Phong_Pixel(fr, (float) x, w, a0, da);
+    }
+}
+
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2")))
+void Unit_AVX2(__m256 *x, __m256 *y, __m256 *z)
+{
+    __m256      len;
+
+    len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(
+                             _mm256_mul_ps(*x, *x), _mm256_mul_ps(*y, *y)),
+                             _mm256_mul_ps(*z, *z)));
+    len = _mm256_and_ps(_mm256_cmp_ps(len, _mm256_setzero_ps(), _CMP_GT_OQ),
+                        _mm256_div_ps(_mm256_set1_ps(1.0), len));
+    *x = _mm256_mul_ps(*x, len);
+    *y = _mm256_mul_ps(*y, len);
+    *z = _mm256_mul_ps(*z, len);
+}
+
+
+__attribute__((target("avx2")))
+__m256 Fast_Pow_AVX2(__m256 x, float s)
+{
+    __m256i     bits;
+    __m256      e,t,y,r,ok;
+
+    bits = _mm256_castps_si256(x);
+    e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                            _mm256_set1_epi32(127)));
+    bits = _mm256_or_si256(_mm256_and_si256(bits,
+                                            _mm256_set1_epi32(0x7FFFFF)),
+                           _mm256_set1_epi32(0x3F800000));
+    t = _mm256_sub_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(1.0));
+    y = _mm256_add_ps(_mm256_set1_ps(Log2_Poly[3]),
+                      _mm256_mul_ps(t, _mm256_set1_ps(Log2_Poly[4])));
+    y = _mm256_add_ps(_mm256_set1_ps(Log2_Poly[2]), _mm256_mul_ps(t, y));
+    y = _mm256_add_ps(_mm256_set1_ps(Log2_Poly[1]), _mm256_mul_ps(t, y));
+    y = _mm256_add_ps(_mm256_set1_ps(Log2_Poly[0]), _mm256_mul_ps(t, y));
+    y = _mm256_mul_ps(_mm256_set1_ps(s),
+                      _mm256_add_ps(e, _mm256_mul_ps(t, y)));
+
+    ok = _mm256_and_ps(_mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ),
+                       _mm256_cmp_ps(y, _mm256_set1_ps(-126.0), _CMP_GE_OQ));
+
+    r = _mm256_floor_ps(y);
+    bits = _mm256_slli_epi32(_mm256_cvttps_epi32(r), 23);
+    t = _mm256_sub_ps(y, r);
+    r = _mm256_add_ps(_mm256_set1_ps(Exp2_Poly[3]),
+                      _mm256_mul_ps(t, _mm256_set1_ps(Exp2_Poly[4])));
+    r = _mm256_add_ps(_mm256_set1_ps(Exp2_Poly[2]), _mm256_mul_ps(t, r));
+    r = _mm256_add_ps(_mm256_set1_ps(Exp2_Poly[1]), _mm256_mul_ps(t, r));
+    r = _mm256_add_ps(_mm256_set1_ps(Exp2_Poly[0]), _mm256_mul_ps(t, r));
+    r = _mm256_add_ps(_mm256_set1_ps(1.0), _mm256_mul_ps(t, r));
+    r = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(r), bits));
+
+    return (_mm256_and_ps(ok, r));
+}
+
+
+__attribute__((target("avx2")))
+void Span_Phong_AVX2(Frame *fr, UBYTE *line, float *depth, long x1, long x2,
+                     float w0, float dw, float *a0, float *da)
+{
+    __m256      x,w,iw,nx,ny,nz,px,py,pz,lx,ly,lz,ex,ey,ez,hx,hy,hz,
+                diff,spec,light,zero,one,valid;
+    __m256i     lanes,inside;
+    int         S[8],front;
+    float       W[8];
+    long        i,j;
+
+    zero  = _mm256_setzero_ps();
+    one   = _mm256_set1_ps(1.0);
+    lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+/* Spans are often shorter than 8 pixels, so rather   */
+/* than leave the odd ones over to Span_Phong, the    */
+/* last 8 just leave out the lanes past the end.      */
+
+    for (i = x1; i < x2; i += 8) {
+        inside = _mm256_cmpgt_epi32(_mm256_set1_epi32(x2 - i), lanes);
+        valid  = _mm256_castsi256_ps(inside);
+        x = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(i),
+                                                lanes));
+        w = _mm256_add_ps(_mm256_set1_ps(w0),
+                          _mm256_mul_ps(x, _mm256_set1_ps(dw)));
+        if (depth)
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(w,
+                        _mm256_maskload_ps(depth + i, inside), _CMP_GT_OQ));
+        if (!(front = _mm256_movemask_ps(valid)))
+            continue;
+
+        iw = _mm256_div_ps(one, w);
+#define ATTR(a) _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(a0[a]), \
+                    _mm256_mul_ps(x, _mm256_set1_ps(da[a]))), iw)
+        nx = ATTR(0);
+        ny = ATTR(1);
+        nz = ATTR(2);
+        px = ATTR(3);
+        py = ATTR(4);
+        pz = ATTR(5);
+#undef ATTR
+        Unit_AVX2(&nx, &ny, &nz);
+
+        lx = _mm256_sub_ps(_mm256_set1_ps(fr->Light.X), px);
+        ly = _mm256_sub_ps(_mm256_set1_ps(fr->Light.Y), py);
+        lz = _mm256_sub_ps(_mm256_set1_ps(fr->Light.Z), pz);
+        Unit_AVX2(&lx, &ly, &lz);
+
+        ex = _mm256_sub_ps(_mm256_set1_ps(fr->From.X), px);
+        ey = _mm256_sub_ps(_mm256_set1_ps(fr->From.Y), py);
+        ez = _mm256_sub_ps(_mm256_set1_ps(fr->From.Z), pz);
+        Unit_AVX2(&ex, &ey, &ez);
+
+        hx = _mm256_add_ps(lx, ex);
+        hy = _mm256_add_ps(ly, ey);
+        hz = _mm256_add_ps(lz, ez);
+        Unit_AVX2(&hx, &hy, &hz);
+
+        diff = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, lx),
+                                           _mm256_mul_ps(ny, ly)),
+                             _mm256_mul_ps(nz, lz));
+        diff = _mm256_max_ps(diff, zero);
+        spec = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, hx),
+                                           _mm256_mul_ps(ny, hy)),
+                             _mm256_mul_ps(nz, hz));
+        spec = Fast_Pow_AVX2(_mm256_max_ps(spec, zero), Sharpness);
+        spec = _mm256_and_ps(_mm256_cmp_ps(diff, zero, _CMP_GT_OQ), spec);
+
+        light = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(Ambient),
+                                  _mm256_mul_ps(_mm256_set1_ps(Diffuse), diff)),
+                              _mm256_mul_ps(_mm256_set1_ps(Specular), spec));
+        light = _mm256_min_ps(_mm256_mul_ps(light, _mm256_set1_ps(Exposure)),
+                              one);
+        _mm256_storeu_si256((__m256i *) S, _mm256_cvttps_epi32(
+                                _mm256_mul_ps(light, _mm256_set1_ps(255.0))));
+        _mm256_storeu_ps(W, w);
+
+        for (j = 0; j < 8; j++)
+            if (front & (1 << j)) {
+                if (depth)
+                    depth[i+j] = W[j];
+                line[i+j] = (UBYTE) S[j];
+            }
+    }
+}
+
+#endif
+
+
+/* Gouraud shading.  Each vertex is lit once a frame, */
+/* with the same sums as a Phong pixel, by            */
+/* Light_Vertices, and brings just that one value,    */
+/* times 1/z, for the pixels to share out between     */
+/* them.  That's far less work than Phong, with a     */
+/* face the same size, but a highlight smaller than   */
+/* a face gets smeared across it or lost.             */
+
+/* Light_Some: light block n of Light_Vertices.       */
+
+#define LIGHT_BLOCK     4096
+
+void Light_Some(void *arg, long n)
+{
+    Frame       *fr = arg;
+    Level       *l = fr->Detail;
+    long        i,end;
+
+    end = (n + 1) * LIGHT_BLOCK;
+    if (end > l->TotalPoints)
+        end = l->TotalPoints;
+    for (i = n * LIGHT_BLOCK; i < end; i++)
+        fr->Bright[i] = Lighting(fr, l->Normals.X[i], l->Normals.Y[i],
+                                     l->Normals.Z[i], l->Points.X[i],
+                                     l->Points.Y[i], l->Points.Z[i]);
+}
+
+
+/* Light_Vertices: work out Bright for each vertex    */
+/* of the level fr is drawing, a block at a time on   */
+/* as many threads as there are.                      */
+
+void Light_Vertices(Frame *fr)
+{
+    RunJobs(Light_Some, fr,
+            (fr->Detail->TotalPoints + LIGHT_BLOCK - 1) / LIGHT_BLOCK);
+}
+
+
+/* Gouraud_Attrs: put the light at face n's vertices, */
+/* times 1/z, into Attrs.                             */
+
+void Gouraud_Attrs(Frame *fr, long n, Display_Point *Points, float *Attrs)
+{
+    Level       *l = fr->Detail;
+    long        i,v;
+
+    for (i = 0; l->Faces[n].start + i <= l->Faces[n].end; i++) {
+        v = LEVEL_VERTEX(l, l->Faces[n].start + i);
+        Attrs[0] = fr->Bright[v] * Points[i].W;
+        Attrs += MAX_ATTRS;
+    }
+}
+
+
+/* Span_Gouraud: shade pixels x1 to x2-1 of a line,   */
+/* like Span_Phong.                                   */
+
+void Span_Gouraud(Frame *fr, UBYTE *line, float *depth, long x1, long x2,
+                  float w0, float dw, float *a0, float *da)
+{
+    long        x;
+    float       w,light;
+
+    for (x = x1; x < x2; x++) {
+        w = w0 + x * dw;
+        if (depth) {
+            if (!(w > depth[x]))
+                continue;
+            depth[x] = w;
+        }
+        light = (a0[0] + x * da[0]) / w;
+        light = (light < 1.0) ? light : 1.0;
+        line[x] = (UBYTE) (LONG) (light * (float) 255.0);
+    }
+}
+
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2")))
+void Span_Gouraud_AVX2(Frame *fr, UBYTE *line, float *depth, long x1,
+                       long x2, float w0, float dw, float *a0, float *da)
+{
+    __m256      x,w,light,valid;
+    __m256i     lanes,inside;
+    int         S[8],front;
+    float       W[8];
+    long        i,j;
+
+    lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (i = x1; i < x2; i += 8) {
+        inside = _mm256_cmpgt_epi32(_mm256_set1_epi32(x2 - i), lanes);
+        valid  = _mm256_castsi256_ps(inside);
+        x = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(i),
+                                                lanes));
+        w = _mm256_add_ps(_mm256_set1_ps(w0),
+                          _mm256_mul_ps(x, _mm256_set1_ps(dw)));
+        if (depth)
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(w,
+                        _mm256_maskload_ps(depth + i, inside), _CMP_GT_OQ));
+        if (!(front = _mm256_movemask_ps(valid)))
+            continue;
+
+        light = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(a0[0]),
+                                  _mm256_mul_ps(x, _mm256_set1_ps(da[0]))),
+                              w);
+        light = _mm256_min_ps(light, _mm256_set1_ps(1.0));
+        _mm256_storeu_si256((__m256i *) S, _mm256_cvttps_epi32(
+                                _mm256_mul_ps(light, _mm256_set1_ps(255.0))));
+        _mm256_storeu_ps(W, w);
+
+        for (j = 0; j < 8; j++)
+            if (front & (1 << j)) {
+                if (depth)
+                    depth[i+j] = W[j];
+                line[i+j] = (UBYTE) S[j];
+            }
+    }
+}
+
+#endif
+
+
+/* Shade_Span is whichever span routine the shading   */
+/* and the machine call for, picked by ChooseShader   */
+/* once the lights are set.                           */
+
+    void (*Shade_Span)(Frame *, UBYTE *, float *, long, long,
+                       float, float, float *, float *) = Span_Phong;
+
+void ChooseShader()
+{
+    Exposure = Ambient + Diffuse + Specular;
+    Exposure = (Exposure > 1.0) ? (float) 1.0 / Exposure : 1.0;
+
+    Attributes = 0;
+    if (Shading == SHADE_PHONG) {
+        Attributes = 6;
+        Shade_Span = Span_Phong;
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (UseSIMD && __builtin_cpu_supports("avx2"))
+            Shade_Span = Span_Phong_AVX2;
+#endif
+    }
+    if (Shading == SHADE_GOURAUD) {
+        Attributes = 1;
+        Shade_Span = Span_Gouraud;
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (UseSIMD && __builtin_cpu_supports("avx2"))
+            Shade_Span = Span_Gouraud_AVX2;
+#endif
+    }
+}
+
+
+/* FillPolygon: the headless replacement for the      */
+/* Area routines.  It walks down the polygon one      */
+/* scanline at a time, finds where each edge          */
+/* crosses the middle of the line, and fills          */
+/* between pairs of crossings - the same even-odd     */
+/* rule AreaEnd uses.  A pixel is filled only if its  */
+/* center is inside, so faces that share an edge      */
+/* never draw over each other.                        */
+
+/* With a depth buffer, 1/z is carried down the       */
+/* edges and across each span along with x, and a     */
+/* pixel is only drawn if it's nearer than what's     */
+/* already there.  Everything is worked out from the  */
+/* row and column rather than added up along the      */
+/* way, so a pixel comes out the same no matter how   */
+/* the clipping box cuts up the polygon.              */
+
+/* With smooth shading each vertex also brings        */
+/* Attributes values in s->Attrs, multiplied by its   */
+/* 1/z so they too can be interpolated straight       */
+/* across the screen.  They're carried along the      */
+/* same way, and Shade_Span works out the pixels of   */
+/* each span from them.                               */
+
+/* The clip box is always one tile, so line[x] is     */
+/* pixel x of the current row for any x inside it,    */
+/* and the next row is TILE_SIZE bytes on.            */
+
+void FillPolygon(Frame *fr, Box *clip, Display_Point *Points,
+                 long count, UBYTE shade, Scratch *s)
+{
+    FrameBuffer *f = &fr->Buffer;
+    Edge    *Edges = s->Edges, *e;
+    float   *CrossX = s->CrossX, *CrossW = s->CrossW, x, w, dw;
+    float   *Attrs = s->Attrs, *CrossA = s->CrossA,
+            a0[MAX_ATTRS], da[MAX_ATTRS];
+    long    i,j,k,n,a,y,ymin,ymax,x1,x2;
+    UBYTE   *line;
+    float   *depth;
+
+/* Set up every edge that isn't horizontal with its   */
+/* top, bottom and slope.                             */
+
+    n = 0;
+    ymin = ymax = Points[0].Y;
+    for (i = 0, j = count - 1; i < count; j = i++) {
+        if (Points[i].Y < ymin)
+            ymin = Points[i].Y;
+        else if (Points[i].Y > ymax)
+            ymax = Points[i].Y;
+
+        if (Points[i].Y == Points[j].Y)
+            continue;
+
+        if (Points[i].Y < Points[j].Y)
+            k = i;
+        else
+            k = j;
+        e = &Edges[n++];
+        e->Top    = Points[k].Y;
+        e->Bottom = Points[i+j-k].Y;
+        e->Slope  = (float) (Points[i+j-k].X - Points[k].X) /
+                    (float) (e->Bottom - e->Top);
+        e->X      = Points[k].X + e->Slope * 0.5;
+        e->SlopeW = (Points[i+j-k].W - Points[k].W) /
+                    (float) (e->Bottom - e->Top);
+        e->W      = Points[k].W + e->SlopeW * 0.5;
+
+        for (a = 0; a < Attributes; a++) {
+            e->SlopeA[a] = (Attrs[(i+j-k) * MAX_ATTRS + a] -
+                            Attrs[k * MAX_ATTRS + a]) /
+                           (float) (e->Bottom - e->Top);
+            e->A[a] = Attrs[k * MAX_ATTRS + a] + e->SlopeA[a] * 0.5;
+        }
+    }
+
+    if (ymin < clip->Top)
+        ymin = clip->Top;
+    if (ymax > clip->Bottom)
+        ymax = clip->Bottom;
+
+    line = f->Pixels + TILE_OFFSET(clip->Left, ymin) - clip->Left;
+
+    for (y = ymin; y < ymax; y++, line += TILE_SIZE) {
+
+/* Collect the crossings in order from left to right. */
+
+        k = 0;
+        for (i = 0; i < n; i++) {
+            e = &Edges[i];
+            if (y < e->Top || y >= e->Bottom)
+                continue;
+            x = e->X + e->Slope * (y - e->Top);
+            w = e->W + e->SlopeW * (y - e->Top);
+            for (j = k++; j > 0 && CrossX[j-1] > x; j--) {
+                CrossX[j] = CrossX[j-1];
+                CrossW[j] = CrossW[j-1];
+                for (a = 0; a < Attributes; a++)
+                    CrossA[j * MAX_ATTRS + a] =
+                        CrossA[(j-1) * MAX_ATTRS + a];
+            }
+            CrossX[j] = x;
+            CrossW[j] = w;
+            for (a = 0; a < Attributes; a++)
+                CrossA[j * MAX_ATTRS + a] =
+                    e->A[a] + e->SlopeA[a] * (y - e->Top);
+        }
+
+/* And fill in between each pair                      */
+
+        for (i = 0; i + 1 < k; i += 2) {
+            x1 = (long) ceil(CrossX[i] - 0.5);
+            x2 = (long) ceil(CrossX[i+1] - 0.5);
+            if (x1 < clip->Left)
+                x1 = clip->Left;
+            if (x2 > clip->Right)
+                x2 = clip->Right;
+            if (x1 >= x2)
+                continue;
+
+            if (!f->Depth && !Attributes) {
+                memset(line + x1, shade, x2 - x1);
+                continue;
+            }
+
+            depth = f->Depth ? f->Depth + (line - f->Pixels) : NULL;
+            dw = (CrossW[i+1] - CrossW[i]) /
+                 (CrossX[i+1] - CrossX[i]);
+            w  = CrossW[i] + (0.5 - CrossX[i]) * dw;
+
+            if (Attributes) {
+                for (a = 0; a < Attributes; a++) {
+                    da[a] = (CrossA[(i+1) * MAX_ATTRS + a] -
+                             CrossA[i * MAX_ATTRS + a]) /
+                            (CrossX[i+1] - CrossX[i]);
+                    a0[a] = CrossA[i * MAX_ATTRS + a] +
+                            (0.5 - CrossX[i]) * da[a];
+                }
+                Shade_Span(fr, line, depth, x1, x2, w, dw, a0, da);
+                continue;
+            }
+
+            for (j = x1; j < x2; j++)
+                if (w + j * dw > depth[j]) {
+                    depth[j] = w + j * dw;
+                    line[j]  = shade;
+                }
+        }
+    }
+}
+
+
+/* The fixed point pipeline.  With -fixed no float    */
+/* touches a pixel: points are the whole numbers they */
+/* were in the input file, unit vectors and the view  */
+/* matrix are whole numbers scaled up by a power of   */
+/* 2, sines and cosines come from CORDIC rather than  */
+/* the math library, and the polygon filler steps     */
+/* down the edges and across the spans exactly.       */
+/* Integer sums come out the same on any machine,     */
+/* which float sums don't quite, so neither does the  */
+/* picture.  (The BVH still culls with floats, but    */
+/* with CULL_MARGIN to spare, so it can't change what */
+/* gets drawn; and faces the same distance away are   */
+/* only guaranteed to stay in order with the radix    */
+/* sort, not qsort.)                                  */
+
+/* Display points are in 16ths of a pixel (28.4), and */
+/* W is 1/z scaled to a whole number below 2 to the   */
+/* FIX_DEPTH, which a float holds exactly.  The view  */
+/* coordinates keep FIX_FRAC bits below a file unit.  */
+/* Points must be within FIX_LIMIT of 0.              */
+
+#define FIX_SCALE       10000.0
+#define FIX_LIMIT       (1L << 26)
+#define FIX_NORMAL      14
+#define FIX_VIEW        24
+#define FIX_FRAC        12
+#define FIX_SUB         4
+#define FIX_DEPTH       24
+#define FIX_ANGLE       30
+
+    Fixed_3D    FixAt,FixFrom,FixLight;
+    LONG        FixMultX,FixMultY,FixAmbient,FixDiffuse;
+    short       FixDepthShift;
+
+
+/* Floor_Div: a/b rounded down, for b > 0, with       */
+/* what's left over in *rest if rest isn't NULL.      */
+
+int64_t Floor_Div(int64_t a, int64_t b, int64_t *rest)
+{
+    int64_t     q;
+
+    q = a / b;
+    if (q * b > a)
+        q--;
+    if (rest)
+        *rest = a - q * b;
+    return (q);
+}
+
+
+/* Int_Sqrt: the square root of n, rounded down, for  */
+/* n below 2^62.  A float square root gets within one */
+/* of it, and whole numbers put it right, so it's     */
+/* the same answer wherever it's worked out.          */
+
+ULONG Int_Sqrt(uint64_t n)
+{
+    uint64_t    root;
+
+    root = (uint64_t) sqrt((double) n);
+    while (root * root > n)
+        root--;
+    while ((root + 1) * (root + 1) <= n)
+        root++;
+    return ((ULONG) root);
+}
+
+
+/* Fixed_Unit: make x,y,z 1 unit long, 1 being 2 to   */
+/* the power bits, and put it in r.  It's first       */
+/* scaled to between 2^29 and 2^30 so the squares     */
+/* can't overflow and small vectors keep their        */
+/* direction.                                         */
+
+void Fixed_Unit(int64_t x, int64_t y, int64_t z, short bits,
+                Fixed_3D *r)
+{
+    int64_t     m,scale;
+    ULONG       len;
+
+    m = (x < 0) ? -x : x;
+    m = (y > m) ? y : (-y > m) ? -y : m;
+    m = (z > m) ? z : (-z > m) ? -z : m;
+    if (m == 0) {
+        r->X = r->Y = r->Z = 0;
+        return;
+    }
+    for (scale = 1; m >= (1L << 30); m >>= 1)
+        scale *= 2;
+    x /= scale;
+    y /= scale;
+    z /= scale;
+    for (scale = 1; m < (1L << 29); m <<= 1)
+        scale *= 2;
+    x *= scale;
+    y *= scale;
+    z *= scale;
+
+    len = Int_Sqrt((uint64_t) (x * x + y * y + z * z));
+    r->X = (LONG) (x * ((int64_t) 1 << bits) / len);
+    r->Y = (LONG) (y * ((int64_t) 1 << bits) / len);
+    r->Z = (LONG) (z * ((int64_t) 1 << bits) / len);
+}
+
+
+/* Cordic: the cosine and sine of angle, in 2^32ths   */
+/* of a turn, times 2^FIX_ANGLE.  Anything more than  */
+/* a quarter turn either way is turned round by half  */
+/* a turn first, and the rest done by CORDIC: turning */
+/* by plus or minus atan(2^-i) for each i in turn, to */
+/* bring what's left of the angle down to 0.  The     */
+/* turns stretch the vector by 1/CORDIC_GAIN, so it   */
+/* starts that much shorter.                          */
+
+#define CORDIC_STEPS    30
+#define CORDIC_GAIN     652032874
+
+    LONG        Cordic_Atan[CORDIC_STEPS] = {
+                    536870912, 316933406, 167458907, 85004756, 42667331,
+                    21354465, 10679838, 5340245, 2670163, 1335087,
+                    667544, 333772, 166886, 83443, 41722,
+                    20861, 10430, 5215, 2608, 1304,
+                    652, 326, 163, 81, 41,
+                    20, 10, 5, 3, 1 };
+
+void Cordic(ULONG angle, LONG *cosine, LONG *sine)
+{
+    int64_t     x,y,z,t;
+    short       i,flip = 0;
+
+    z = angle;
+    if (z >= ((int64_t) 1 << 31))
+        z -= (int64_t) 1 << 32;
+    if (z > (1L << 30)) {
+        z -= (int64_t) 1 << 31;
+        flip = 1;
+    } else if (z < -(1L << 30)) {
+        z += (int64_t) 1 << 31;
+        flip = 1;
+    }
+
+    x = CORDIC_GAIN;
+    y = 0;
+    for (i = 0; i < CORDIC_STEPS; i++) {
+        t = x;
+        if (z >= 0) {
+            x -= y >> i;
+            y += t >> i;
+            z -= Cordic_Atan[i];
+        } else {
+            x += y >> i;
+            y -= t >> i;
+            z += Cordic_Atan[i];
+        }
+    }
+
+    *cosine = (LONG) (flip ? -x : x);
+    *sine   = (LONG) (flip ? -y : y);
+}
+
+
+/* Prepare_Fixed: make Fixed_Data and Fixed_Faces.    */
+/* The points go back to the whole numbers they came  */
+/* from; the centroids and normals are worked out the */
+/* same way as Face_Details does.                     */
+
+void Prepare_Fixed()
+{
+    long        i,j,first;
+    int64_t     x,y,z,v1[3],v2[3];
+    Fixed_3D    P[3];
+    Fixed_Info  *info;
+
+    Fixed_Data.X = Arena_Get(&MeshArena, TotalPoints*sizeof(LONG));
+    Fixed_Data.Y = Arena_Get(&MeshArena, TotalPoints*sizeof(LONG));
+    Fixed_Data.Z = Arena_Get(&MeshArena, TotalPoints*sizeof(LONG));
+    Fixed_Faces  = Arena_Get(&MeshArena, TotalFaces*sizeof(Fixed_Info));
+
+    for (i = 0; i < TotalPoints; i++) {
+        x = (int64_t) floor(World_Data.X[i] * FIX_SCALE + 0.5);
+        y = (int64_t) floor(World_Data.Y[i] * FIX_SCALE + 0.5);
+        z = (int64_t) floor(World_Data.Z[i] * FIX_SCALE + 0.5);
+        if (x < -FIX_LIMIT || x > FIX_LIMIT ||
+            y < -FIX_LIMIT || y > FIX_LIMIT ||
+            z < -FIX_LIMIT || z > FIX_LIMIT)
+            Quit(BAD_PARAM);
+        Fixed_Data.X[i] = (LONG) x;
+        Fixed_Data.Y[i] = (LONG) y;
+        Fixed_Data.Z[i] = (LONG) z;
+    }
+
+    for (i = 0; i < TotalFaces; i++) {
+        info  = &Fixed_Faces[i];
+        first = Face_List[i].start;
+
+        x = y = z = 0;
+        for (j = first; j <= Face_List[i].end; j++) {
+            x += Fixed_Data.X[VERTEX(j)];
+            y += Fixed_Data.Y[VERTEX(j)];
+            z += Fixed_Data.Z[VERTEX(j)];
+        }
+        j = Face_List[i].end - first + 1;
+        info->Centroid.X = (LONG) (x / j);
+        info->Centroid.Y = (LONG) (y / j);
+        info->Centroid.Z = (LONG) (z / j);
+
+        /* A face with fewer than three corners gets */
+        /* no normal, so like one whose corners are  */
+        /* all in a line it's never drawn.           */
+
+        if (j < 3) {
+            info->Normal.X = info->Normal.Y = info->Normal.Z = 0;
+            continue;
+        }
+        for (j = 0; j < 3; j++) {
+            P[j].X = Fixed_Data.X[VERTEX(first + j)];
+            P[j].Y = Fixed_Data.Y[VERTEX(first + j)];
+            P[j].Z = Fixed_Data.Z[VERTEX(first + j)];
+        }
+
+        /* v1 = P3 - P1, v2 = P2 - P1 */
+
+        v1[0] = (int64_t) P[2].X - P[0].X;
+        v1[1] = (int64_t) P[2].Y - P[0].Y;
+        v1[2] = (int64_t) P[2].Z - P[0].Z;
+        v2[0] = (int64_t) P[1].X - P[0].X;
+        v2[1] = (int64_t) P[1].Y - P[0].Y;
+        v2[2] = (int64_t) P[1].Z - P[0].Z;
+
+        Fixed_Unit(v2[1] * v1[2] - v2[2] * v1[1],
+                   v2[2] * v1[0] - v2[0] * v1[2],
+                   v2[0] * v1[1] - v2[1] * v1[0],
+                   FIX_NORMAL, &info->Normal);
+    }
+}
+
+
+/* Fixed_Defaults: SetDefaults again in whole         */
+/* numbers: the At, From and Light points, the view   */
+/* angle of 100 degrees, and the light values.        */
+/* FixDepthShift is picked so that 1/z only reaches   */
+/* 2^FIX_DEPTH within a 16th of the way from From to  */
+/* At.  ASPECT can be any ratio with -size, so it's   */
+/* taken to a 65536th, which keeps x within a pixel   */
+/* of the float version on the biggest screen.        */
+
+void Fixed_Defaults()
+{
+    long        i;
+    LONG        Min[3],Max[3],offset,cosine,sine;
+    int64_t     near;
+
+    Min[0] = Max[0] = Fixed_Data.X[0];
+    Min[1] = Max[1] = Fixed_Data.Y[0];
+    Min[2] = Max[2] = Fixed_Data.Z[0];
+    for (i = 1; i < TotalPoints; i++) {
+        if (Fixed_Data.X[i] < Min[0])
+            Min[0] = Fixed_Data.X[i];
+        else if (Fixed_Data.X[i] > Max[0])
+            Max[0] = Fixed_Data.X[i];
+
+        if (Fixed_Data.Y[i] < Min[1])
+            Min[1] = Fixed_Data.Y[i];
+        else if (Fixed_Data.Y[i] > Max[1])
+            Max[1] = Fixed_Data.Y[i];
+
+        if (Fixed_Data.Z[i] < Min[2])
+            Min[2] = Fixed_Data.Z[i];
+        else if (Fixed_Data.Z[i] > Max[2])
+            Max[2] = Fixed_Data.Z[i];
+    }
+
+    FixAt.X = (Min[0] + Max[0]) / 2;
+    FixAt.Y = (Min[1] + Max[1]) / 2;
+    FixAt.Z = (Min[2] + Max[2]) / 2;
+
+    offset = (Max[0] - Min[0]) / 2;
+    if ((Max[2] - Min[2]) > (Max[1] - Min[1]))
+        offset += (Max[2] - Min[2]) * 10 / 23;
+    else
+        offset += (Max[1] - Min[1]) * 10 / 23;
+
+    FixFrom   = FixAt;
+    FixFrom.X += offset;
+
+    FixLight   = FixFrom;
+    FixLight.Y += offset;
+    FixLight.Z += offset;
+
+    Cordic((ULONG) (((int64_t) 50 << 32) / 360), &cosine, &sine);
+    FixMultX = (LONG) (((int64_t) MAXX << FIX_SUB) * cosine /
+                       ((int64_t) (ASPECT * 65536 + 0.5) * sine >> 15));
+    FixMultY = (LONG) (((int64_t) MAXY << FIX_SUB) * cosine / (2 * sine));
+
+    FixAmbient = (LONG) (Ambient * (1 << FIX_NORMAL) + 0.5);
+    FixDiffuse = (LONG) (Diffuse * (1 << FIX_NORMAL) + 0.5);
+
+    near = ((int64_t) offset << FIX_FRAC) / 16;
+    for (FixDepthShift = FIX_DEPTH; near > 1 && FixDepthShift < 62;
+         near >>= 1)
+        FixDepthShift++;
+}
+
+
+/* Fixed_Orbit: OrbitCamera for -fixed.  The orbit is */
+/* 80 frames round, so frame n is n/80 of a turn.     */
+
+void Fixed_Orbit(Frame *fr, long n)
+{
+    LONG        cosine,sine;
+    int64_t     x,y;
+
+    Cordic((ULONG) (((int64_t) (n % 80) << 32) / 80), &cosine, &sine);
+
+    x = (int64_t) FixFrom.X - FixAt.X;
+    y = (int64_t) FixFrom.Y - FixAt.Y;
+
+    fr->FixFrom.X = FixAt.X + (LONG) ((x * cosine - y * sine) >> FIX_ANGLE);
+    fr->FixFrom.Y = FixAt.Y + (LONG) ((x * sine + y * cosine) >> FIX_ANGLE);
+    fr->FixFrom.Z = FixFrom.Z;
+
+    fr->From.X = (float) (fr->FixFrom.X / FIX_SCALE);
+    fr->From.Y = (float) (fr->FixFrom.Y / FIX_SCALE);
+    fr->From.Z = (float) (fr->FixFrom.Z / FIX_SCALE);
+}
+
+
+/* Fixed_View: Calculate_V for -fixed, with UP along  */
+/* the z axis.  V gets the same matrix as floats, for */
+/* the BVH.                                           */
+
+void Fixed_View(Frame *fr)
+{
+    Fixed_3D    a,b,c,*V = fr->FixV;
+    short       i;
+
+    Fixed_Unit((int64_t) FixAt.X - fr->FixFrom.X,
+               (int64_t) FixAt.Y - fr->FixFrom.Y,
+               (int64_t) FixAt.Z - fr->FixFrom.Z, FIX_VIEW, &c);
+
+    /* a = c x UP */
+
+    Fixed_Unit(c.Y, -c.X, 0, FIX_VIEW, &a);
+
+    /* b = a x c */
+
+    b.X = (LONG) (((int64_t) a.Y * c.Z - (int64_t) a.Z * c.Y) >> FIX_VIEW);
+    b.Y = (LONG) (((int64_t) a.Z * c.X - (int64_t) a.X * c.Z) >> FIX_VIEW);
+    b.Z = (LONG) (((int64_t) a.X * c.Y - (int64_t) a.Y * c.X) >> FIX_VIEW);
+
+    V[0].X = a.X;
+    V[1].X = a.Y;
+    V[2].X = a.Z;
+
+    V[0].Y = b.X;
+    V[1].Y = b.Y;
+    V[2].Y = b.Z;
+
+    V[0].Z = c.X;
+    V[1].Z = c.Y;
+    V[2].Z = c.Z;
+
+    for (i = 0; i < 3; i++) {
+        fr->V[i].X = (float) V[i].X / (float) (1L << FIX_VIEW);
+        fr->V[i].Y = (float) V[i].Y / (float) (1L << FIX_VIEW);
+        fr->V[i].Z = (float) V[i].Z / (float) (1L << FIX_VIEW);
+    }
+}
+
+
+/* Transform_Fixed: Transform_Scalar for -fixed.  It  */
+/* takes two divisions rather than one, since a       */
+/* whole number 1/z doesn't have the bits to scale X  */
+/* and Y with.                                        */
+
+void Transform_Fixed(Frame *fr, long start, long end)
+{
+    long        i;
+    int64_t     x,y,z,vx,vy,vz,sx,sy,w,limit;
+    Fixed_3D    *V = fr->FixV;
+
+    limit = (int64_t) COORD_LIMIT << FIX_SUB;
+
+    for (i = start; i < end; i++) {
+        x = (int64_t) Fixed_Data.X[i] - fr->FixFrom.X;
+        y = (int64_t) Fixed_Data.Y[i] - fr->FixFrom.Y;
+        z = (int64_t) Fixed_Data.Z[i] - fr->FixFrom.Z;
+
+        vz = (x*V[0].Z + y*V[1].Z + z*V[2].Z) >> (FIX_VIEW - FIX_FRAC);
+
+        if (vz > 0) {
+            vx = (x*V[0].X + y*V[1].X + z*V[2].X) >> (FIX_VIEW - FIX_FRAC);
+            vy = (x*V[0].Y + y*V[1].Y + z*V[2].Y) >> (FIX_VIEW - FIX_FRAC);
+            sx = vx * FixMultX / vz;
+            sy = vy * FixMultY / vz;
+            sx = (sx > limit) ? limit : (sx < -limit) ? -limit : sx;
+            sy = (sy > limit) ? limit : (sy < -limit) ? -limit : sy;
+            w  = ((int64_t) 1 << FixDepthShift) / vz;
+            w  = (w < (1L << FIX_DEPTH)) ? w : (1L << FIX_DEPTH) - 1;
+
+            fr->Display[i].X = (HALFX << FIX_SUB) + (LONG) sx;
+            fr->Display[i].Y = (HALFY << FIX_SUB) - (LONG) sy;
+            fr->Display[i].Z = 1;
+            fr->Display[i].W = (float) w;
+        } else
+            fr->Display[i].Z = -1;
+    }
+}
+
+
+/* Fixed_Color: FaceColor for -fixed, for face n of   */
+/* the object.                                        */
+
+short Fixed_Color(Frame *fr, long n)
+{
+    Fixed_Info  *info = &Fixed_Faces[n];
+    int64_t     x,y,z,dot;
+    ULONG       len;
+    short       count;
+
+    dot = ((int64_t) fr->FixFrom.X - info->Centroid.X) * info->Normal.X +
+          ((int64_t) fr->FixFrom.Y - info->Centroid.Y) * info->Normal.Y +
+          ((int64_t) fr->FixFrom.Z - info->Centroid.Z) * info->Normal.Z;
+    if (!(dot > 0))
+        return (-1);
+
+/* The cosine is the dot product over the length of   */
+/* the vector to the light, which saves making it a   */
+/* unit vector first.                                 */
+
+    x = (int64_t) FixLight.X - info->Centroid.X;
+    y = (int64_t) FixLight.Y - info->Centroid.Y;
+    z = (int64_t) FixLight.Z - info->Centroid.Z;
+    dot = x * info->Normal.X + y * info->Normal.Y + z * info->Normal.Z;
+    len = Int_Sqrt((uint64_t) (x * x + y * y + z * z));
+    dot = (dot > 0 && len > 0) ? dot / len : 0;
+
+    count = (short) (((FixAmbient + ((FixDiffuse * dot) >> FIX_NORMAL)) *
+                      61) >> FIX_NORMAL);
+    if (count > 60)
+        count = 60;
+    return (count);
+}
+
+
+/* Fixed_Distance: the square of how far face n is    */
+/* from FixFrom, as a float for Face_Key; every whole */
+/* number converts to the same float anywhere.        */
+
+float Fixed_Distance(Frame *fr, long n)
+{
+    int64_t     x,y,z;
+
+    x = (int64_t) fr->FixFrom.X - Fixed_Faces[n].Centroid.X;
+    y = (int64_t) fr->FixFrom.Y - Fixed_Faces[n].Centroid.Y;
+    z = (int64_t) fr->FixFrom.Z - Fixed_Faces[n].Centroid.Z;
+    return ((float) (x * x + y * y + z * z));
+}
+
+
+/* Step_Start: set s to v0 plus t/den of the way to   */
+/* v0 + dv, stepping a pixel (16 units of t) at a     */
+/* time.                                              */
+
+void Step_Start(Fixed_Step *s, int64_t v0, int64_t dv, int64_t den,
+                int64_t t)
+{
+    int64_t     rest;
+
+    s->At    = v0 + Floor_Div(t * dv, den, &rest);
+    s->Rest  = (LONG) rest;
+    s->Step  = Floor_Div(dv * (1 << FIX_SUB), den, &rest);
+    s->Extra = (LONG) rest;
+    s->Per   = (LONG) den;
+}
+
+
+void Step_Next(Fixed_Step *s)
+{
+    s->At += s->Step;
+    if ((s->Rest += s->Extra) >= s->Per) {
+        s->Rest -= s->Per;
+        s->At++;
+    }
+}
+
+
+/* Fill_Fixed: FillPolygon for -fixed.  A pixel is    */
+/* filled if its center, 8/16 of the way into it, is  */
+/* inside, so it's line y for every edge from its     */
+/* top to its bottom crossing 16y + 8.  Each edge     */
+/* starts stepping at the first line in clip it       */
+/* covers, which gives the same crossings as starting */
+/* from the top.                                      */
+
+void Fill_Fixed(Frame *fr, Box *clip, Display_Point *Points,
+                long count, UBYTE shade, Scratch *s)
+{
+    FrameBuffer *f = &fr->Buffer;
+    Fixed_Edge  *Edges = s->FixEdges, *e;
+    Fixed_Step  sw;
+    LONG        *CrossX = s->FixX, *CrossW = s->FixW, x, w;
+    long        i,j,k,n,y,ymin,ymax,x1,x2;
+    UBYTE       *line;
+    float       *depth;
+
+    n = 0;
+    ymin = ymax = Points[0].Y;
+    for (i = 0, j = count - 1; i < count; j = i++) {
+        if (Points[i].Y < ymin)
+            ymin = Points[i].Y;
+        else if (Points[i].Y > ymax)
+            ymax = Points[i].Y;
+
+        if (Points[i].Y == Points[j].Y)
+            continue;
+
+        if (Points[i].Y < Points[j].Y)
+            k = i;
+        else
+            k = j;
+        e = &Edges[n];
+        e->Top    = (LONG) Floor_Div(Points[k].Y + 7, 16, NULL);
+        e->Bottom = (LONG) Floor_Div(Points[i+j-k].Y + 7, 16, NULL);
+        if (e->Top < clip->Top)
+            e->Top = clip->Top;
+        if (e->Top >= e->Bottom)
+            continue;
+        Step_Start(&e->X, Points[k].X,
+                   (int64_t) Points[i+j-k].X - Points[k].X,
+                   (int64_t) Points[i+j-k].Y - Points[k].Y,
+                   ((int64_t) e->Top << FIX_SUB) + 8 - Points[k].Y);
+        Step_Start(&e->W, (int64_t) Points[k].W,
+                   (int64_t) Points[i+j-k].W - (int64_t) Points[k].W,
+                   (int64_t) Points[i+j-k].Y - Points[k].Y,
+                   ((int64_t) e->Top << FIX_SUB) + 8 - Points[k].Y);
+        n++;
+    }
+
+    ymin = (long) Floor_Div(ymin + 7, 16, NULL);
+    ymax = (long) Floor_Div(ymax + 7, 16, NULL);
+    if (ymin < clip->Top)
+        ymin = clip->Top;
+    if (ymax > clip->Bottom)
+        ymax = clip->Bottom;
+
+    line = f->Pixels + TILE_OFFSET(clip->Left, ymin) - clip->Left;
+
+    for (y = ymin; y < ymax; y++, line += TILE_SIZE) {
+        k = 0;
+        for (i = 0; i < n; i++) {
+            e = &Edges[i];
+            if (y < e->Top || y >= e->Bottom)
+                continue;
+            x = (LONG) e->X.At;
+            w = (LONG) e->W.At;
+            Step_Next(&e->X);
+            Step_Next(&e->W);
+            for (j = k++; j > 0 && CrossX[j-1] > x; j--) {
+                CrossX[j] = CrossX[j-1];
+                CrossW[j] = CrossW[j-1];
+            }
+            CrossX[j] = x;
+            CrossW[j] = w;
+        }
+
+        for (i = 0; i + 1 < k; i += 2) {
+            x1 = (long) Floor_Div((int64_t) CrossX[i] + 7, 16, NULL);
+            x2 = (long) Floor_Div((int64_t) CrossX[i+1] + 7, 16, NULL);
+            if (x1 < clip->Left)
+                x1 = clip->Left;
+            if (x2 > clip->Right)
+                x2 = clip->Right;
+            if (x1 >= x2)
+                continue;
+
+            if (!f->Depth) {
+                memset(line + x1, shade, x2 - x1);
+                continue;
+            }
+
+            depth = f->Depth + (line - f->Pixels);
+            Step_Start(&sw, CrossW[i], (int64_t) CrossW[i+1] - CrossW[i],
+                       (int64_t) CrossX[i+1] - CrossX[i],
+                       ((int64_t) x1 << FIX_SUB) + 8 - CrossX[i]);
+            for (j = x1; j < x2; j++, Step_Next(&sw))
+                if ((float) sw.At > depth[j]) {
+                    depth[j] = (float) sw.At;
+                    line[j]  = shade;
+                }
+        }
+    }
+}
+
+#endif
+
+
+/* Display a single face.  Since the Area... routines */
+/* will crash if you try to draw something too large, */
+/* this routine first gathers all the points into a   */
+/* temporary array, checks to make sure that the      */
+/* total size of the face will fit in our TmpRas, and */
+/* if so it calls AreaMove, AreaDraw and AreaEnd to   */
+/* draw the face.  It also sets up the area pattern   */
+/* to handle dithering.                               */
+
+
+/* GatherFace: gather the display points of face n    */
+/* into the Points array and return how many there    */
+/* are.  If any of the points are behind the viewer   */
+/* it returns 0, since we won't draw the face.        */
+/* When streaming, Display holds a point for each     */
+/* connection from fr->Base on rather than for each   */
+/* vertex.                                            */
+
+long GatherFace(Frame *fr, long n, Display_Point *Points)
+{
+    long        nextpoint, last;
+    long        pointnum;
+    Display_Point *Display = fr->Display;
+    Level       *l = fr->Detail;
+
+    nextpoint = l->Faces[n].start;
+    last      = l->Faces[n].end;
+    pointnum  = 0;
+
+    while (nextpoint <= last) {
+        if (Streaming)
+            Points[pointnum] = Display[nextpoint - fr->Base];
+        else
+            Points[pointnum] = Display[LEVEL_VERTEX(l, nextpoint)];
+        if (Points[pointnum++].Z <= 0)
+            return (0);
+        nextpoint++;
+    }
+
+    return (pointnum);
+}
+
+
+void ShowFace(Frame *fr, long n, short color)
+{
+    long        i,pointnum;
+
+    LONG        x1,x2,y1,y2,p;
+
+    Display_Point *Points = Scratch_List[ThreadIndex].Points;
+#ifdef HEADLESS
+    Drawing     *d;
+#endif
+
+/* Gather the points into the Points array.           */
+
+    if (!(pointnum = GatherFace(fr, n, Points)))
+        return;
+
+/* Make sure the face fits within the TmpRas          */
+
+    x1 = x2 = Points[0].X;
+    y1 = y2 = Points[0].Y;
+
+    for (i = 1; i < pointnum; i++) {
+        p = Points[i].X;
+        if (p < x1)
+            x1 = p;
+        else if (p > x2)
+            x2 = p;
+
+        p = Points[i].Y;
+        if (p < y1)
+            y1 = p;
+        else if (p > y2)
+            y2 = p;
+    }
+
+#ifdef HEADLESS
+
+/* With -fixed the points are in 16ths of a pixel,    */
+/* and this is exactly the pixels whose centers are   */
+/* in the box, up to but not including x2,y2; a face  */
+/* that slips between them all has nothing to draw.   */
+
+    if (FixedPoint) {
+        x1 = (LONG) Floor_Div(x1 + 7, 16, NULL);
+        y1 = (LONG) Floor_Div(y1 + 7, 16, NULL);
+        x2 = (LONG) Floor_Div(x2 + 7, 16, NULL);
+        y2 = (LONG) Floor_Div(y2 + 7, 16, NULL);
+        if (x1 >= x2 || y1 >= y2)
+            return;
+    }
+#endif
+
+#ifndef HEADLESS
+    if (((x2-x1) > MAXX) ||
+        ((y2-y1) > MAXY))
+        return;
+
+/* The AreaInfos only have room for 20 vertices.      */
+
+    if (pointnum >= 20)
+        return;
+#endif
+
+    if ((y2 < 0)         ||
+        (y1 >= MAXY)     ||
+        (x2 < 0)         ||
+        (x1 >= MAXX))
+        return;
+
+#ifdef HEADLESS
+
+/* Without a palette we can just use the 61 shades    */
+/* directly, so there's no need to dither.  The face  */
+/* isn't actually drawn until ShowObject has been     */
+/* through them all: for now just note it down.       */
+
+    d = &fr->Drawings[fr->DrawCount++];
+    d->Face  = n;
+    d->Shade = (UBYTE) ((color * 255L) / 60);
+    d->Bounds.Left   = (x1 < 0) ? 0 : x1;
+    d->Bounds.Top    = (y1 < 0) ? 0 : y1;
+    d->Bounds.Right  = (x2 > MAXX) ? MAXX : x2;
+    d->Bounds.Bottom = (y2 > MAXY) ? MAXY : y2;
+#else
+
+/* Set up the colors and patterns for dithering       */
+
+    switch(color % 4) {
+
+      case 0 : SetAPen(rp, color >> 2);
+               SetDrMd(rp, JAM1);
+               SetAfPt(rp, &SolidPattern, 0);
+               break;
+      case 1 : SetAPen(rp, (color >> 2)+1);
+               SetBPen(rp, color >> 2);
+               SetDrMd(rp, JAM2);
+               SetAfPt(rp, OddCheck, 1);
+               break;
+      case 2 : SetAPen(rp, color >> 2);
+               SetBPen(rp, (color >> 2) + 1);
+               SetDrMd(rp, JAM2);
+               SetAfPt(rp, EvenCheck, 1);
+               break;
+      case 3 : SetAPen(rp, color >> 2);
+               SetBPen(rp, (color >> 2) + 1);
+               SetDrMd(rp, JAM2);
+               SetAfPt(rp, OddCheck, 1);
+               break;
+    }
+
+/* Actually draw the face                             */
+
+    AreaMove(rp,Points[0].X,Points[0].Y);
+    for (i = 1; i < pointnum; i++)
+        AreaDraw(rp, Points[i].X,Points[i].Y);
+    AreaEnd(rp);
+#endif
+}
+
+
+#ifdef HEADLESS
+
+/* DrawTile: fill in one tile of the framebuffer,     */
+/* drawing every face in its bin in the order         */
+/* ShowFace saw them.  Since no two tiles share a     */
+/* pixel they can all be drawn at once.               */
+
+void DrawTile(void *frame, long tile)
+{
+    Frame         *fr = frame;
+    FrameBuffer   *fb = &fr->Buffer;
+    long          i,count;
+    Box           clip;
+    Drawing       *d;
+    Scratch       *s = &Scratch_List[ThreadIndex];
+
+    clip.Left   = (tile % TILES_ACROSS) * TILE_SIZE;
+    clip.Top    = (tile / TILES_ACROSS) * TILE_SIZE;
+    clip.Right  = clip.Left + TILE_SIZE;
+    clip.Bottom = clip.Top  + TILE_SIZE;
+    if (clip.Right > fb->Width)
+        clip.Right = fb->Width;
+    if (clip.Bottom > fb->Height)
+        clip.Bottom = fb->Height;
+
+    for (i = fr->BinStart[tile]; i < fr->BinStart[tile+1]; i++) {
+        d = &fr->Drawings[fr->Bins[i]];
+        count = GatherFace(fr, d->Face, s->Points);
+        if (Shading == SHADE_PHONG)
+            Phong_Attrs(fr, d->Face, s->Points, s->Attrs);
+        else if (Shading == SHADE_GOURAUD)
+            Gouraud_Attrs(fr, d->Face, s->Points, s->Attrs);
+        if (FixedPoint)
+            Fill_Fixed(fr, &clip, s->Points, count, d->Shade, s);
+        else
+            FillPolygon(fr, &clip, s->Points, count, d->Shade, s);
+    }
+}
+
+
+/* DrawAll: sort the frame's drawings into a bin for  */
+/* each tile they touch, then draw the tiles on as    */
+/* many threads as we've got.  The bins are filled    */
+/* in drawing order, so the picture comes out the     */
+/* same however many threads there are.               */
+
+void DrawAll(Frame *fr)
+{
+    long        i,t,tx,ty,total;
+    Drawing     *d;
+
+    Arena_Reset(&fr->Temp);
+    for (t = 0; t <= TILES_ACROSS * TILES_DOWN; t++)
+        fr->BinStart[t] = 0;
+
+/* First count how many drawings land in each tile,   */
+/* so we know where each bin starts.                  */
+
+    for (i = 0; i < fr->DrawCount; i++) {
+        d = &fr->Drawings[i];
+        if (d->Bounds.Left >= d->Bounds.Right ||
+            d->Bounds.Top >= d->Bounds.Bottom)
+            continue;
+        for (ty = d->Bounds.Top / TILE_SIZE;
+             ty <= (d->Bounds.Bottom - 1) / TILE_SIZE; ty++)
+            for (tx = d->Bounds.Left / TILE_SIZE;
+                 tx <= (d->Bounds.Right - 1) / TILE_SIZE; tx++)
+                fr->BinStart[ty * TILES_ACROSS + tx + 1]++;
+    }
+
+    for (t = 0; t < TILES_ACROSS * TILES_DOWN; t++) {
+        fr->BinStart[t+1] += fr->BinStart[t];
+        fr->BinNext[t] = fr->BinStart[t];
+    }
+
+    total = fr->BinStart[TILES_ACROSS * TILES_DOWN];
+    fr->Bins = Arena_Get(&fr->Temp, total * sizeof(long));
+
+/* Then go round again and drop them in.              */
+
+    for (i = 0; i < fr->DrawCount; i++) {
+        d = &fr->Drawings[i];
+        if (d->Bounds.Left >= d->Bounds.Right ||
+            d->Bounds.Top >= d->Bounds.Bottom)
+            continue;
+        for (ty = d->Bounds.Top / TILE_SIZE;
+             ty <= (d->Bounds.Bottom - 1) / TILE_SIZE; ty++)
+            for (tx = d->Bounds.Left / TILE_SIZE;
+                 tx <= (d->Bounds.Right - 1) / TILE_SIZE; tx++)
+                fr->Bins[fr->BinNext[ty * TILES_ACROSS + tx]++] = i;
+    }
+
+    RunJobs(DrawTile, fr, TILES_ACROSS * TILES_DOWN);
+
+    fr->DrawCount = 0;
+}
+
+#endif
+
+
+/* This function is used by the qsort() routine to    */
+/* sort the faces from farthest to nearest.           */
+
+int CompareFaces(Face_Key *f1, Face_Key *f2)
+{
+    if (f1->distance < f2->distance)
+        return(1);
+    else if (f1->distance > f2->distance)
+        return(-1);
+    else
+        return(0);
+}
+
+
+/* Depth_Key: turn a face's distance into a number    */
+/* that gets smaller as the distance gets bigger.     */
+/* The bits of a float that isn't negative sort the   */
+/* same way as the float itself.                      */
+
+ULONG Depth_Key(Face_Key *key)
+{
+    ULONG       bits;
+
+    memcpy(&bits, &key->distance, sizeof(bits));
+    return (~bits);
+}
+
+
+/* Radix_Sort: sort count keys farthest to nearest,   */
+/* RADIX_BITS of their Depth_Key at a time starting   */
+/* from the bottom.  Each pass keeps the order of     */
+/* the last for keys that are the same so far, so     */
+/* faces the same distance away stay in the order     */
+/* they came.  Buckets for every pass are counted in  */
+/* one go, and a pass that would put everything in    */
+/* the same bucket is skipped.                        */
+
+void Radix_Sort(Frame *fr, Face_Key *keys, long count)
+{
+    Face_Key    *from = keys, *to = fr->Spare, *t;
+    LONG        *b, n, sum;
+    ULONG       k;
+    long        i,pass,shift;
+
+    if (count < 2)
+        return;
+
+    memset(fr->Buckets, 0, RADIX_PASSES * RADIX_SIZE * sizeof(LONG));
+    for (i = 0; i < count; i++) {
+        k = Depth_Key(&keys[i]);
+        for (pass = 0; pass < RADIX_PASSES; pass++)
+            fr->Buckets[pass * RADIX_SIZE +
+                        ((k >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1))]++;
+    }
+
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+        b = fr->Buckets + pass * RADIX_SIZE;
+        shift = pass * RADIX_BITS;
+        if (b[(Depth_Key(&from[0]) >> shift) & (RADIX_SIZE - 1)] == count)
+            continue;
+
+        for (sum = 0, i = 0; i < RADIX_SIZE; i++) {
+            n = b[i];
+            b[i] = sum;
+            sum += n;
+        }
+        for (i = 0; i < count; i++)
+            to[b[(Depth_Key(&from[i]) >> shift) & (RADIX_SIZE - 1)]++] =
+                from[i];
+
+        t = from;
+        from = to;
+        to = t;
+    }
+
+    if (from != keys)
+        memcpy(keys, from, count * sizeof(Face_Key));
+}
+
+
+/* Face_Distances: work out how far each of count     */
+/* faces in keys is from From (or rather the square   */
+/* of it, which sorts the same), measuring to the     */
+/* middle of the face.                                */
+
+void Face_Distances(Frame *fr, Face_Key *keys, long count)
+{
+    long        i;
+    Point_3D    Back;
+    Face_Info   *Data = fr->Detail->Data;
+
+#ifdef HEADLESS
+    if (FixedPoint) {
+        for (i=0; i<count; i++)
+            keys[i].distance = Fixed_Distance(fr, keys[i].face);
+        return;
+    }
+#endif
+
+    for (i=0; i<count; i++) {
+        Minus(fr->From,Data[keys[i].face].Centroid,&Back);
+        keys[i].distance = DotProduct(Back,Back);
+    }
+}
+
+
+/* Sort the faces from farthest to nearest, measuring */
+/* the distance from From to the middle of each face. */
+/* Only the first count faces in fr->Order are        */
+/* sorted.                                            */
+
+void SortFaces(Frame *fr, long count)
+{
+    double      start;
+
+    start = Seconds();
+
+    switch (SortMethod) {
+      case SORT_QSORT:
+        Face_Distances(fr, fr->Order, count);
+        qsort(fr->Order,count,sizeof(Face_Key),
+              (int (*)(const void *, const void *)) CompareFaces);
+        break;
+      case SORT_RADIX:
+        Face_Distances(fr, fr->Order, count);
+        Radix_Sort(fr, fr->Order, count);
+        break;
+    }
+
+    fr->SortTime += Seconds() - start;
+    fr->SortedFaces += count;
+}
+
+
+/* Hidden: return 1 if none of node's faces could     */
+/* possibly be drawn, because they're all facing      */
+/* away or all beyond the same edge of the screen     */
+/* (or behind the viewer).                            */
+
+/* A face is facing away if Normal . (From - C) <= 0, */
+/* C being its centroid.  Since the normal is within  */
+/* the cone and C within Radius of Center, that's at  */
+/* most Radius plus the most any normal in the cone   */
+/* can have in the direction of From - Center.        */
+
+/* For the edges, the corners of the box are put      */
+/* into view coordinates.  If they're all on the far  */
+/* side of one of the planes through the viewer and   */
+/* an edge of the screen (with a pixel or two to      */
+/* spare), so is everything in between.               */
+
+#define CULL_MARGIN     2.0
+
+short Hidden(Frame *fr, BVH_Node *node)
+{
+    Point_3D    D,P,*V = fr->V;
+    float       d,cosa,sina,x,y,z;
+    short       i,left,right,top,bottom,behind;
+
+    if (node->CosSpread > 0.0) {
+        Minus(fr->From, node->Center, &D);
+        d = Magnitude(&D);
+        if (d > node->Radius) {
+            cosa = DotProduct(D, node->Axis) / d;
+            sina = 1.0 - cosa * cosa;
+            sina = (sina > 0.0) ? fsqrt(sina) : 0.0;
+            if (cosa < node->CosSpread &&
+                d * (cosa * node->CosSpread + sina * node->SinSpread) +
+                node->Radius < -0.001 * (d + node->Radius))
+                return (1);
+        }
+    }
+
+    left = right = top = bottom = behind = 0;
+    for (i = 0; i < 8; i++) {
+        P.X = ((i & 1) ? node->Max.X : node->Min.X) - fr->From.X;
+        P.Y = ((i & 2) ? node->Max.Y : node->Min.Y) - fr->From.Y;
+        P.Z = ((i & 4) ? node->Max.Z : node->Min.Z) - fr->From.Z;
+        x = P.X*V[0].X + P.Y*V[1].X + P.Z*V[2].X;
+        y = P.X*V[0].Y + P.Y*V[1].Y + P.Z*V[2].Y;
+        z = P.X*V[0].Z + P.Y*V[1].Z + P.Z*V[2].Z;
+
+        left   += (x * MultX < -(HALFX + CULL_MARGIN) * z);
+        right  += (x * MultX >  (HALFX + CULL_MARGIN) * z);
+        top    += (y * MultY >  (HALFY + CULL_MARGIN) * z);
+        bottom += (y * MultY < -(HALFY + CULL_MARGIN) * z);
+        behind += (z <= 0.0);
+    }
+
+    return (left == 8 || right == 8 || top == 8 || bottom == 8 ||
+            behind == 8);
+}
+
+
+/* Visible_Faces: put the numbers of all the faces    */
+/* worth looking at into fr->Order, and return how    */
+/* many there are.  Without culling, that's all of    */
+/* them, in order.  Only Levels[0] has a BVH.         */
+
+long Visible_Faces(Frame *fr)
+{
+    long        stack[64],depth,count,i;
+    BVH_Node    *node;
+    Level       *l = fr->Detail;
+
+    if (!Culling || !l->BVH) {
+        for (i = 0; i < l->TotalFaces; i++)
+            fr->Order[i].face = i;
+        return (l->TotalFaces);
+    }
+
+    count = 0;
+    depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        node = &l->BVH[stack[--depth]];
+        if (Hidden(fr, node))
+            continue;
+        if (node->Left) {
+            stack[depth++] = node->Right;
+            stack[depth++] = node->Left;
+        } else
+            for (i = node->First; i < node->First + node->Count; i++)
+                fr->Order[count++].face = i;
+    }
+
+    return (count);
+}
+
+
+/* FaceColor: decide how bright a face should be, or  */
+/* return -1 if it's facing away from the viewer.     */
+
+short FaceColor(Frame *fr, Face_Info *info)
+{
+    short       count;
+    Point_3D    Centroid,Normal,Back,L,Reflection;
+    float       CenterDot,ReflectDot;
+
+    Centroid = info->Centroid;
+    Normal   = info->Normal;
+
+/* Calculate the Back vector, which is a vector that  */
+/* points from the middle of the face toward the From */
+/* point.  Only its direction matters here, so it     */
+/* isn't worth making it 1 unit long.                 */
+
+    Minus(fr->From,Centroid,&Back);
+
+/* If the polygon faces us, figure out the correct    */
+/* color and draw it.  The dot product of two unit    */
+/* vectors is the cosine of the angle between them,   */
+/* and cosines of angles > 90 degrees are less than   */
+/* zero (well, this is all obvious, isn't it?), so    */
+/* if the dot product of the normal and the back      */
+/* vectors is less than zero, the face is pointing    */
+/* away from us.                                      */
+
+
+
+    if (!(DotProduct(Normal,Back) > 0))
+        return (-1);
+
+/* Smooth shading lights the face as it's drawn, so   */
+/* all that's wanted here is whether to draw it.      */
+
+    if (Shading != SHADE_FLAT)
+        return (0);
+
+    Minus(fr->Light,Centroid,&L);
+    Normalize(&L);
+    CenterDot = DotProduct(Normal,L);
+    if (CenterDot < 0.0)
+        CenterDot = 0.0;
+
+
+/* The specular part doesn't make much of a           */
+/* contribution in the best of times, so since it     */
+/* takes a while to calculate I've skipped it.        */
+
+
+/*  Reflection = Normal;
+    Reflection.X *= 2.0 * CenterDot;
+    Reflection.Y *= 2.0 * CenterDot;
+    Reflection.Z *= 2.0 * CenterDot;
+    Minus(L,Reflection,&Reflection);
+    ReflectDot = DotProduct(Reflection,Back);
+    if (ReflectDot < 0.0)
+        ReflectDot = 0.0;                             */
+
+
+    count = (short) ((Ambient +
+                      Diffuse * CenterDot 
+  /*  + Specular * fpow(ReflectDot,Sharpness) */
+                      ) * 61.0);
+    if (count > 60)
+        count = 60;
+    return (count);
+}
+
+
+/* Display the object.  For each face, make sure the  */
+/* viewer can see it.  Then figure out the color, and */
+/* call ShowFace.                                     */
+
+/* With a z-buffer there's no need to sort at all:    */
+/* the faces can go in any order.                     */
+/* Either way, only the faces Visible_Faces finds     */
+/* are looked at.  Headless, ShowFace just notes the  */
+/* faces down, and DrawAll draws them afterwards.     */
+
+void ShowObject(Frame *fr)
+{
+    long        i,n,visible;
+    short       count;
+
+    visible = Visible_Faces(fr);
+
+    if (!ZBuffer)
+        SortFaces(fr, visible);
+
+/* Draw all the faces pointed toward us.  The center  */
+/* of the face and its unit outer normal, i.e. a      */
+/* vector 1 unit long that is perpendicular to the    */
+/* face and pointing outward, were worked out by      */
+/* Prepare_Faces.                                     */
+
+    for (i=0; i<visible; i++) {
+
+        n = fr->Order[i].face;
+
+#ifdef HEADLESS
+        if (FixedPoint)
+            count = Fixed_Color(fr, n);
+        else
+#endif
+        count = FaceColor(fr, &fr->Detail->Data[n]);
+
+        if (count >= 0)
+            ShowFace(fr,n,count);
+    }
+}
+
+
+/* Calculate the transformation matrix V.  This       */
+/* matrix depends on the From and At points as well   */
+/* as the UP vector.  As long as none of these change,*/
+/* you don't have to recalculate V.                   */
+
+void Calculate_V(Frame *fr)
+{
+    Point_3D  a,b,c,*V = fr->V;
+
+    Minus(At, fr->From, &c);
+    Normalize(&c);
+
+    CrossProduct(c, UP, &a);
+    Normalize(&a);
+
+    CrossProduct(a,c,&b);
+
+    V[0].X = a.X;
+    V[1].X = a.Y;
+    V[2].X = a.Z;
+
+    V[0].Y = b.X;
+    V[1].Y = b.Y;
+    V[2].Y = b.Z;
+
+    V[0].Z = c.X;
+    V[1].Z = c.Y;
+    V[2].Z = c.Z;
+}
+
+
+
+/* Transform_Scalar: calculate the display            */
+/* coordinates of points start to end-1 from the      */
+/* world coordinates, by way of the view coordinates. */
+/* The points come from fr->Source, which is usually  */
+/* just World_Data.                                   */
+/* It's Minus and VectorMatrix written out by hand,   */
+/* so nothing gets copied around, and it divides      */
+/* only once per point: the 1/z we need anyway for    */
+/* the depth buffer scales both X and Y.              */
+/* Both are held to within COORD_LIMIT of the middle  */
+/* of the screen so they can't overflow a LONG.       */
+
+void Transform_Scalar(Frame *fr, long start, long end)
+{
+    long    i;
+    float   x,y,z,vx,vy,vz,w,sx,sy;
+
+    for (i = start; i < end; i++) {
+        x = fr->Source.X[i] - fr->From.X;
+        y = fr->Source.Y[i] - fr->From.Y;
+        z = fr->Source.Z[i] - fr->From.Z;
+
+        vz = x*fr->V[0].Z + y*fr->V[1].Z + z*fr->V[2].Z;
+
+        if (vz > 0.0) {
+            vx = x*fr->V[0].X + y*fr->V[1].X + z*fr->V[2].X;
+            vy = x*fr->V[0].Y + y*fr->V[1].Y + z*fr->V[2].Y;
+            w  = (float) 1.0 / vz;
+            sx = (vx * w) * MultX;
+            sy = (vy * w) * MultY;
+            sx = (sx > COORD_LIMIT) ? COORD_LIMIT :
+                 (sx < -COORD_LIMIT) ? -COORD_LIMIT : sx;
+            sy = (sy > COORD_LIMIT) ? COORD_LIMIT :
+                 (sy < -COORD_LIMIT) ? -COORD_LIMIT : sy;
+
+            fr->Display[i].X = HALFX + (LONG) sx;
+            fr->Display[i].Y = HALFY - (LONG) sy;
+            fr->Display[i].Z = 1;
+            fr->Display[i].W = w;
+        } else
+            fr->Display[i].Z = -1;
+    }
+}
+
+
+#ifdef SIMD_X86
+
+/* The same transform done 8 points at a time with    */
+/* AVX2, or 4 at a time with SSE2.  The arithmetic    */
+/* is done in exactly the same order as in            */
+/* Transform_Scalar, so the results are identical     */
+/* down to the last bit.  Only the final packing      */
+/* into Display is done one point at a time.          */
+
+__attribute__((target("avx2")))
+void Transform_AVX2(Frame *fr, long start, long end)
+{
+    __m256   fx,fy,fz,ax,ay,az,bx,by,bz,cx,cy,cz,
+             mx,my,zero,one,lo,hi,x,y,z,vx,vy,vz,w;
+    int      SX[8],SY[8],front;
+    float    SW[8];
+    long     i,j;
+
+    fx = _mm256_set1_ps(fr->From.X);
+    fy = _mm256_set1_ps(fr->From.Y);
+    fz = _mm256_set1_ps(fr->From.Z);
+    ax = _mm256_set1_ps(fr->V[0].X);
+    ay = _mm256_set1_ps(fr->V[1].X);
+    az = _mm256_set1_ps(fr->V[2].X);
+    bx = _mm256_set1_ps(fr->V[0].Y);
+    by = _mm256_set1_ps(fr->V[1].Y);
+    bz = _mm256_set1_ps(fr->V[2].Y);
+    cx = _mm256_set1_ps(fr->V[0].Z);
+    cy = _mm256_set1_ps(fr->V[1].Z);
+    cz = _mm256_set1_ps(fr->V[2].Z);
+    mx = _mm256_set1_ps(MultX);
+    my = _mm256_set1_ps(MultY);
+    zero = _mm256_setzero_ps();
+    one  = _mm256_set1_ps(1.0);
+    lo   = _mm256_set1_ps(-COORD_LIMIT);
+    hi   = _mm256_set1_ps(COORD_LIMIT);
+
+    for (i = start; i + 8 <= end; i += 8) {
+        x = _mm256_sub_ps(_mm256_loadu_ps(fr->Source.X + i), fx);
+        y = _mm256_sub_ps(_mm256_loadu_ps(fr->Source.Y + i), fy);
+        z = _mm256_sub_ps(_mm256_loadu_ps(fr->Source.Z + i), fz);
+
+        vx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, ax),
+                                         _mm256_mul_ps(y, ay)),
+                           _mm256_mul_ps(z, az));
+        vy = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, bx),
+                                         _mm256_mul_ps(y, by)),
+                           _mm256_mul_ps(z, bz));
+        vz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, cx),
+                                         _mm256_mul_ps(y, cy)),
+                           _mm256_mul_ps(z, cz));
+
+        front = _mm256_movemask_ps(_mm256_cmp_ps(vz, zero, _CMP_GT_OQ));
+        w = _mm256_div_ps(one, vz);
+
+        x = _mm256_mul_ps(_mm256_mul_ps(vx, w), mx);
+        y = _mm256_mul_ps(_mm256_mul_ps(vy, w), my);
+        x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+        y = _mm256_min_ps(_mm256_max_ps(y, lo), hi);
+        _mm256_storeu_si256((__m256i *) SX, _mm256_cvttps_epi32(x));
+        _mm256_storeu_si256((__m256i *) SY, _mm256_cvttps_epi32(y));
+        _mm256_storeu_ps(SW, w);
+
+        for (j = 0; j < 8; j++)
+            if (front & (1 << j)) {
+                fr->Display[i+j].X = HALFX + SX[j];
+                fr->Display[i+j].Y = HALFY - SY[j];
+                fr->Display[i+j].Z = 1;
+                fr->Display[i+j].W = SW[j];
+            } else
+                fr->Display[i+j].Z = -1;
+    }
+
+    Transform_Scalar(fr, i, end);
+}
+
+
+__attribute__((target("sse2")))
+void Transform_SSE2(Frame *fr, long start, long end)
+{
+    __m128   fx,fy,fz,ax,ay,az,bx,by,bz,cx,cy,cz,
+             mx,my,zero,one,lo,hi,x,y,z,vx,vy,vz,w;
+    int      SX[4],SY[4],front;
+    float    SW[4];
+    long     i,j;
+
+    fx = _mm_set1_ps(fr->From.X);
+    fy = _mm_set1_ps(fr->From.Y);
+    fz = _mm_set1_ps(fr->From.Z);
+    ax = _mm_set1_ps(fr->V[0].X);
+    ay = _mm_set1_ps(fr->V[1].X);
+    az = _mm_set1_ps(fr->V[2].X);
+    bx = _mm_set1_ps(fr->V[0].Y);
+    by = _mm_set1_ps(fr->V[1].Y);
+    bz = _mm_set1_ps(fr->V[2].Y);
+    cx = _mm_set1_ps(fr->V[0].Z);
+    cy = _mm_set1_ps(fr->V[1].Z);
+    cz = _mm_set1_ps(fr->V[2].Z);
+    mx = _mm_set1_ps(MultX);
+    my = _mm_set1_ps(MultY);
+    zero = _mm_setzero_ps();
+    one  = _mm_set1_ps(1.0);
+    lo   = _mm_set1_ps(-COORD_LIMIT);
+    hi   = _mm_set1_ps(COORD_LIMIT);
+
+    for (i = start; i + 4 <= end; i += 4) {
+        x = _mm_sub_ps(_mm_loadu_ps(fr->Source.X + i), fx);
+        y = _mm_sub_ps(_mm_loadu_ps(fr->Source.Y + i), fy);
+        z = _mm_sub_ps(_mm_loadu_ps(fr->Source.Z + i), fz);
+
+        vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, ax),
+                                   _mm_mul_ps(y, ay)),
+                        _mm_mul_ps(z, az));
+        vy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, bx),
+                                   _mm_mul_ps(y, by)),
+                        _mm_mul_ps(z, bz));
+        vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, cx),
+                                   _mm_mul_ps(y, cy)),
+                        _mm_mul_ps(z, cz));
+
+        front = _mm_movemask_ps(_mm_cmpgt_ps(vz, zero));
+        w = _mm_div_ps(one, vz);
+
+        x = _mm_mul_ps(_mm_mul_ps(vx, w), mx);
+        y = _mm_mul_ps(_mm_mul_ps(vy, w), my);
+        x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+        y = _mm_min_ps(_mm_max_ps(y, lo), hi);
+        _mm_storeu_si128((__m128i *) SX, _mm_cvttps_epi32(x));
+        _mm_storeu_si128((__m128i *) SY, _mm_cvttps_epi32(y));
+        _mm_storeu_ps(SW, w);
+
+        for (j = 0; j < 4; j++)
+            if (front & (1 << j)) {
+                fr->Display[i+j].X = HALFX + SX[j];
+                fr->Display[i+j].Y = HALFY - SY[j];
+                fr->Display[i+j].Z = 1;
+                fr->Display[i+j].W = SW[j];
             } else
-                Connections[i] = vertex - 1;
+                fr->Display[i+j].Z = -1;
+    }
+
+    Transform_Scalar(fr, i, end);
+}
+
+#endif
+
+
+/* Transform_Points is whichever of the above this    */
+/* machine can run, picked by ChooseTransform.        */
+
+    void (*Transform_Points)(Frame *, long, long) = Transform_Scalar;
+
+void ChooseTransform()
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        Transform_Points = Transform_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        Transform_Points = Transform_SSE2;
+#endif
+}
+
+
+/* Calculate each of the display coordinates from the */
+/* world coordinates, by way of the view coordinates. */
+
+void Compute_Display_Coords(Frame *fr)
+{
+    Transform_Points(fr, 0, fr->Detail->TotalPoints);
+}
+
+
+/* Choose_Level: pick the level fr will draw.  A      */
+/* vertex of a level is never more than the diagonal  */
+/* of one of its cubes from the vertices it stands    */
+/* for, and nothing on the object can be nearer to    */
+/* the viewer than the edge of the sphere round it,   */
+/* so that says how many pixels out it can be.        */
+
+/* Choose_Detail does the choosing, from any set of   */
+/* levels; Choose_Level chooses from the object's.    */
+
+void Choose_Detail(Frame *fr, Level *levels, long count, Point_3D center,
+                   float radius)
+{
+    long        i;
+    Point_3D    D;
+    float       d,mult;
+
+    fr->Detail = &levels[0];
+
+    Minus(fr->From, center, &D);
+    d = Magnitude(&D) - radius;
+    mult = (MultX > MultY) ? MultX : MultY;
+
+    for (i = count - 1; i > 0 && d > 0.0; i--)
+        if (levels[i].Cell * fsqrt(3.0) * mult <= LOD_PIXELS * d) {
+            fr->Detail = &levels[i];
+            break;
+        }
+
+    fr->Source = fr->Detail->Points;
+}
+
+void Choose_Level(Frame *fr)
+{
+    Choose_Detail(fr, Levels, LevelCount, LodCenter, LodRadius);
+}
+
+
+
+/* Calculate everything we need to display the object */
+
+void CalculateDisplay(Frame *fr)
+{
+    Choose_Level(fr);
+    Calculate_V(fr);
+#ifdef HEADLESS
+    if (FixedPoint)
+        Fixed_View(fr);
+#endif
+
+    Compute_Display_Coords(fr);
+#ifdef HEADLESS
+    if (Shading == SHADE_GOURAUD)
+        Light_Vertices(fr);
+#endif
+}
+
+
+/* OrbitCamera: put fr's camera where it belongs on   */
+/* frame n of the orbit, which is From turned n       */
+/* times PI/40 about a vertical line through At.      */
+/* Working it out from n rather than a step at a      */
+/* time means any frame can be drawn first.           */
+
+void OrbitCamera(Frame *fr, long n)
+{
+    fr->Number = n;
+    RotateZ(From,At,(float) (n * (PI / 40.0)),&fr->From);
+    fr->Light = Light;
+#ifdef HEADLESS
+    if (FixedPoint)
+        Fixed_Orbit(fr, n);
+#endif
+}
+
+
+
+#ifndef HEADLESS
+
+/* Main.  Set up some default values, then draw the   */
+/* object as the From point moves around.             */
+
+main(int argc, char *argv[])
+{
+
+    long  i;
+    long  quitsignal;
+    long  start,end;
+    Frame *fr;
+
+    if (argc < 2)
+        Quit("Usage: 3d objectfile");
+
+    if (!(IntuitionBase = (void *)
+            OpenLibrary("intuition.library",0L)))
+        Quit("No Intuition");
+
+    if (!(GfxBase = (void *)
+            OpenLibrary("graphics.library",0L)))
+        Quit("No Graphics");
+
+    OpenDisplay();
+
+    ReadObjectFile(argv[1]);
+
+    Prepare_Faces();
+
+    Build_BVH();
+
+    SetDefaults();
+
+    OpenFrames(1);
+    fr = &Frame_List[0];
+    fr->From = From;
+    fr->Light = Light;
+
+/* The program will quit if we get any IDCMP          */
+/* messages from either window.                       */
+
+    quitsignal =(1 << window1->UserPort->mp_SigBit) |
+                (1 << window2->UserPort->mp_SigBit);
+
+    while (!(SetSignal(0,0) & quitsignal)) {
+
+        CalculateDisplay(fr);
+        SetRast(rp, 0);
+        ShowObject(fr);
+        SwapBuffers();
+
+        RotateZ(fr->From,At,(PI / 40.0),&fr->From);
+    }
+
+    FreeRaster(RasterBuffer1,MAXX,MAXY);
+    FreeRaster(RasterBuffer2,MAXX,MAXY);
+    CloseFrames();
+    Free_Object();
+
+    CloseWindow(window1);
+    CloseScreen(screen1);
+    CloseWindow(window2);
+    CloseScreen(screen2);
+
+    CloseLibrary(IntuitionBase);
+    CloseLibrary(GfxBase);
+}
+
+#else
+
+/* StreamObject: draw the object without ever having  */
+/* more than a piece of it in memory.  The faces are  */
+/* taken in runs short enough that the vertices of    */
+/* all their connections fit in StreamSlots; these    */
+/* are copied into fr->Source, transformed and drawn  */
+/* (into the depth buffer, so the order doesn't       */
+/* matter), and then that part of the mesh file is    */
+/* let go before the next run.  A vertex shared by    */
+/* several faces is transformed once for each, but    */
+/* that's cheap next to drawing them.                 */
+
+void StreamObject(Frame *fr)
+{
+    long        first,last,i,v,count,lo,hi;
+    short       color;
+    Face_Info   info;
+
+    for (first = 0; first < TotalFaces; first = last) {
+        fr->Base = Face_List[first].start;
+
+        for (last = first; last < TotalFaces &&
+                           last - first < StreamFaces &&
+                           Face_List[last].end - fr->Base < StreamSlots;
+             last++)
+            ;
+
+        count = Face_List[last-1].end - fr->Base + 1;
+        lo = TotalPoints;
+        hi = 0;
+        for (i = 0; i < count; i++) {
+            v = VERTEX(fr->Base + i);
+            fr->Source.X[i] = World_Data.X[v];
+            fr->Source.Y[i] = World_Data.Y[v];
+            fr->Source.Z[i] = World_Data.Z[v];
+            if (v < lo)
+                lo = v;
+            if (v > hi)
+                hi = v;
         }
 
-        fclose(ObjectFile);
-    } else
-        Quit("Could not open input file");
+        Transform_Points(fr, 0, count);
+
+        for (i = first; i < last; i++) {
+            Face_Details(&Levels[0], i, &info);
+            if ((color = FaceColor(fr, &info)) >= 0)
+                ShowFace(fr,i,color);
+        }
+        DrawAll(fr);
+
+        ReleasePoints(lo, hi + 1);
+        ReleaseFaces(first, last);
+    }
 }
 
 
-/* Open a couple of screens and windows.  This        */
-/* program uses two of each for double buffering.     */
-/* Also, this routine jump-starts the double          */
-/* buffering process.                                 */
+/* OpenStream: get ready to stream the object.  It    */
+/* has to be a mapped mesh file.  The runs are made   */
+/* as long as MemCap allows, after the framebuffer,   */
+/* depth buffer and STREAM_EXTRA for the program      */
+/* itself, counting for each connection its copy of   */
+/* the vertex, its display point, the connection      */
+/* itself and the vertex in the file, plus a third    */
+/* of a face and its drawing.  There has to be room   */
+/* for more than the biggest face, so that every run  */
+/* takes at least one whole face.                     */
+
+/* The system maps the file in bigger pieces than we  */
+/* touch (up to 2MB at a time on some), so each of    */
+/* the five arrays being read can have a good deal    */
+/* more of it in memory than the run needs.           */
+/* STREAM_MAPPED allows for that.                     */
+
+void OpenStream()
+{
+    long        i,fixed,slot;
 
-void OpenDisplay()
+    if (!MeshMapped)
+        Quit("Streaming needs a compiled mesh file");
+
+    ZBuffer = 1;
+    Full_Level();
+
+    for (i = 0; i < TotalFaces; i++) {
+        if (Face_List[i].end - Face_List[i].start + 1 > MaxFaceSize)
+            MaxFaceSize = Face_List[i].end - Face_List[i].start + 1;
+        if ((i + 1) % STREAM_BLOCK == 0)
+            Release(Face_List + i + 1 - STREAM_BLOCK,
+                    STREAM_BLOCK * sizeof(Face));
+    }
+
+    if (MemCap) {
+        fixed = FRAME_PIXELS * (1 + sizeof(float)) +
+                STREAM_EXTRA + STREAM_MAPPED +
+                Threads * MaxFaceSize * SCRATCH_SIZE;
+        slot  = 6 * sizeof(float) + sizeof(Display_Point) + IndexSize +
+                (sizeof(Face) + sizeof(Drawing) + 2) / 3;
+        StreamSlots = (MemCap - fixed) / slot;
+    }
+    if (StreamSlots <= MaxFaceSize)
+        Quit("Not enough memory allowed for streaming");
+
+    StreamFaces = StreamSlots / 3 + 1;
+}
+
+/* Prepare_Mesh: work out everything the options      */
+/* call for from the object just read.                */
+/* Prepare_Object goes on to set up the camera and    */
+/* lights for it.                                     */
+
+void Prepare_Mesh()
 {
-    struct ViewPort  *vp;
-    long  i;
+    if (Optimizing)
+        Optimize_Mesh();
+    Prepare_Faces();
+    if (Shading != SHADE_FLAT)
+        Vertex_Normals(&Levels[0]);
+    if (Culling)
+        Build_BVH();
+    if (LevelOfDetail)
+        Build_Levels();
+}
 
-    if (!(screen1 = (void *) OpenScreen(&MyNewScreen)))
-        Quit("Could not open screen");
-    ShowTitle(screen1, FALSE);
+void Prepare_Object()
+{
+    Prepare_Mesh();
+    if (FixedPoint)
+        Prepare_Fixed();
 
-    if (!(screen2 = (void *) OpenScreen(&MyNewScreen)))
-        Quit("Could not open screen");
-    ShowTitle(screen2, FALSE);
+    SetDefaults();
+    if (FixedPoint)
+        Fixed_Defaults();
+    ChooseShader();
+}
 
-    MyNewWindow.Screen = screen1;
 
-    if (!(window1 = (struct Window *)
-                            OpenWindow(&MyNewWindow)))
-        Quit("Could not open the window");
+/* Keep_Mesh: put the object just read and got        */
+/* ready away in m, and clear the globals for the     */
+/* next one.  Use_Mesh brings it back again.          */
 
-    MyNewWindow.Screen = screen2;
-    MyNewWindow.Flags  = BACKDROP | BORDERLESS;
+void Keep_Mesh(Mesh *m)
+{
+    long        i;
+
+    m->TotalPoints = TotalPoints;
+    m->TotalFaces  = TotalFaces;
+    m->ConnectLen  = ConnectLen;
+    m->MaxFaceSize = MaxFaceSize;
+    m->World_Data  = World_Data;
+    m->Face_List   = Face_List;
+    m->Face_Data   = Face_Data;
+    m->Connections = Connections;
+    m->IndexSize   = IndexSize;
+    m->MeshMapped  = MeshMapped;
+    m->BVH         = BVH;
+    m->BVH_Nodes   = BVH_Nodes;
+    m->LevelCount  = LevelCount;
+    m->LodMin      = LodMin;
+    m->LodCenter   = LodCenter;
+    m->LodRadius   = LodRadius;
+    m->FileData    = FileData;
+    m->FileSize    = FileSize;
+    m->MeshArena   = MeshArena;
+    memcpy(m->Levels, Levels, sizeof(Levels));
+
+    m->Min.X = m->Max.X = World_Data.X[0];
+    m->Min.Y = m->Max.Y = World_Data.Y[0];
+    m->Min.Z = m->Max.Z = World_Data.Z[0];
+    for (i = 1; i < TotalPoints; i++)
+        Extend(&m->Min, &m->Max, WorldPoint(i));
+
+    World_Data.X = World_Data.Y = World_Data.Z = NULL;
+    Face_List   = NULL;
+    Face_Data   = NULL;
+    Connections = NULL;
+    MeshMapped  = 0;
+    BVH         = NULL;
+    BVH_Nodes   = 0;
+    LevelCount  = 0;
+    FileData    = NULL;
+    FileSize    = 0;
+    memset(&MeshArena, 0, sizeof(Arena));
+    memset(Levels, 0, sizeof(Levels));
+}
 
-    if (!(window2 = (struct Window *)
-                        OpenWindow(&MyNewWindow)))
-        Quit("Could not open the window");
+void Use_Mesh(Mesh *m)
+{
+    TotalPoints = m->TotalPoints;
+    TotalFaces  = m->TotalFaces;
+    ConnectLen  = m->ConnectLen;
+    MaxFaceSize = m->MaxFaceSize;
+    World_Data  = m->World_Data;
+    Face_List   = m->Face_List;
+    Face_Data   = m->Face_Data;
+    Connections = m->Connections;
+    IndexSize   = m->IndexSize;
+    MeshMapped  = m->MeshMapped;
+    BVH         = m->BVH;
+    BVH_Nodes   = m->BVH_Nodes;
+    LevelCount  = m->LevelCount;
+    LodMin      = m->LodMin;
+    LodCenter   = m->LodCenter;
+    LodRadius   = m->LodRadius;
+    FileData    = m->FileData;
+    FileSize    = m->FileSize;
+    MeshArena   = m->MeshArena;
+    memcpy(Levels, m->Levels, sizeof(Levels));
+}
 
-    frontwindow = window1;
-    ScreenToFront(screen1);
 
-/* Set the colors for each screen to a range of red.  */
+/* Is_Scene: return 1 if fname is a scene file,       */
+/* which is to say the first thing in it other than   */
+/* comments is a mesh line.                           */
 
-    vp = (void *) ViewPortAddress(window1);
-    for (i=0; i<16; i++)
-        SetRGB4(vp,i,i,0,0);
+short Is_Scene(char *fname)
+{
+    FILE        *file;
+    char        line[256],word[16];
+    short       scene = 0;
+
+    if (!(file = fopen(fname, "r")))
+        return (0);
+    while (fgets(line, sizeof(line), file))
+        if (sscanf(line, " %15s", word) == 1 && word[0] != '#') {
+            scene = !strcmp(word, "mesh");
+            break;
+        }
+    fclose(file);
+    return (scene);
+}
 
-    vp = (void *) ViewPortAddress(window2);
-    for (i=0; i<16; i++)
-        SetRGB4(vp,i,i,0,0);
 
-/* Initialize a TmpRas for each window.  The TmpRas   */
-/* is used by the Area routines.                      */
+/* Read_Scene: read the scene file fname, and each    */
+/* object it names.  The first time through just      */
+/* counts the meshes and places; the second reads     */
+/* the objects in, gets each one ready and puts it    */
+/* away with Keep_Mesh, and fills in Instance_List.   */
+/* Turn is Rz(Heading) Ry(Pitch) Rx(Roll).            */
 
-    InitArea(&areainfo1, AreaBuffer1, 20);
+#define SCENE_LINE      1024
+#define SCENE_DEGREE    (atan(1.0) / 45.0)
 
-    RasterBuffer1 = (void *) AllocRaster(MAXX,MAXY);
-    if (!RasterBuffer1)
-        Quit(NO_MEMORY);
+void Read_Scene(char *fname)
+{
+    FILE        *file;
+    char        line[SCENE_LINE],word[16],name[64],object[SCENE_LINE],
+                path[2 * SCENE_LINE],*slash;
+    long        pass,i,dir,found;
+    double      x,y,z,h,p,r,s,ch,sh,cp,sp,cr,sr;
+    Instance    *in;
+
+    if (!(file = fopen(fname, "r")))
+        Quit(BAD_FILE);
+    slash = strrchr(fname, '/');
+    dir = slash ? slash - fname + 1 : 0;
+
+    for (pass = 0; pass < 2; pass++) {
+        rewind(file);
+        MeshCount = InstanceCount = 0;
+
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, " %15s", word) < 1 || word[0] == '#')
+                continue;
+
+            if (!strcmp(word, "mesh")) {
+                if (sscanf(line, " %*s %63s %1023s", name, object) != 2)
+                    Quit(BAD_FILE);
+                if (pass == 1) {
+                    for (i = 0; i < MeshCount; i++)
+                        if (!strcmp(Mesh_List[i].Name, name))
+                            Quit(BAD_FILE);
+                    if (object[0] == '/')
+                        strcpy(path, object);
+                    else
+                        snprintf(path, sizeof(path), "%.*s%s",
+                                 (int) dir, fname, object);
+                    ReadObjectFile(path);
+                    Prepare_Mesh();
+                    Keep_Mesh(&Mesh_List[MeshCount]);
+                    strcpy(Mesh_List[MeshCount].Name, name);
+                }
+                MeshCount++;
+            }
+
+            else if (!strcmp(word, "place")) {
+                h = p = r = 0.0;
+                s = 1.0;
+                i = sscanf(line, " %*s %63s %lf %lf %lf %lf %lf %lf %lf",
+                           name, &x, &y, &z, &h, &p, &r, &s);
+                if ((i != 4 && i != 7 && i != 8) || s <= 0.0)
+                    Quit(BAD_FILE);
+                if (pass == 1) {
+                    for (found = -1, i = 0; i < MeshCount; i++)
+                        if (!strcmp(Mesh_List[i].Name, name))
+                            found = i;
+                    if (found < 0)
+                        Quit(BAD_FILE);
+
+                    in = &Instance_List[InstanceCount];
+                    in->Object = &Mesh_List[found];
+                    in->At.X = x / 10000.0;
+                    in->At.Y = y / 10000.0;
+                    in->At.Z = z / 10000.0;
+                    in->Scale = s;
+
+                    h *= SCENE_DEGREE;
+                    p *= SCENE_DEGREE;
+                    r *= SCENE_DEGREE;
+                    ch = cos(h);  sh = sin(h);
+                    cp = cos(p);  sp = sin(p);
+                    cr = cos(r);  sr = sin(r);
+                    in->Turn[0].X = ch * cp;
+                    in->Turn[0].Y = ch * sp * sr - sh * cr;
+                    in->Turn[0].Z = ch * sp * cr + sh * sr;
+                    in->Turn[1].X = sh * cp;
+                    in->Turn[1].Y = sh * sp * sr + ch * cr;
+                    in->Turn[1].Z = sh * sp * cr - ch * sr;
+                    in->Turn[2].X = -sp;
+                    in->Turn[2].Y = cp * sr;
+                    in->Turn[2].Z = cp * cr;
+                }
+                InstanceCount++;
+            }
+
+            else
+                Quit(BAD_FILE);
+        }
 
-    InitTmpRas(&tmpras1,RasterBuffer1,RASSIZE(MAXX,MAXY));
+        if (pass == 0) {
+            if (!MeshCount || !InstanceCount)
+                Quit(BAD_FILE);
+            Mesh_List = GetMemory(MeshCount * sizeof(Mesh));
+            Instance_List = GetMemory(InstanceCount * sizeof(Instance));
+            memset(Mesh_List, 0, MeshCount * sizeof(Mesh));
+        }
+    }
+    fclose(file);
 
-    rp = window1->RPort;
-    rp->AreaInfo = &areainfo1;
-    rp->TmpRas = &tmpras1;
+    if (Verbose)
+        printf("Read %s: %ld meshes, %ld instances\n",
+               fname, MeshCount, InstanceCount);
+}
 
-    InitArea(&areainfo2, AreaBuffer2, 20);
 
-    RasterBuffer2 = (void *) AllocRaster(MAXX,MAXY);
-    if (!RasterBuffer2)
-        Quit(NO_MEMORY);
+/* Place: where the point P of in's mesh ends up,     */
+/* At + Scale Turn P.                                 */
 
-    InitTmpRas(&tmpras2,RasterBuffer2,RASSIZE(MAXX,MAXY));
+void Place(Instance *in, Point_3D P, Point_3D *Q)
+{
+    Q->X = in->At.X + in->Scale * DotProduct(in->Turn[0], P);
+    Q->Y = in->At.Y + in->Scale * DotProduct(in->Turn[1], P);
+    Q->Z = in->At.Z + in->Scale * DotProduct(in->Turn[2], P);
+}
 
-    rp = window2->RPort;
-    rp->AreaInfo = &areainfo2;
-    rp->TmpRas   = &tmpras2;
+
+/* Unplace: Turn turned back (its transpose) times    */
+/* P, times scale.                                    */
+
+void Unplace(Instance *in, Point_3D P, float scale, Point_3D *Q)
+{
+    Point_3D    *T = in->Turn;
+
+    Q->X = scale * (T[0].X * P.X + T[1].X * P.Y + T[2].X * P.Z);
+    Q->Y = scale * (T[0].Y * P.X + T[1].Y * P.Y + T[2].Y * P.Z);
+    Q->Z = scale * (T[0].Z * P.X + T[1].Z * P.Y + T[2].Z * P.Z);
 }
 
 
+/* Scene_Defaults: the scene's SetDefaults.  The      */
+/* camera takes in the corners of every instance's    */
+/* box.  The frames are then made big enough for the  */
+/* biggest mesh, which is all any of them draws at a  */
+/* time.                                              */
 
+void Scene_Defaults()
+{
+    long        i,j;
+    Point_3D    C,P,Min,Max;
+    Mesh        *m;
+
+    Place(&Instance_List[0], Instance_List[0].Object->Min, &Min);
+    Max = Min;
+    for (i = 0; i < InstanceCount; i++) {
+        m = Instance_List[i].Object;
+        for (j = 0; j < 8; j++) {
+            C.X = (j & 1) ? m->Max.X : m->Min.X;
+            C.Y = (j & 2) ? m->Max.Y : m->Min.Y;
+            C.Z = (j & 4) ? m->Max.Z : m->Min.Z;
+            Place(&Instance_List[i], C, &P);
+            Extend(&Min, &Max, P);
+        }
+    }
+    Aim_Camera(Min.X, Max.X, Min.Y, Max.Y, Min.Z, Max.Z);
+
+    TotalPoints = TotalFaces = 0;
+    for (i = 0; i < MeshCount; i++) {
+        if (Mesh_List[i].TotalPoints > TotalPoints)
+            TotalPoints = Mesh_List[i].TotalPoints;
+        if (Mesh_List[i].TotalFaces > TotalFaces)
+            TotalFaces = Mesh_List[i].TotalFaces;
+    }
+    ChooseShader();
+}
 
-/* Shows the screen we have, presumably, just         */
-/* finished drawing on.  This routine also sets       */
-/* up the correct rastport, so if we always draw      */
-/* into rp we never need to know the details of       */
-/* which screen is in front.                          */
 
-void SwapBuffers()
+/* Instance_View: set fr up to draw in, given the     */
+/* camera From, V and Light of the whole scene.       */
+/* Rather than move each point of the mesh into the   */
+/* scene, the camera and light are moved into the     */
+/* mesh: From and Light by the opposite of in's       */
+/* placing, and V is the view matrix with the         */
+/* placing folded into it, so that the points come    */
+/* out where they would have had they been moved.     */
+/* Depths are the scene's own, so the z-buffer works  */
+/* across instances, and angles are the same as they  */
+/* would be in the scene, so the shading, culling     */
+/* and choice of level all come out the same.         */
+
+void Instance_View(Frame *fr, Instance *in, Point_3D From, Point_3D *V,
+                   Point_3D Light)
 {
-    rp = frontwindow->RPort;
+    Point_3D    D;
+    Mesh        *m = in->Object;
 
-    if (frontwindow == window1) {
-        ScreenToFront(screen2);
-        frontwindow = window2;
-    } else {
-        ScreenToFront(screen1);
-        frontwindow = window1;
+    Minus(From, in->At, &D);
+    Unplace(in, D, 1.0 / in->Scale, &fr->From);
+    Minus(Light, in->At, &D);
+    Unplace(in, D, 1.0 / in->Scale, &fr->Light);
+
+    D.X = V[0].X;  D.Y = V[1].X;  D.Z = V[2].X;
+    Unplace(in, D, in->Scale, &D);
+    fr->V[0].X = D.X;  fr->V[1].X = D.Y;  fr->V[2].X = D.Z;
+
+    D.X = V[0].Y;  D.Y = V[1].Y;  D.Z = V[2].Y;
+    Unplace(in, D, in->Scale, &D);
+    fr->V[0].Y = D.X;  fr->V[1].Y = D.Y;  fr->V[2].Y = D.Z;
+
+    D.X = V[0].Z;  D.Y = V[1].Z;  D.Z = V[2].Z;
+    Unplace(in, D, in->Scale, &D);
+    fr->V[0].Z = D.X;  fr->V[1].Z = D.Y;  fr->V[2].Z = D.Z;
+
+    Choose_Detail(fr, m->Levels, m->LevelCount, m->LodCenter,
+                  m->LodRadius);
+}
+
+
+/* Scene_Order: put the instances in fr->Instances    */
+/* in the order to draw them.  Without a z-buffer     */
+/* that's farthest first, by the middle of each one's */
+/* box, and each is drawn whole before the next, so   */
+/* instances mustn't overlap.                         */
+
+void Scene_Order(Frame *fr)
+{
+    long        i;
+    Point_3D    C,P;
+    Mesh        *m;
+
+    for (i = 0; i < InstanceCount; i++) {
+        fr->Instances[i].face = i;
+        if (ZBuffer)
+            continue;
+        m = Instance_List[i].Object;
+        C.X = (m->Min.X + m->Max.X) / 2.0;
+        C.Y = (m->Min.Y + m->Max.Y) / 2.0;
+        C.Z = (m->Min.Z + m->Max.Z) / 2.0;
+        Place(&Instance_List[i], C, &P);
+        Minus(fr->From, P, &C);
+        fr->Instances[i].distance = DotProduct(C, C);
     }
+    if (!ZBuffer)
+        qsort(fr->Instances, InstanceCount, sizeof(Face_Key),
+              (int (*)(const void *, const void *)) CompareFaces);
 }
 
 
-/* This routine sets the field of view.  The field is */
-/* specified in degrees.                              */
+/* Show_Scene: draw every instance into fr, each in   */
+/* turn the way CalculateDisplay and ShowObject draw  */
+/* the whole object.                                  */
 
-void Set_View_Angle(float theta)
+void Show_Scene(Frame *fr)
 {
-    theta = fabs(theta);
-    if (theta >= 180.0)
-        theta = 179.9;
-    else if (theta == 0.0)
-        theta = 1.0;
+    long        i;
+    Point_3D    From,V[3],Light;
+
+    Calculate_V(fr);
+    From = fr->From;
+    Light = fr->Light;
+    memcpy(V, fr->V, sizeof(V));
+    Scene_Order(fr);
+
+    for (i = 0; i < InstanceCount; i++) {
+        Instance_View(fr, &Instance_List[fr->Instances[i].face],
+                      From, V, Light);
+        Compute_Display_Coords(fr);
+        if (Shading == SHADE_GOURAUD)
+            Light_Vertices(fr);
+        ShowObject(fr);
+        DrawAll(fr);
+    }
 
-    theta = ftan((theta / 2.0) / (180.0 / PI));
+    fr->From = From;
+    fr->Light = Light;
+    memcpy(fr->V, V, sizeof(V));
+}
 
-    MultX = MAXX / (ASPECT * 2.0 * theta);
-    MultY = MAXY / (2.0 * theta);
+
+/* Free_Scene: free every mesh of the scene, and the  */
+/* scene itself.  The frames must be closed first,    */
+/* since they're the size of the biggest mesh.        */
+
+void Free_Scene()
+{
+    long        i;
+
+    for (i = 0; i < MeshCount; i++) {
+        Use_Mesh(&Mesh_List[i]);
+        Free_Object();
+    }
+    FreeMem(Mesh_List, MeshCount * sizeof(Mesh));
+    FreeMem(Instance_List, InstanceCount * sizeof(Instance));
+    Mesh_List = NULL;
+    Instance_List = NULL;
+    MeshCount = InstanceCount = 0;
 }
 
 
-/* After reading in all the data points, come up with */
-/* some plausible default values.                     */
+/* RenderFrame: draw frame n of the orbit into fr,    */
+/* and write it out.                                  */
 
-void SetDefaults()
+void RenderFrame(Frame *fr, long n)
 {
-    short       i;
-    float       MinX,MaxX,
-                MinY,MaxY,
-                MinZ,MaxZ,
-                offset;
+    OrbitCamera(fr, n);
+    SetRast(&fr->Buffer, 0);
+    if (Streaming) {
+        Calculate_V(fr);
+        StreamObject(fr);
+    } else if (InstanceCount)
+        Show_Scene(fr);
+    else {
+        CalculateDisplay(fr);
+        ShowObject(fr);
+        DrawAll(fr);
+    }
+    SwapBuffers(fr);
+}
 
-/*  These Min and Max points define the minimum       */
-/*  bounding box of all the points.  The center       */
-/*  of this box will be the At point.                 */
 
+/* In batch mode every thread draws whole frames, so  */
+/* each one needs a Frame of its own for as long as   */
+/* it's working on one.  There are exactly as many    */
+/* Frames as threads, so one is always free.          */
 
-    MinX = MaxX = World_Data[0].X;
-    MinY = MaxY = World_Data[0].Y;
-    MinZ = MaxZ = World_Data[0].Z;
+    pthread_mutex_t FrameLock = PTHREAD_MUTEX_INITIALIZER;
 
-    for (i = 1; i < TotalPoints; i++) {
-        if (World_Data[i].X < MinX)
-            MinX = World_Data[i].X;
-        else if (World_Data[i].X > MaxX)
-            MaxX = World_Data[i].X;
+void BatchFrame(void *unused, long n)
+{
+    Frame       *fr;
+    long        i;
+
+    pthread_mutex_lock(&FrameLock);
+    for (i = 0; Frame_List[i].Busy; i++)
+        ;
+    fr = &Frame_List[i];
+    fr->Busy = 1;
+    pthread_mutex_unlock(&FrameLock);
+
+    RenderFrame(fr, n);
+
+    pthread_mutex_lock(&FrameLock);
+    fr->Busy = 0;
+    pthread_mutex_unlock(&FrameLock);
+}
 
-        if (World_Data[i].Y < MinY)
-            MinY = World_Data[i].Y;
-        else if (World_Data[i].Y > MaxY)
-            MaxY = World_Data[i].Y;
 
-        if (World_Data[i].Z < MinZ)
-            MinZ = World_Data[i].Z;
-        else if (World_Data[i].Z > MaxZ)
-            MaxZ = World_Data[i].Z;
+/* Otherwise the frames go through a pipeline of two  */
+/* stages.  Pipe_SetUp, on a thread of its own, does  */
+/* everything up to the drawing: it moves the camera, */
+/* transforms the points, culls, sorts and lights the */
+/* faces and notes down the ones to draw.  Pipeline,  */
+/* on the main thread, then clears the framebuffer,   */
+/* fills it with all the threads of the pool and      */
+/* writes it out.  So the next frame is always being  */
+/* set up while this one is filled.  There are        */
+/* PIPE_FRAMES Frames, used in turn, so the set up    */
+/* can get a frame ahead of the filling as well when  */
+/* one frame is quicker to fill than the next.        */
+/* PipeReady counts the frames set up, PipeDone the   */
+/* ones filled.                                       */
+/*                                                    */
+/* A stream or a scene needs each piece drawn before  */
+/* the next is transformed over it, so those are      */
+/* drawn a frame at a time as before.                 */
+
+#define PIPE_FRAMES     3
+
+    pthread_mutex_t PipeLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  PipeChanged = PTHREAD_COND_INITIALIZER;
+    long            PipeReady = 0,
+                    PipeDone = 0;
+
+void *Pipe_SetUp(void *unused)
+{
+    Frame       *fr;
+    long        n;
+
+    InPool = 1;
+    ThreadIndex = ScratchSlots - 1;
+
+    for (n = 0; n < FrameCount; n++) {
+        pthread_mutex_lock(&PipeLock);
+        while (n - PipeDone >= PIPE_FRAMES)
+            pthread_cond_wait(&PipeChanged, &PipeLock);
+        pthread_mutex_unlock(&PipeLock);
+
+        fr = &Frame_List[n % PIPE_FRAMES];
+        OrbitCamera(fr, n);
+        CalculateDisplay(fr);
+        ShowObject(fr);
+
+        pthread_mutex_lock(&PipeLock);
+        PipeReady = n + 1;
+        pthread_cond_broadcast(&PipeChanged);
+        pthread_mutex_unlock(&PipeLock);
     }
 
-/* Set the UP vector to be along the positive         */
-/* z axis.                                            */
+    return (NULL);
+}
 
-    UP.X = 0.0;
-    UP.Y = 0.0;
-    UP.Z = 1.0;
+void Pipeline()
+{
+    Frame       *fr;
+    pthread_t   thread;
+    long        n;
+
+    PipeReady = PipeDone = 0;
+    if (pthread_create(&thread, NULL, Pipe_SetUp, NULL))
+        Quit("Could not start a thread");
+
+    for (n = 0; n < FrameCount; n++) {
+        pthread_mutex_lock(&PipeLock);
+        while (PipeReady <= n)
+            pthread_cond_wait(&PipeChanged, &PipeLock);
+        pthread_mutex_unlock(&PipeLock);
+
+        fr = &Frame_List[n % PIPE_FRAMES];
+        SetRast(&fr->Buffer, 0);
+        DrawAll(fr);
+        SwapBuffers(fr);
+
+        pthread_mutex_lock(&PipeLock);
+        PipeDone = n + 1;
+        pthread_cond_broadcast(&PipeChanged);
+        pthread_mutex_unlock(&PipeLock);
+    }
 
-/* Place the At point in the middle of the            */
-/* bounding box.                                      */
+    pthread_join(thread, NULL);
+}
 
-    At.X = (MinX + MaxX) / 2.0;
-    At.Y = (MinY + MaxY) / 2.0;
-    At.Z = (MinZ + MaxZ) / 2.0;
 
+/* shade generate writes an object made to order, of  */
+/* about as many faces as asked for, so the rest can  */
+/* be timed on objects of any size.  A sphere, blimp  */
+/* or torus (standing on its edge, so the orbit sees  */
+/* it from every side) is a grid of points bent       */
+/* round, with a fan of triangles round each pole of  */
+/* the sphere and blimp; terrain is a flat grid of    */
+/* points lifted by noise that comes from the         */
+/* seed.  Every point is worked out from its place in */
+/* the grid alone, so the object is streamed straight */
+/* to the file, never held in memory, and the same    */
+/* seed always gives the same file.  A name ending in */
+/* .shb gets a compiled mesh, anything else the text  */
+/* format.                                            */
+
+#define GEN_SPHERE      0
+#define GEN_BLIMP       1
+#define GEN_TORUS       2
+#define GEN_TERRAIN     3
+#define GEN_SHAPES      4
+
+#define GEN_PI          3.14159265358979323846
+#define GEN_SIZE        50000000.0
+#define GEN_OCTAVES     8
+#define GEN_BUFFER      (1L << 20)
+#define GEN_MAXFACES    500000000L
+
+    char        *Gen_Names[GEN_SHAPES] = {
+                    "sphere", "blimp", "torus", "terrain" };
+
+/* Gen_Mesh: Rows by Cols points, plus Poles (0 or 2) */
+/* more at the ends, top first.  WrapRows and         */
+/* WrapCols join the last row or column back to the   */
+/* first.                                             */
 
-/* Put the From point just far enough away from the   */
-/* At point that we could see the entire bounding box */
-/* using a field of view of 100.                     */
+    typedef struct {
+        short       Shape,Poles,WrapRows,WrapCols;
+        long        Rows,Cols;
+        long        Points,Faces,ConnectLen;
+        uint64_t    Seed;
+    } Gen_Mesh;
 
-    offset = (MaxX - MinX) / 2.0;
-    if ((MaxZ - MinZ) > (MaxY - MinY))
-        offset += (MaxZ - MinZ) / 2.3;
-    else
-        offset += (MaxY - MinY) / 2.3;
+/* Gen_Out: buffered output to one part of the file,  */
+/* the next byte of which goes At bytes in.           */
 
-    From.X = At.X + offset;
-    From.Y = At.Y;
-    From.Z = At.Z;
+    typedef struct {
+        int         File;
+        int64_t     At;
+        long        Used;
+        char        *Buf;
+    } Gen_Out;
 
 
-/* Place the Light position to the upper right of the */
-/* From point                                         */
+/* Gen_Hash: a well mixed 64 bit number from x.       */
+
+uint64_t Gen_Hash(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (x ^ (x >> 31));
+}
+
+
+/* Gen_Lattice: the noise at corner x,y of the grid   */
+/* for the given octave, between -1 and 1.            */
+
+double Gen_Lattice(Gen_Mesh *m, long octave, long x, long y)
+{
+    uint64_t    h;
+
+    h = Gen_Hash(m->Seed ^ Gen_Hash(((uint64_t) octave << 56) ^
+                 ((uint64_t) x << 28) ^ (uint64_t) y));
+    return ((h >> 11) * (2.0 / 9007199254740992.0) - 1.0);
+}
+
+
+/* Gen_Height: the height of the terrain at u,v,      */
+/* both 0 to 1.  Each octave is noise on a grid       */
+/* twice as fine as the last, at half the height,     */
+/* stopping once it's finer than the terrain's own    */
+/* grid.                                              */
+
+double Gen_Height(Gen_Mesh *m, double u, double v)
+{
+    double      height = 0.0,amp = 0.5,x,y,fx,fy,a,b;
+    long        octave,cells = 4,ix,iy;
+
+    for (octave = 0; octave < GEN_OCTAVES && cells < m->Rows * 2;
+         octave++, cells *= 2, amp *= 0.5) {
+        x = u * cells;
+        y = v * cells;
+        ix = (long) x;
+        iy = (long) y;
+        fx = x - ix;
+        fy = y - iy;
+        fx = fx * fx * (3.0 - 2.0 * fx);
+        fy = fy * fy * (3.0 - 2.0 * fy);
+
+        a = Gen_Lattice(m, octave, ix, iy) +
+            (Gen_Lattice(m, octave, ix + 1, iy) -
+             Gen_Lattice(m, octave, ix, iy)) * fx;
+        b = Gen_Lattice(m, octave, ix, iy + 1) +
+            (Gen_Lattice(m, octave, ix + 1, iy + 1) -
+             Gen_Lattice(m, octave, ix, iy + 1)) * fx;
+        height += (a + (b - a) * fy) * amp;
+    }
+    return (height);
+}
+
+
+/* Gen_Point: point i of m, in the units of an object */
+/* file.                                              */
+
+void Gen_Point(Gen_Mesh *m, long i, int64_t *P)
+{
+    double      x,y,z,theta,phi,r;
+    long        row,col;
+
+    if (i < m->Poles) {
+        x = y = z = 0.0;
+        if (m->Shape == GEN_BLIMP)
+            x = (i ? -GEN_SIZE : GEN_SIZE);
+        else
+            z = (i ? -GEN_SIZE : GEN_SIZE) / 2.0;
+    } else {
+        row = (i - m->Poles) / m->Cols;
+        col = (i - m->Poles) % m->Cols;
+
+        switch (m->Shape) {
+        case GEN_SPHERE:
+            theta = GEN_PI * (row + 1) / (m->Rows + 1);
+            phi   = 2.0 * GEN_PI * col / m->Cols;
+            x = GEN_SIZE / 2.0 * sin(theta) * cos(phi);
+            y = GEN_SIZE / 2.0 * sin(theta) * sin(phi);
+            z = GEN_SIZE / 2.0 * cos(theta);
+            break;
+
+        case GEN_BLIMP:
+            theta = GEN_PI * (row + 1) / (m->Rows + 1);
+            phi   = 2.0 * GEN_PI * col / m->Cols;
+            r = GEN_SIZE * 0.3 * sin(theta) * (1.0 + 0.25 * cos(theta));
+            x = GEN_SIZE * cos(theta);
+            y = r * cos(phi);
+            z = r * sin(phi);
+            break;
+
+        case GEN_TORUS:
+            theta = 2.0 * GEN_PI * row / m->Rows;
+            phi   = 2.0 * GEN_PI * col / m->Cols;
+            r = GEN_SIZE * (0.35 + 0.15 * cos(phi));
+            x = GEN_SIZE * 0.15 * sin(phi);
+            y = r * sin(theta);
+            z = -r * cos(theta);
+            break;
+
+        default:
+            x = GEN_SIZE * (2.0 * row / (m->Rows - 1) - 1.0);
+            y = GEN_SIZE * (2.0 * col / (m->Cols - 1) - 1.0);
+            z = GEN_SIZE * 0.4 *
+                Gen_Height(m, (double) row / (m->Rows - 1),
+                           (double) col / (m->Cols - 1));
+            break;
+        }
+    }
+
+    P[0] = (int64_t) floor(x + 0.5);
+    P[1] = (int64_t) floor(y + 0.5);
+    P[2] = (int64_t) floor(z + 0.5);
+}
+
 
-    Light.X = From.X;
-    Light.Y = From.Y + offset;
-    Light.Z = From.Z + offset;
+/* Gen_Face: the points of face i of m (counting      */
+/* from 0) into v; returns how many.  The faces go    */
+/* top fan, then the grid a row at a time, then       */
+/* bottom fan, each one clockwise seen from outside   */
+/* (from above, for terrain).                         */
 
-/* Set a reasonable field of view                     */
+short Gen_Face(Gen_Mesh *m, long i, LONG *v)
+{
+    long        row,col,next,down,cols,fan;
 
-    Set_View_Angle(100.0);
+#define GRID(r,c)   (m->Poles + ((r) % m->Rows) * m->Cols + (c) % m->Cols)
 
-/* Set some reasonable light values                   */
+    fan  = m->Poles ? m->Cols : 0;
+    cols = m->WrapCols ? m->Cols : m->Cols - 1;
 
-    Ambient   = 0.3;
-    Diffuse   = 0.8;
-    Specular  = 0.2;     /* Not currently used        */
-    Sharpness = 200.0;   /* Not currently used        */
-}
+    if (i < fan) {
+        v[0] = 0;
+        v[1] = GRID(0, i + 1);
+        v[2] = GRID(0, i);
+        return (3);
+    }
+    i -= fan;
+
+    if (i >= m->Faces - 2 * fan) {
+        i -= m->Faces - 2 * fan;
+        v[0] = GRID(m->Rows - 1, i);
+        v[1] = GRID(m->Rows - 1, i + 1);
+        v[2] = 1;
+        return (3);
+    }
 
+    row  = i / cols;
+    col  = i % cols;
+    next = col + 1;
+    down = row + 1;
+    v[0] = GRID(row, col);
+    v[1] = GRID(row, next);
+    v[2] = GRID(down, next);
+    v[3] = GRID(down, col);
+    return (4);
+
+#undef GRID
+}
 
-/* Display a single face.  Since the Area... routines */
-/* will crash if you try to draw something too large, */
-/* this routine first gathers all the points into a   */
-/* temporary array, checks to make sure that the      */
-/* total size of the face will fit in our TmpRas, and */
-/* if so it calls AreaMove, AreaDraw and AreaEnd to   */
-/* draw the face.  It also sets up the area pattern   */
-/* to handle dithering.                               */
 
+/* Gen_Flush and Gen_Put: write out o's buffer, and   */
+/* add n bytes to it.                                 */
 
-void ShowFace(short n, short color)
+void Gen_Flush(Gen_Out *o)
 {
-    short       startpoint, nextpoint;
-    short       i,pointnum;
+    long        done = 0,n;
 
-    short       x1,x2,y1,y2,p;
+    while (done < o->Used) {
+        if ((n = pwrite(o->File, o->Buf + done, o->Used - done,
+                        o->At + done)) <= 0)
+            Quit("Error writing output file");
+        done += n;
+    }
+    o->At += o->Used;
+    o->Used = 0;
+}
 
-    Display_Point Points[12];
+void Gen_Put(Gen_Out *o, void *data, long n)
+{
+    if (o->Used + n > GEN_BUFFER)
+        Gen_Flush(o);
+    memcpy(o->Buf + o->Used, data, n);
+    o->Used += n;
+}
 
 
-/* Gather the points into the Points array.  If any   */
-/* of the points are behind the viewer, don't draw    */
-/* the face.                                          */
+/* Gen_Number: add value to o as text, followed by c. */
+/* This is the inner loop of writing a text object,   */
+/* so it doesn't go through printf.                   */
 
-    startpoint = Face_List[n].start;
-    if (Display[Connections[startpoint]].Z <= 0)
-        return;
+void Gen_Number(Gen_Out *o, int64_t value, char c)
+{
+    char        text[24],*p = text + sizeof(text);
+    uint64_t    u = (value < 0) ? 0 - (uint64_t) value : (uint64_t) value;
+
+    *--p = c;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        *--p = '-';
+    Gen_Put(o, p, text + sizeof(text) - p);
+}
 
-    Points[0] = Display[Connections[startpoint]];
-    pointnum  = 1;
 
-    nextpoint = Face_List[n].start + 1;
+/* Gen_Shape: set m up as about faces faces of shape. */
 
-    while (nextpoint <= Face_List[n].end) {
-        if (Display[Connections[nextpoint]].Z <= 0)
-            return;
-        Points[pointnum++] =
-                     Display[Connections[nextpoint++]];
+void Gen_Shape(Gen_Mesh *m, short shape, long faces, uint64_t seed)
+{
+    long        side;
+
+    memset(m, 0, sizeof(Gen_Mesh));
+    m->Shape = shape;
+    m->Seed  = seed;
+    side = (long) floor(sqrt(faces / 2.0) + 0.5);
+
+    switch (shape) {
+    case GEN_SPHERE:
+    case GEN_BLIMP:
+        m->Poles = 2;
+        m->WrapCols = 1;
+        m->Rows = (side > 3) ? side - 1 : 2;
+        m->Cols = (side > 3) ? 2 * side : 6;
+        m->Faces = (m->Rows + 1) * m->Cols;
+        m->ConnectLen = 4 * m->Faces - 2 * m->Cols;
+        break;
+
+    case GEN_TORUS:
+        m->WrapRows = m->WrapCols = 1;
+        m->Rows = (side > 3) ? 2 * side : 6;
+        m->Cols = (side > 3) ? side : 3;
+        m->Faces = m->Rows * m->Cols;
+        m->ConnectLen = 4 * m->Faces;
+        break;
+
+    default:
+        side = (long) floor(sqrt((double) faces) + 0.5);
+        if (side < 1)
+            side = 1;
+        m->Rows = m->Cols = side + 1;
+        m->Faces = side * side;
+        m->ConnectLen = 4 * m->Faces;
+        break;
     }
+    m->Points = m->Poles + m->Rows * m->Cols;
+}
 
-/* Make sure the face fits within the TmpRas          */
-
-    x1 = x2 = Points[0].X;
-    y1 = y2 = Points[0].Y;
 
-    for (i = 1; i < pointnum; i++) {
-        p = Points[i].X;
-        if (p < x1)
-            x1 = p;
-        else if (p > x2)
-            x2 = p;
+/* Generate: write about faces faces of shape to      */
+/* fname, with the terrain from seed.                 */
 
-        p = Points[i].Y;
-        if (p < y1)
-            y1 = p;
-        else if (p > y2)
-            y2 = p;
+void Generate(char *fname, short shape, long faces, uint64_t seed)
+{
+    Gen_Mesh    m;
+    Gen_Out     out[MESH_SECTIONS];
+    Mesh_Header h;
+    long        length[MESH_SECTIONS],i,sections;
+    int64_t     P[3];
+    LONG        v[4];
+    float       f;
+    short       k,n,compiled,vertex;
+    Face        face;
+    size_t      len = strlen(fname);
+
+    if (faces < 1 || faces > GEN_MAXFACES)
+        Quit(BAD_PARAM);
+    Gen_Shape(&m, shape, faces, seed);
+
+    compiled = (len > 4 && !strcmp(fname + len - 4, ".shb"));
+    sections = compiled ? MESH_SECTIONS : 1;
+
+    memset(out, 0, sizeof(out));
+    if ((out[0].File = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        Quit("Could not open output file");
+    for (k = 0; k < sections; k++) {
+        out[k].File = out[0].File;
+        out[k].Buf  = GetMemory(GEN_BUFFER);
     }
 
-    if (((x2-x1) > MAXX) ||
-        ((y2-y1) > MAXY) ||
-        (y2 < 0)         ||
-        (y1 >= MAXY)     ||
-        (x2 < 0)         ||
-        (x1 >= MAXX))
-        return;
+    if (compiled) {
+        Mesh_Layout(&h, m.Points, m.Faces, m.ConnectLen, length);
+        for (k = 0; k < MESH_SECTIONS; k++)
+            out[k].At = h.Offset[k];
+        if (pwrite(out[0].File, &h, sizeof(h), 0) != sizeof(h))
+            Quit("Error writing output file");
+    } else {
+        Gen_Number(&out[0], m.Points, '\n');
+        Gen_Number(&out[0], m.Faces, '\n');
+        Gen_Number(&out[0], m.ConnectLen, '\n');
+    }
 
-/* Set up the colors and patterns for dithering       */
+    for (i = 0; i < m.Points; i++) {
+        Gen_Point(&m, i, P);
+        for (k = 0; k < 3; k++)
+            if (compiled) {
+                f = (float) (P[k] / 10000.0);
+                Gen_Put(&out[k], &f, sizeof(f));
+            } else
+                Gen_Number(&out[0], P[k], (k == 2) ? '\n' : ' ');
+    }
 
-    switch(color % 4) {
+    face.end = -1;
+    for (i = 0; i < m.Faces; i++) {
+        n = Gen_Face(&m, i, v);
+        if (compiled) {
+            face.start = face.end + 1;
+            face.end  += n;
+            Gen_Put(&out[3], &face, sizeof(face));
+            for (k = 0; k < n; k++)
+                if (h.IndexSize == 2) {
+                    vertex = v[k];
+                    Gen_Put(&out[4], &vertex, sizeof(vertex));
+                } else
+                    Gen_Put(&out[4], &v[k], sizeof(LONG));
+        } else
+            for (k = 0; k < n; k++)
+                Gen_Number(&out[0], (k == n - 1) ? -(v[k] + 1) : v[k] + 1,
+                           (k == n - 1) ? '\n' : ' ');
+    }
 
-      case 0 : SetAPen(rp, color >> 2);
-               SetDrMd(rp, JAM1);
-               SetAfPt(rp, &SolidPattern, 0);
-               break;
-      case 1 : SetAPen(rp, (color >> 2)+1);
-               SetBPen(rp, color >> 2);
-               SetDrMd(rp, JAM2);
-               SetAfPt(rp, OddCheck, 1);
-               break;
-      case 2 : SetAPen(rp, color >> 2);
-               SetBPen(rp, (color >> 2) + 1);
-               SetDrMd(rp, JAM2);
-               SetAfPt(rp, EvenCheck, 1);
-               break;
-      case 3 : SetAPen(rp, color >> 2);
-               SetBPen(rp, (color >> 2) + 1);
-               SetDrMd(rp, JAM2);
-               SetAfPt(rp, OddCheck, 1);
-               break;
+    for (k = 0; k < sections; k++) {
+        Gen_Flush(&out[k]);
+        FreeMem(out[k].Buf, GEN_BUFFER);
     }
+    if (close(out[0].File))
+        Quit("Error writing output file");
 
-/* Actually draw the face                             */
+    if (Verbose)
+        printf("Generated %s: %ld points, %ld faces\n",
+               fname, m.Points, m.Faces);
+}
 
-    AreaMove(rp,Points[0].X,Points[0].Y);
-    for (i = 1; i < pointnum; i++)
-        AreaDraw(rp, Points[i].X,Points[i].Y);
-    AreaEnd(rp);
+
+/* shade bench times each stage of drawing a frame on */
+/* its own, so a change to any one of them shows up   */
+/* clearly:                                           */
+/*                                                    */
+/*   load       reading the object and Prepare_Object */
+/*   view       OrbitCamera and Calculate_V           */
+/*   transform  Compute_Display_Coords                */
+/*   cull       Visible_Faces                         */
+/*   sort       SortFaces                             */
+/*   light      FaceColor (and Light_Vertices)        */
+/*   fill       ShowFace and DrawAll                  */
+/*                                                    */
+/* Each object is loaded and drawn BenchRuns times,   */
+/* each time BenchFrames frames spread round the      */
+/* orbit, and the mean and standard deviation are     */
+/* taken over the runs.  Nothing is written out.      */
+/* Without any files it uses the objects that come    */
+/* with Shade, if they're in the current directory,   */
+/* then spheres from Generate of each size in         */
+/* Bench_Spheres.                                     */
+
+#define BENCH_STAGES    7
+#define BENCH_LOAD      0
+#define BENCH_VIEW      1
+#define BENCH_TRANSFORM 2
+#define BENCH_CULL      3
+#define BENCH_SORT      4
+#define BENCH_LIGHT     5
+#define BENCH_FILL      6
+
+    char        *Bench_Names[BENCH_STAGES] = {
+                    "load", "view", "transform", "cull", "sort", "light",
+                    "fill" },
+                *Bench_Files[] = {
+                    "hemi.data", "2hemi.data", "sphere.data", "blimp.data",
+                    "prize.data", NULL };
+    long        Bench_Spheres[] = { 10000, 100000, 1000000, 0 };
+    long        BenchRuns = 5,
+                BenchFrames = 16;
+    char        *BenchSizes = NULL;
+
+
+/* Bench_Frame: draw frame n into fr the way          */
+/* RenderFrame would, adding the time each stage      */
+/* takes to Times.  Colors has room for a shade for   */
+/* every face.  A scene goes through the stages once  */
+/* for each instance.                                 */
+
+void Bench_Frame(Frame *fr, long n, double *Times, short *Colors)
+{
+    double      now,last;
+    long        i,k,visible;
+    Point_3D    From,V[3],Light;
+
+#define LAP(s)  (now = Seconds(), Times[s] += now - last, last = now)
+
+    last = Seconds();
+    OrbitCamera(fr, n);
+    Calculate_V(fr);
+    if (FixedPoint)
+        Fixed_View(fr);
+    From = fr->From;
+    Light = fr->Light;
+    memcpy(V, fr->V, sizeof(V));
+    if (InstanceCount)
+        Scene_Order(fr);
+    LAP(BENCH_VIEW);
+
+    SetRast(&fr->Buffer, 0);
+    LAP(BENCH_FILL);
+
+    for (k = 0; k < (InstanceCount ? InstanceCount : 1); k++) {
+        if (InstanceCount)
+            Instance_View(fr, &Instance_List[fr->Instances[k].face],
+                          From, V, Light);
+        else
+            Choose_Level(fr);
+        LAP(BENCH_VIEW);
+
+        Compute_Display_Coords(fr);
+        LAP(BENCH_TRANSFORM);
+
+        visible = Visible_Faces(fr);
+        LAP(BENCH_CULL);
+
+        if (!ZBuffer)
+            SortFaces(fr, visible);
+        LAP(BENCH_SORT);
+
+        if (Shading == SHADE_GOURAUD)
+            Light_Vertices(fr);
+        for (i = 0; i < visible; i++)
+            if (FixedPoint)
+                Colors[i] = Fixed_Color(fr, fr->Order[i].face);
+            else
+                Colors[i] = FaceColor(fr,
+                                      &fr->Detail->Data[fr->Order[i].face]);
+        LAP(BENCH_LIGHT);
+
+        for (i = 0; i < visible; i++)
+            if (Colors[i] >= 0)
+                ShowFace(fr, fr->Order[i].face, Colors[i]);
+        DrawAll(fr);
+        LAP(BENCH_FILL);
+    }
+
+#undef LAP
 }
 
 
-/* This function is used by the qsort() routine to    */
-/* sort the faces from farthest to nearest.           */
+/* Bench_Object: run the benchmark on fname, calling  */
+/* it name in the report.                             */
 
-int CompareFaces(Face *f1, Face *f2)
+void Bench_Object(char *fname, char *name)
 {
-    if (f1->distance < f2->distance)
-        return(1);
-    else
-        return(-1);
+    double      Times[BENCH_STAGES],Sum[BENCH_STAGES],Squares[BENCH_STAGES],
+                mean,sd,start,pixels,points,faces,per;
+    long        run,i,s;
+    short       *Colors;
+    UBYTE       *p;
+    char        item[32];
+
+    memset(Sum, 0, sizeof(Sum));
+    memset(Squares, 0, sizeof(Squares));
+    pixels = points = faces = 0.0;
+
+    for (run = 0; run < BenchRuns; run++) {
+        memset(Times, 0, sizeof(Times));
+
+        start = Seconds();
+        if (Is_Scene(fname)) {
+            Read_Scene(fname);
+            Scene_Defaults();
+        } else {
+            ReadObjectFile(fname);
+            Prepare_Object();
+        }
+        Times[BENCH_LOAD] = Seconds() - start;
+        points = TotalPoints;
+        faces  = TotalFaces;
+        if (InstanceCount)
+            for (points = faces = 0.0, i = 0; i < InstanceCount; i++) {
+                points += Instance_List[i].Object->TotalPoints;
+                faces  += Instance_List[i].Object->TotalFaces;
+            }
+
+        OpenFrames(1);
+        Colors = GetMemory(TotalFaces * sizeof(short));
+        for (i = 0; i < BenchFrames; i++) {
+            Bench_Frame(&Frame_List[0], i * 80 / BenchFrames, Times, Colors);
+            for (p = Frame_List[0].Buffer.Pixels;
+                 p < Frame_List[0].Buffer.Pixels + FRAME_PIXELS; p++)
+                pixels += (*p != 0);
+        }
+        FreeMem(Colors, TotalFaces * sizeof(short));
+        CloseFrames();
+        if (InstanceCount)
+            Free_Scene();
+        else
+            Free_Object();
+
+        for (s = 0; s < BENCH_STAGES; s++) {
+            if (s != BENCH_LOAD)
+                Times[s] /= BenchFrames;
+            Sum[s]     += Times[s];
+            Squares[s] += Times[s] * Times[s];
+        }
+    }
+
+    printf("%s: %.0f points, %.0f faces, %ldx%ld, %ld runs of %ld frames\n",
+           name, points, faces, MAXX, MAXY, BenchRuns, BenchFrames);
+    printf("    %-10s %12s %10s\n", "stage", "ms/frame", "sd");
+
+    for (s = 0; s <= BENCH_STAGES; s++) {
+        if (s < BENCH_STAGES) {
+            mean = Sum[s] / BenchRuns;
+            sd   = Squares[s] / BenchRuns - mean * mean;
+        } else {
+            for (mean = sd = 0.0, i = BENCH_VIEW; i < BENCH_STAGES; i++) {
+                mean += Sum[i] / BenchRuns;
+                sd   += Squares[i] / BenchRuns -
+                        (Sum[i] / BenchRuns) * (Sum[i] / BenchRuns);
+            }
+        }
+        sd = (sd > 0.0) ? sqrt(sd) : 0.0;
+
+        item[0] = '\0';
+        per = (s == BENCH_TRANSFORM) ? points : faces;
+        if (s == BENCH_FILL)
+            snprintf(item, sizeof(item), "%.1f Mpixels/s", mean > 0.0 ?
+                     pixels / (BenchRuns * BenchFrames) / mean / 1e6 : 0.0);
+        else if (s == BENCH_STAGES)
+            snprintf(item, sizeof(item), "%.1f frames/s",
+                     mean > 0.0 ? 1.0 / mean : 0.0);
+        else if (s != BENCH_VIEW)
+            snprintf(item, sizeof(item), "%.1f ns/%s", mean * 1e9 / per,
+                     (s == BENCH_TRANSFORM) ? "vertex" : "face");
+
+        printf("    %-10s %12.3f %10.3f%s%s\n",
+               (s < BENCH_STAGES) ? Bench_Names[s] : "total",
+               mean * 1000.0, sd * 1000.0, item[0] ? "   " : "", item);
+    }
+    printf("    (load is per run, not per frame; total leaves it out)\n\n");
 }
 
-/* Display the object.  For each face, make sure the  */
-/* viewer can see it.  Then figure out the color, and */
-/* call ShowFace.                                     */
 
-void ShowObject()
+/* Bench_Sizes: run the benchmark on fname at each of */
+/* the screen sizes in BenchSizes, or just the one    */
+/* if there's no list.                                */
+
+void Bench_Sizes(char *fname, char *name)
 {
-    short       i,count;
-    Point_3D    Centroid,V1,V2,
-                Normal,Back,L,Reflection;
-    float       rcount,CenterDot,ReflectDot;
+    char        *spec = BenchSizes;
 
-    for (i=0; i<TotalFaces; i++) {
+    if (!spec) {
+        Bench_Object(fname, name);
+        return;
+    }
+    while (*spec) {
+        Set_Screen(&spec, PixelAspect);
+        Bench_Object(fname, name);
+    }
+}
 
-/* Calculate the distance from the midpoint to From   */
 
-        Centroid.X = Centroid.Y = Centroid.Z = 0.0;
-        for (count = Face_List[i].start;
-             count <= Face_List[i].end;
-             count++)
-            Minus(Centroid,
-               World_Data[Connections[count]],&Centroid);
-        rcount = (float)
-           ((Face_List[i].start - Face_List[i].end) - 1);
+/* Bench: run the benchmark on the count files in     */
+/* Files, or the standard set if there are none.      */
 
-        Centroid.X /= rcount;
-        Centroid.Y /= rcount;
-        Centroid.Z /= rcount;
+void Bench(char **Files, long count)
+{
+    char        name[64],temp[64];
+    long        i;
+    int         fd;
 
-        Minus(From,Centroid,&Back);
+    if (count) {
+        for (i = 0; i < count; i++)
+            Bench_Sizes(Files[i], Files[i]);
+        return;
+    }
 
-        Face_List[i].distance = DotProduct(Back,Back);
+    for (i = 0; Bench_Files[i]; i++)
+        if (access(Bench_Files[i], R_OK) == 0)
+            Bench_Sizes(Bench_Files[i], Bench_Files[i]);
+
+    for (i = 0; Bench_Spheres[i]; i++) {
+        strcpy(temp, "/tmp/shadeXXXXXX");
+        if ((fd = mkstemp(temp)) < 0)
+            Quit("Can't write a sphere to benchmark");
+        close(fd);
+        Generate(temp, GEN_SPHERE, Bench_Spheres[i], 1);
+        snprintf(name, sizeof(name), "sphere of %ld faces", Bench_Spheres[i]);
+        Bench_Sizes(temp, name);
+        unlink(temp);
     }
+}
 
-/* Sort all the faces, farthest to nearest.           */
 
-    qsort(Face_List,TotalFaces,sizeof(Face),CompareFaces);
+/* shade serve keeps running, drawing pictures for    */
+/* whoever asks through a Unix socket, so a caller    */
+/* that wants a great many small ones doesn't pay     */
+/* for starting Shade and reading the object each     */
+/* time.  A request is one line:                      */
+/*                                                    */
+/*   render File [from X Y Z] [at X Y Z] [up X Y Z]   */
+/*               [light X Y Z] [size WxH] [png]       */
+/*                                                    */
+/* and the answer is "OK n" and a newline, then the n */
+/* bytes of the picture as a PPM, or a PNG if asked   */
+/* for, or "ERROR" and what went wrong.  The points   */
+/* are in the units of the object file.  Whatever     */
+/* isn't given is as the first frame of the orbit     */
+/* would have it.  A connection can send as many      */
+/* requests as it likes, one after another, and they  */
+/* are answered in turn.                              */
+/*                                                    */
+/* The objects are kept, got ready to draw, in        */
+/* Mesh_Cache, up to CacheSize of them; when it's     */
+/* full the one used longest ago makes way.  An       */
+/* object is read again if its file has changed,      */
+/* which is to say the device, inode, size or time    */
+/* it was last changed are different.  Each one is    */
+/* drawn as a scene of one instance that leaves it    */
+/* where it is.                                       */
+
+#define SERVE_CACHE     16
+#define SERVE_LINE      4096
 
-/* Draw all the faces pointed toward us.  First,      */
-/* recalculate the center of the face.                */
+    typedef struct {
+        Mesh        Object;
+        char        Path[SERVE_LINE];
+        dev_t       Device;
+        ino_t       Inode;
+        off_t       Size;
+        time_t      Changed;
+        long        Used;
+    } Cache_Entry;
+
+    Cache_Entry *Mesh_Cache = NULL;
+    long        CacheSize = SERVE_CACHE,
+                CacheClock = 0;
+    ULONG       PNG_CRC[256];
+
+/* Serve_Client: one of the SERVE_CLIENTS open        */
+/* connections, or a free place for one if Socket is  */
+/* -1.  Line holds Used bytes read from it and not    */
+/* yet answered.  Skipping is set while the rest of a */
+/* line too long for Line is thrown away.  A client   */
+/* that won't take its answer for SERVE_WAIT seconds  */
+/* is dropped, rather than hold up the rest.          */
+
+#define SERVE_CLIENTS   64
+#define SERVE_WAIT      5
 
-    for (i=0; i<TotalFaces; i++) {
+    typedef struct {
+        int         Socket;
+        long        Used;
+        short       Skipping;
+        char        Line[SERVE_LINE];
+    } Serve_Client;
 
-        Centroid.X = Centroid.Y = Centroid.Z = 0.0;
-        for (count = Face_List[i].start;
-             count <= Face_List[i].end;
-             count++)
-            Minus(Centroid,
-               World_Data[Connections[count]],&Centroid);
-        rcount = (float)
-           ((Face_List[i].start - Face_List[i].end) - 1);
 
-        Centroid.X /= rcount;
-        Centroid.Y /= rcount;
-        Centroid.Z /= rcount;
+/* Cache_Drop: free entry e, if it holds anything.    */
+
+void Cache_Drop(Cache_Entry *e)
+{
+    if (!e->Used)
+        return;
+    Use_Mesh(&e->Object);
+    Free_Object();
+    e->Used = 0;
+}
 
 
-/* Calculate the unit outer normal of the face, i.e   */
-/* a vector 1 unit long that is perpendicular to the  */
-/* face, and pointing outward.                        */
+/* Cache_Mesh: the object in fname, from the cache or */
+/* read in afresh.                                    */
 
+Mesh *Cache_Mesh(char *fname)
+{
+    struct stat info;
+    Cache_Entry *e,*oldest;
+    long        i;
 
-        count = Face_List[i].start;
+    if (stat(fname, &info))
+        Quit("Could not open input file");
 
-        /* V1 = P3 - P1 */
+    oldest = &Mesh_Cache[0];
+    for (i = 0; i < CacheSize; i++) {
+        e = &Mesh_Cache[i];
+        if (e->Used && !strcmp(e->Path, fname)) {
+            if (e->Device == info.st_dev && e->Inode == info.st_ino &&
+                e->Size == info.st_size && e->Changed == info.st_mtime) {
+                e->Used = ++CacheClock;
+                return (&e->Object);
+            }
+            oldest = e;
+            break;
+        }
+        if (e->Used < oldest->Used)
+            oldest = e;
+    }
 
-        Minus(World_Data[Connections[count+2]],
-              World_Data[Connections[count]],&V1);
+    e = oldest;
+    Cache_Drop(e);
+
+    MaxFaceSize = 0;
+    ReadObjectFile(fname);
+    Prepare_Mesh();
+    Keep_Mesh(&e->Object);
+
+    strcpy(e->Path, fname);
+    e->Device  = info.st_dev;
+    e->Inode   = info.st_ino;
+    e->Size    = info.st_size;
+    e->Changed = info.st_mtime;
+    e->Used    = ++CacheClock;
+    return (&e->Object);
+}
 
-        /* V2 = P2 - P1 */
 
-        Minus(World_Data[Connections[count+1]],
-              World_Data[Connections[count]],&V2);
+/* PNG_Put32: put n into p, high byte first.          */
 
-        CrossProduct(V2,V1,&Normal);
-        Normalize(&Normal);
+void PNG_Put32(UBYTE *p, ULONG n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
 
-/* Calculate the unit Back vector, which is a vector  */
-/* 1 unit long that points from the middle of the     */
-/* face toward the From point.                        */
 
+/* PNG_Chunk: finish off the chunk of length bytes    */
+/* whose type is at p, putting the length before it   */
+/* and the CRC after, and return where the next one   */
+/* goes.                                              */
 
-        Minus(From,Centroid,&Back);
-        Normalize(&Back);
+UBYTE *PNG_Chunk(UBYTE *p, long length)
+{
+    ULONG       crc = 0xFFFFFFFF;
+    long        i;
+
+    PNG_Put32(p - 4, length);
+    for (i = 0; i < length + 4; i++)
+        crc = PNG_CRC[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    PNG_Put32(p + length + 4, crc ^ 0xFFFFFFFF);
+    return (p + length + 12);
+}
 
-/* If the polygon faces us, figure out the correct    */
-/* color and draw it.  The dot product of two unit    */
-/* vectors is the cosine of the angle between them,   */
-/* and cosines of angles > 90 degrees are less than   */
-/* zero (well, this is all obvious, isn't it?), so    */
-/* if the dot product of the normal and the back      */
-/* vectors is less than zero, the face is pointing    */
-/* away from us.                                      */
 
+/* Encode: f as a PPM, or a PNG if png is set, in     */
+/* memory of its own; its size goes in *length.  The  */
+/* PNG isn't compressed at all, its pixels going out  */
+/* in stored deflate blocks, which costs nothing to   */
+/* make and any reader can take.                      */
 
+#define PNG_BLOCK       65535
 
-        if (DotProduct(Normal,Back) > 0) {
-            Minus(Light,Centroid,&L);
-            Normalize(&L);
-            CenterDot = DotProduct(Normal,L);
-            if (CenterDot < 0.0)
-                CenterDot = 0.0;
+UBYTE *Encode(FrameBuffer *f, short png, long *length)
+{
+    UBYTE       *image,*p,*rows,*pixel;
+    long        x,y,header,raw,blocks,left,n;
+    ULONG       a,b;
+
+    raw = (long) f->Height * (f->Width * 3 + (png ? 1 : 0));
+    blocks = (raw + PNG_BLOCK - 1) / PNG_BLOCK;
+    header = png ? 8 + 25 + 12 + 2 : 32;
+    *length = header + raw + (png ? 5 * blocks + 4 + 12 : 0);
+    image = GetMemory(*length + raw + f->Width);
+
+/* The rows go in after the picture, in its spare     */
+/* room, and are copied into place from there.        */
+
+    rows = image + *length;
+    pixel = rows + raw;
+    p = rows;
+    for (y = 0; y < f->Height; y++) {
+        if (png)
+            *p++ = 0;
+        Frame_Row(f, y, pixel);
+        for (x = 0; x < f->Width; x++) {
+            *p++ = pixel[x];
+            *p++ = 0;
+            *p++ = 0;
+        }
+    }
 
+    if (!png) {
+        header = sprintf((char *) image, "P6\n%d %d\n255\n",
+                         f->Width, f->Height);
+        memmove(image + header, rows, raw);
+        *length = header + raw;
+        return (image);
+    }
 
-/* The specular part doesn't make much of a           */
-/* contribution in the best of times, so since it     */
-/* takes a while to calculate I've skipped it.        */
+    memcpy(image, "\211PNG\r\n\032\n", 8);
+    p = image + 12;
+    memcpy(p, "IHDR", 4);
+    PNG_Put32(p + 4, f->Width);
+    PNG_Put32(p + 8, f->Height);
+    p[12] = 8;
+    p[13] = 2;
+    p[14] = p[15] = p[16] = 0;
+    p = PNG_Chunk(p, 13);
+
+    memcpy(p, "IDAT", 4);
+    p[4] = 0x78;
+    p[5] = 0x01;
+    pixel = p + 6;
+    a = 1;
+    b = 0;
+    for (left = raw; left > 0; left -= n) {
+        n = (left < PNG_BLOCK) ? left : PNG_BLOCK;
+        pixel[0] = (left == n);
+        pixel[1] = n;
+        pixel[2] = n >> 8;
+        pixel[3] = ~n;
+        pixel[4] = ~n >> 8;
+        memcpy(pixel + 5, rows, n);
+        for (x = 0; x < n; x++) {
+            a = (a + rows[x]) % 65521;
+            b = (b + a) % 65521;
+        }
+        rows += n;
+        pixel += n + 5;
+    }
+    PNG_Put32(pixel, (b << 16) | a);
+    p = PNG_Chunk(p, pixel + 4 - (p + 4));
 
+    memcpy(p, "IEND", 4);
+    PNG_Chunk(p, 0);
+    return (image);
+}
 
-/*          Reflection = Normal;
-            Reflection.X *= 2.0 * CenterDot;
-            Reflection.Y *= 2.0 * CenterDot;
-            Reflection.Z *= 2.0 * CenterDot;
-            Minus(L,Reflection,&Reflection);
-            ReflectDot = DotProduct(Reflection,Back);
-            if (ReflectDot < 0.0)
-                ReflectDot = 0.0;                     */
 
+/* Serve_Send: send all length bytes of data, or      */
+/* return 0 if the caller has gone.                   */
 
-            count = (short) ((Ambient +
-                              Diffuse * CenterDot 
-          /*  + Specular * fpow(ReflectDot,Sharpness) */
-                              ) * 61.0);
-            if (count > 60)
-                count = 60;
-            ShowFace(i,count);
-        }
+short Serve_Send(int client, void *data, long length)
+{
+    ssize_t     done;
+    char        *p = data;
+
+    while (length > 0) {
+        if ((done = write(client, p, length)) <= 0)
+            return (0);
+        p += done;
+        length -= done;
     }
+    return (1);
 }
 
 
-/* Calculate the transformation matrix V.  This       */
-/* matrix depends on the From and At points as well   */
-/* as the UP vector.  As long as none of these change,*/
-/* you don't have to recalculate V.                   */
+/* Serve_Point: read the three numbers after a word   */
+/* of a request into *P, returning 0 if they aren't   */
+/* there.                                             */
 
-void Calculate_V()
+short Serve_Point(Point_3D *P)
 {
-    Point_3D  a,b,c;
+    char        *x,*y,*z;
+
+    if (!(x = strtok(NULL, " \t\r\n")) || !(y = strtok(NULL, " \t\r\n")) ||
+        !(z = strtok(NULL, " \t\r\n")))
+        return (0);
+    P->X = atof(x) / 10000.0;
+    P->Y = atof(y) / 10000.0;
+    P->Z = atof(z) / 10000.0;
+    return (1);
+}
 
-    Minus(At, From, &c);
-    Normalize(&c);
 
-    CrossProduct(c, UP, &a);
-    Normalize(&a);
+/* Serve_Request: answer the request in line.         */
+/* Returns 0 if the caller has gone.                  */
 
-    CrossProduct(a,c,&b);
+    Instance    Serve_Instance = { NULL, { 0.0, 0.0, 0.0 },
+                                   { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 },
+                                     { 0.0, 0.0, 1.0 } }, 1.0 };
 
-    V[0].X = a.X;
-    V[1].X = a.Y;
-    V[2].X = a.Z;
+short Serve_Request(int client, char *line)
+{
+    jmp_buf     jump;
+    char        *word,*fname,*size,reply[256];
+    Point_3D    Asked[4];
+    short       given[4],png,sent;
+    long        i,length;
+    double      start;
+    UBYTE       *image;
+    Mesh        *m;
+    Frame       *fr;
+
+    start = Seconds();
+    if (setjmp(jump)) {
+        QuitJump = NULL;
+        Instance_List = NULL;
+        InstanceCount = 0;
+        snprintf(reply, sizeof(reply), "ERROR %s\n", QuitMessage);
+        return (Serve_Send(client, reply, strlen(reply)));
+    }
 
-    V[0].Y = b.X;
-    V[1].Y = b.Y;
-    V[2].Y = b.Z;
+    if (!(word = strtok(line, " \t\r\n")) || strcmp(word, "render") ||
+        !(word = strtok(NULL, " \t\r\n"))) {
+        strcpy(reply, "ERROR Bad request\n");
+        return (Serve_Send(client, reply, strlen(reply)));
+    }
 
-    V[0].Z = c.X;
-    V[1].Z = c.Y;
-    V[2].Z = c.Z;
+    QuitJump = &jump;
+    fname = word;
+    m = Cache_Mesh(fname);
+
+    size = NULL;
+    png = 0;
+    given[0] = given[1] = given[2] = given[3] = 0;
+    while ((word = strtok(NULL, " \t\r\n"))) {
+        i = !strcmp(word, "from")  ? 0 : !strcmp(word, "at")    ? 1 :
+            !strcmp(word, "up")    ? 2 : !strcmp(word, "light") ? 3 : -1;
+        if (i >= 0) {
+            if (!Serve_Point(&Asked[i]))
+                Quit("Bad request");
+            given[i] = 1;
+        } else if (!strcmp(word, "size") &&
+                   (size = strtok(NULL, " \t\r\n"))) {
+            if (!Set_Screen(&size, PixelAspect) || *size)
+                Quit(BAD_PARAM);
+        } else if (!strcmp(word, "png"))
+            png = 1;
+        else
+            Quit("Bad request");
+    }
+
+    Aim_Camera(m->Min.X, m->Max.X, m->Min.Y, m->Max.Y, m->Min.Z, m->Max.Z);
+    if (given[0])
+        From = Asked[0];
+    if (given[1])
+        At = Asked[1];
+    if (given[2])
+        UP = Asked[2];
+    if (given[3])
+        Light = Asked[3];
+    ChooseShader();
+
+    Serve_Instance.Object = m;
+    Instance_List = &Serve_Instance;
+    InstanceCount = 1;
+    TotalPoints = m->TotalPoints;
+    TotalFaces  = m->TotalFaces;
+    MaxFaceSize = m->MaxFaceSize;
+
+    OpenFrames(1);
+    fr = &Frame_List[0];
+    fr->Number = 0;
+    fr->From = From;
+    fr->Light = Light;
+    SetRast(&fr->Buffer, 0);
+    Show_Scene(fr);
+    image = Encode(&fr->Buffer, png, &length);
+    CloseFrames();
+
+    QuitJump = NULL;
+    Instance_List = NULL;
+    InstanceCount = 0;
+
+    snprintf(reply, sizeof(reply), "OK %ld\n", length);
+    sent = Serve_Send(client, reply, strlen(reply)) &&
+           Serve_Send(client, image, length);
+    FreeMem(image, length);
+
+    if (Verbose)
+        printf("%s %dx%d: %ld bytes in %.3f ms\n", fname,
+               (int) MAXX, (int) MAXY, length, (Seconds() - start) * 1000.0);
+    return (sent);
 }
 
 
+/* Serve_Waiting: whether c has a whole line waiting  */
+/* to be answered.                                    */
 
-/* Calculate each of the display coordinates from the */
-/* world coordinates, by way of the view coordinates. */
+char *Serve_Waiting(Serve_Client *c)
+{
+    if (c->Skipping)
+        return (NULL);
+    return (memchr(c->Line, '\n', c->Used));
+}
 
-void Compute_Display_Coords()
+
+/* Serve_Read: read whatever has come on c.  It's     */
+/* only called when there isn't a whole line waiting  */
+/* already, so if Line fills up the line is too long, */
+/* and the rest of it is thrown away as it comes.     */
+/* Once its end turns up it's answered with a single  */
+/* ERROR.  Returns 0 if the client has gone.          */
+
+short Serve_Read(Serve_Client *c)
 {
-    short       i;
-    Point_3D    View_Point;
-
-    for (i=0; i<TotalPoints; i++) {
-        Minus(World_Data[i],From,&View_Point);
-        VectorMatrix(View_Point,V,&View_Point);
-
-        if (View_Point.Z > 0.0) {
-            Display[i].X = HALFX + (short)
-                ((View_Point.X / View_Point.Z) * MultX);
-            Display[i].Y = HALFY - (short)
-                ((View_Point.Y / View_Point.Z) * MultY);
-            Display[i].Z = 1;
-        } else
-            Display[i].Z = -1;
+    ssize_t     got;
+    char        *end;
+
+    got = read(c->Socket, c->Line + c->Used, SERVE_LINE - 1 - c->Used);
+    if (got <= 0)
+        return (0);
+    c->Used += got;
+
+    if (c->Skipping) {
+        if (!(end = memchr(c->Line, '\n', c->Used))) {
+            c->Used = 0;
+            return (1);
+        }
+        c->Used -= end + 1 - c->Line;
+        memmove(c->Line, end + 1, c->Used);
+        c->Skipping = 0;
+        return (Serve_Send(c->Socket, "ERROR Bad request\n", 18));
+    }
+
+    if (c->Used == SERVE_LINE - 1 && !Serve_Waiting(c)) {
+        c->Skipping = 1;
+        c->Used = 0;
     }
+    return (1);
 }
 
 
+/* Serve_Line: answer the first line waiting on c, if */
+/* there is one.  Returns 0 if the client has gone.   */
 
-/* Calculate everything we need to display the object */
+short Serve_Line(Serve_Client *c)
+{
+    char        *end;
+    short       sent;
+
+    if (!(end = Serve_Waiting(c)))
+        return (1);
+    *end = '\0';
+    sent = Serve_Request(c->Socket, c->Line);
+    c->Used -= end + 1 - c->Line;
+    memmove(c->Line, end + 1, c->Used);
+    return (sent);
+}
+
+
+/* Serve: answer requests on the socket at path until */
+/* killed.  Each time round, every client with a line */
+/* waiting gets that one line answered, and then poll */
+/* says which sockets have more to read; it doesn't   */
+/* wait at all if there are lines still waiting.  A   */
+/* new connection is only taken when there's room for */
+/* it.  The screen size the options gave is put back  */
+/* after each request.                                */
 
-void CalculateDisplay()
+void Serve(char *path)
 {
-    Calculate_V();
+    struct sockaddr_un addr;
+    struct pollfd fds[SERVE_CLIENTS + 1];
+    struct timeval wait;
+    int         server,client;
+    long        i,k,n,width,height,count,waiting,which[SERVE_CLIENTS + 1];
+    double      aspect;
+    ULONG       crc;
+    Serve_Client *Clients,*c;
+
+    for (i = 0; i < 256; i++) {
+        for (crc = i, k = 0; k < 8; k++)
+            crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        PNG_CRC[i] = crc;
+    }
 
-    Compute_Display_Coords();
-}
+    Mesh_Cache = GetMemory(CacheSize * sizeof(Cache_Entry));
+    memset(Mesh_Cache, 0, CacheSize * sizeof(Cache_Entry));
+    width  = ScreenWidth;
+    height = ScreenHeight;
+    aspect = ScreenAspect;
+
+    Clients = GetMemory(SERVE_CLIENTS * sizeof(Serve_Client));
+    for (i = 0; i < SERVE_CLIENTS; i++)
+        Clients[i].Socket = -1;
+    count = 0;
+    wait.tv_sec  = SERVE_WAIT;
+    wait.tv_usec = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        Quit(BAD_PARAM);
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(server, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(server, 16))
+        Quit("Could not open the socket");
+    signal(SIGPIPE, SIG_IGN);
+
+    if (Verbose)
+        printf("Serving on %s\n", path);
+    fflush(stdout);
+
+    for (;;) {
+        n = waiting = 0;
+        if (count < SERVE_CLIENTS) {
+            fds[n].fd = server;
+            fds[n++].events = POLLIN;
+        }
+        for (i = 0; i < SERVE_CLIENTS; i++) {
+            if ((c = &Clients[i])->Socket < 0)
+                continue;
+            which[n] = i;
+            fds[n].fd = c->Socket;
+            if (Serve_Waiting(c)) {
+                fds[n++].events = 0;
+                waiting = 1;
+            } else
+                fds[n++].events = POLLIN;
+        }
+        if (poll(fds, n, waiting ? 0 : -1) < 0)
+            continue;
+
+        for (k = 0; k < n; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (fds[k].fd == server) {
+                if ((client = accept(server, NULL, NULL)) < 0)
+                    continue;
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &wait,
+                           sizeof(wait));
+                for (i = 0; Clients[i].Socket >= 0; i++)
+                    ;
+                Clients[i].Socket = client;
+                Clients[i].Used = Clients[i].Skipping = 0;
+                count++;
+            } else if (fds[k].events && !Serve_Read(&Clients[which[k]])) {
+                close(fds[k].fd);
+                Clients[which[k]].Socket = -1;
+                count--;
+            }
+        }
 
+        for (i = 0; i < SERVE_CLIENTS; i++) {
+            if ((c = &Clients[i])->Socket < 0)
+                continue;
+            if (!Serve_Line(c)) {
+                close(c->Socket);
+                c->Socket = -1;
+                count--;
+            }
+            ScreenWidth  = width;
+            ScreenHeight = height;
+            ScreenAspect = aspect;
+            fflush(stdout);
+        }
+    }
+}
 
 
-/* Main.  Set up some default values, then draw the   */
-/* object as the From point moves around.             */
+/* Main, headless version.  Read the options, then    */
+/* render the requested number of frames of the same  */
+/* orbit the Amiga version shows, writing each one    */
+/* to its own file.  Normally the frames are drawn    */
+/* one after another with every thread working on     */
+/* the same frame; in batch mode each thread draws    */
+/* whole frames on its own.                           */
 
-main(int argc, char *argv[])
+int main(int argc, char *argv[])
 {
-
     long  i;
-    long  quitsignal;
-    long  start,end;
-
-    if (argc < 2)
-        Quit("Usage: 3d objectfile");
+    long  bench = 0,
+          benchcount = 0,
+          framesgiven = 0;
+    char  *fname = NULL,
+          *meshname = NULL,
+          **benchfiles = NULL,
+          *genargs[3],
+          batchname[1024];
+    short shape;
+    long  generate = 0,
+          gencount = 0,
+          serve = 0;
+    uint64_t seed = 1;
+    char  *size = NULL;
+    double sorttime,sorted;
+    struct rusage usage;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+            if ((FrameCount = atol(argv[++i])) < 1)
+                Quit(BAD_PARAM);
+            framesgiven = 1;
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+            if ((BenchRuns = atol(argv[++i])) < 1)
+                Quit(BAD_PARAM);
+        } else if (!strcmp(argv[i], "-cache") && i + 1 < argc) {
+            if ((CacheSize = atol(argv[++i])) < 1)
+                Quit(BAD_PARAM);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            OutputName = argv[++i];
+        else if (!strcmp(argv[i], "-batch") && i + 1 < argc)
+            BatchDir = argv[++i];
+        else if (!strcmp(argv[i], "-raw"))
+            RawOutput = 1;
+        else if (!strcmp(argv[i], "-video") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "y4m"))
+                VideoFormat = VIDEO_Y4M;
+            else if (!strcmp(argv[i], "rgb"))
+                VideoFormat = VIDEO_RGB;
+            else
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "-size") && i + 1 < argc)
+            size = argv[++i];
+        else if (!strcmp(argv[i], "-aspect") && i + 1 < argc) {
+            if ((PixelAspect = atof(argv[++i])) <= 0.0)
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "-zbuffer"))
+            ZBuffer = 1;
+        else if (!strcmp(argv[i], "-nosimd"))
+            UseSIMD = 0;
+        else if (!strcmp(argv[i], "-nopipeline"))
+            Pipelining = 0;
+        else if (!strcmp(argv[i], "-v"))
+            Verbose = 1;
+        else if (!strcmp(argv[i], "-stream"))
+            Streaming = 1;
+        else if (!strcmp(argv[i], "-nocull"))
+            Culling = 0;
+        else if (!strcmp(argv[i], "-lod"))
+            LevelOfDetail = 1;
+        else if (!strcmp(argv[i], "-optimize"))
+            Optimizing = 1;
+        else if (!strcmp(argv[i], "-fixed"))
+            FixedPoint = 1;
+        else if (!strcmp(argv[i], "-shading") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "flat"))
+                Shading = SHADE_FLAT;
+            else if (!strcmp(argv[i], "phong"))
+                Shading = SHADE_PHONG;
+            else if (!strcmp(argv[i], "gouraud"))
+                Shading = SHADE_GOURAUD;
+            else
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "-sort") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "qsort"))
+                SortMethod = SORT_QSORT;
+            else if (!strcmp(argv[i], "radix"))
+                SortMethod = SORT_RADIX;
+            else
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "-memcap") && i + 1 < argc) {
+            if ((MemCap = atol(argv[++i]) << 20) < 1)
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            if ((Threads = atol(argv[++i])) < 1)
+                Quit(BAD_PARAM);
+        }
+        else if (!strcmp(argv[i], "compile") && i + 2 < argc && !fname) {
+            fname = argv[++i];
+            meshname = argv[++i];
+        }
+        else if (!strcmp(argv[i], "bench") && !bench && !generate && !fname) {
+            bench = 1;
+            benchfiles = GetMemory(argc * sizeof(char *));
+        }
+        else if (!strcmp(argv[i], "generate") && !bench && !generate && !fname)
+            generate = 1;
+        else if (!strcmp(argv[i], "serve") && !bench && !generate && !fname)
+            serve = 1;
+        else if (argv[i][0] == '-' || fname || gencount == 3)
+            Quit(USAGE);
+        else if (generate)
+            genargs[gencount++] = argv[i];
+        else if (bench)
+            benchfiles[benchcount++] = argv[i];
+        else
+            fname = argv[i];
+    }
 
-    if (!(IntuitionBase = (void *)
-            OpenLibrary("intuition.library",0L)))
-        Quit("No Intuition");
+    if (generate) {
+        if (gencount < 3)
+            Quit(USAGE);
+        for (shape = 0; shape < GEN_SHAPES; shape++)
+            if (!strcmp(genargs[0], Gen_Names[shape]))
+                break;
+        if (shape == GEN_SHAPES)
+            Quit(BAD_PARAM);
+        Generate(genargs[2], shape, (long) strtod(genargs[1], NULL), seed);
+        return (0);
+    }
 
-    if (!(GfxBase = (void *)
-            OpenLibrary("graphics.library",0L)))
-        Quit("No Graphics");
+    if (!fname && !bench)
+        Quit(USAGE);
+
+    if (!PixelAspect)
+        PixelAspect = size ? 1.0 : PIXEL_ASPECT;
+    if (bench)
+        BenchSizes = size;
+    if (!size)
+        size = "640x400";
+    do {
+        if (!Set_Screen(&size, PixelAspect))
+            Quit(BAD_PARAM);
+    } while (*size && bench);
+    if (*size)
+        Quit(BAD_PARAM);
+    if (bench && (meshname || BatchDir || Streaming || VideoFormat))
+        Quit(USAGE);
+    if (VideoFormat && (meshname || BatchDir))
+        Quit(USAGE);
+    if (serve && (meshname || BatchDir || Streaming || FixedPoint ||
+                  VideoFormat))
+        Quit(USAGE);
+
+    if (!OutputName)
+        OutputName = VideoFormat ? "-" :
+                     RawOutput ? "frame%04d.raw" : "frame%04d.ppm";
+    if (VideoFormat && !bench)
+        Open_Video();
+
+    if (Streaming && (BatchDir || LevelOfDetail || Optimizing ||
+                      Shading != SHADE_FLAT))
+        Quit(USAGE);
+    if (FixedPoint && (Streaming || LevelOfDetail || Shading != SHADE_FLAT))
+        Quit(USAGE);
+
+    if (BatchDir) {
+        mkdir(BatchDir, 0777);
+        snprintf(batchname, sizeof(batchname), "%s/%s",
+                 BatchDir, OutputName);
+        OutputName = batchname;
+    }
 
-    OpenDisplay();
+    if (FixedPoint)
+        Transform_Points = Transform_Fixed;
+    else if (UseSIMD)
+        ChooseTransform();
 
-    ReadObjectFile(argv[1]);
+    if (!Threads)
+        Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (Threads > 1)
+        StartThreads(Threads);
 
-    SetDefaults();
+    if (serve) {
+        Pipelining = 0;
+        Serve(fname);
+    }
 
-/* The program will quit if we get any IDCMP          */
-/* messages from either window.                       */
+    if (bench) {
+        Pipelining = 0;
+        if (framesgiven)
+            BenchFrames = FrameCount;
+        Bench(benchfiles, benchcount);
+        FreeMem(benchfiles, argc * sizeof(char *));
+        if (PoolSize)
+            StopThreads();
+        return (0);
+    }
 
-    quitsignal =(1 << window1->UserPort->mp_SigBit) |
-                (1 << window2->UserPort->mp_SigBit);
+    if (Is_Scene(fname)) {
+        if (meshname || Streaming || FixedPoint)
+            Quit(USAGE);
+        Read_Scene(fname);
+    } else
+        ReadObjectFile(fname);
 
-    while (!(SetSignal(0,0) & quitsignal)) {
+    if (BatchDir || Streaming || InstanceCount || Threads < 2 ||
+        FrameCount < 2)
+        Pipelining = 0;
 
-        CalculateDisplay();
-        SetRast(rp, 0);
-        ShowObject();
-        SwapBuffers();
+    if (meshname) {
+        if (Optimizing)
+            Optimize_Mesh();
+        WriteMeshFile(meshname);
+    } else {
+        if (Streaming) {
+            OpenStream();
+            SetDefaults();
+            ChooseShader();
+        } else if (InstanceCount)
+            Scene_Defaults();
+        else
+            Prepare_Object();
+
+        if (BatchDir) {
+            OpenFrames(PoolSize + 1);
+            RunJobs(BatchFrame, NULL, FrameCount);
+        } else if (Pipelining) {
+            OpenFrames(PIPE_FRAMES);
+            Pipeline();
+        } else {
+            OpenFrames(1);
+            for (i = 0; i < FrameCount; i++)
+                RenderFrame(&Frame_List[0], i);
+        }
+        if (VideoFormat)
+            Close_Video();
+        if (Verbose && !ZBuffer) {
+            sorttime = sorted = 0.0;
+            for (i = 0; i < FrameSlots; i++) {
+                sorttime += Frame_List[i].SortTime;
+                sorted   += Frame_List[i].SortedFaces;
+            }
+            printf("Sorted %.0f faces a frame in %.3f ms\n",
+                   sorted / FrameCount, sorttime * 1000.0 / FrameCount);
+        }
+        CloseFrames();
+    }
 
-        RotateZ(From,At,(PI / 40.0),&From);
+    if (Streaming && Verbose) {
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Streamed %ld connections at a time; peak memory %.1f MB",
+               StreamSlots, usage.ru_maxrss / 1024.0);
+        if (MemCap)
+            printf(" of %ld MB allowed", MemCap >> 20);
+        printf("\n");
     }
 
-    FreeRaster(RasterBuffer1,MAXX,MAXY);
-    FreeRaster(RasterBuffer2,MAXX,MAXY);
-    FreeMem(Display,TotalPoints*sizeof(Display_Point));
-    FreeMem(World_Data,TotalPoints*sizeof(Point_3D));
-    FreeMem(Face_List,(TotalFaces+1)*sizeof(Face));
-    FreeMem(Connections,ConnectLen*sizeof(short));
+    if (PoolSize)
+        StopThreads();
 
-    CloseWindow(window1);
-    CloseScreen(screen1);
-    CloseWindow(window2);
-    CloseScreen(screen2);
+    if (InstanceCount)
+        Free_Scene();
+    else
+        Free_Object();
 
-    CloseLibrary(IntuitionBase);
-    CloseLibrary(GfxBase);
+    return (0);
 }
+
+#endif